@@ -18,15 +18,30 @@
  */
 #include <stdio.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/file.h>
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/perf_event.h>
 #include <linux/types.h>
 #include <linux/socket.h>
 #include <linux/irda.h>
@@ -38,6 +53,252 @@ static int axn500_debug;
 			fflush(stdout); \
 		} \
 	} while(0)
+
+/*
+ * Tracing
+ *
+ * Built with AXN500_TRACE, fixed size binary events are recorded in a ring
+ * per thread. Only the owner thread writes to its ring, so recording an
+ * event is just a clock read and a few stores. The rings are written to a
+ * file at exit (-T) and can be printed later with -D. Without AXN500_TRACE
+ * axn500_trace() compiles to nothing.
+ */
+enum {
+	AXN500_TRACE_CMD = 1,		/* a = command, b = size */
+	AXN500_TRACE_REPLY,		/* a = command, b = size */
+	AXN500_TRACE_PACKET,		/* a = packet number, b = size */
+	AXN500_TRACE_PARSE,		/* a = stage, b = exercise or count */
+	AXN500_TRACE_ERROR,		/* a = where, b = errno */
+	AXN500_TRACE_TYPES,
+};
+
+enum {
+	AXN500_TRACE_PARSE_SCAN = 0,
+	AXN500_TRACE_PARSE_DECODE,
+	AXN500_TRACE_PARSE_DONE,
+};
+
+#define AXN500_TRACE_MAGIC	"AXT1"
+#define AXN500_TRACE_EVENT_SIZE	24
+#define AXN500_TRACE_RING_SIZE	4096	/* events, power of 2 */
+
+struct axn500_trace_event {
+	unsigned long long time;	/* CLOCK_MONOTONIC, ns */
+	unsigned int thread;
+	unsigned short type;
+	unsigned short pad;
+	unsigned int a;
+	unsigned int b;
+};
+
+#ifdef AXN500_TRACE
+struct axn500_trace_ring {
+	struct axn500_trace_ring *next;
+	unsigned int thread;
+	unsigned long head;
+	struct axn500_trace_event events[AXN500_TRACE_RING_SIZE];
+};
+
+static struct axn500_trace_ring *axn500_trace_rings;
+static unsigned int axn500_trace_threads;
+static __thread struct axn500_trace_ring *axn500_trace_ring;
+
+static struct axn500_trace_ring *axn500_trace_new_ring(void)
+{
+	struct axn500_trace_ring *ring;
+
+	ring = calloc(1, sizeof(*ring));
+	if (ring == NULL)
+		return NULL;
+	ring->thread = __sync_fetch_and_add(&axn500_trace_threads, 1);
+	do {
+		ring->next = axn500_trace_rings;
+	} while (!__sync_bool_compare_and_swap(&axn500_trace_rings, ring->next, ring));
+	axn500_trace_ring = ring;
+	return ring;
+}
+
+static void axn500_trace_event(int type, unsigned int a, unsigned int b)
+{
+	struct axn500_trace_ring *ring = axn500_trace_ring;
+	struct axn500_trace_event *ev;
+	struct timespec ts;
+
+	if (ring == NULL && (ring = axn500_trace_new_ring()) == NULL)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	ev = &ring->events[ring->head & (AXN500_TRACE_RING_SIZE - 1)];
+	ev->time = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	ev->thread = ring->thread;
+	ev->type = type;
+	ev->a = a;
+	ev->b = b;
+	/* make the event visible before the new head */
+	__sync_synchronize();
+	ring->head++;
+}
+#define axn500_trace(type, a, b) axn500_trace_event(type, a, b)
+#else
+#define axn500_trace(type, a, b) do { } while (0)
+#endif
+
+/*
+ * Profiling
+ *
+ * With --profile, the time spent in each phase of a run and the allocations
+ * made by each subsystem are accounted, and a report is printed to stderr
+ * at exit. If the kernel lets us, the phases also count cycles,
+ * instructions and cache misses with perf_event_open(); the counters are
+ * inherited by the decoding threads. Phases nest (discover is part of
+ * connect), each one counts its inclusive time. Without --profile all this
+ * costs a test of a global.
+ */
+enum {
+	AXN500_PHASE_DISCOVER = 0,
+	AXN500_PHASE_CONNECT,
+	AXN500_PHASE_FETCH,
+	AXN500_PHASE_TRANSFER,
+	AXN500_PHASE_PARSE,
+	AXN500_PHASE_OUTPUT,
+	AXN500_PHASE_STORE,
+	AXN500_PHASES,
+};
+
+enum {
+	AXN500_ALLOC_DISCOVER = 0,
+	AXN500_ALLOC_TRANSFER,
+	AXN500_ALLOC_PARSE,	/* arena chunks and thread lists */
+	AXN500_ALLOC_ARENA,	/* carved from the arena, no malloc() */
+	AXN500_ALLOCS,
+};
+
+#define AXN500_COUNTERS		3
+#define AXN500_PROFILE_CMDS	16
+
+struct axn500_phase_stats {
+	unsigned long long calls;
+	unsigned long long ns;
+	unsigned long long counter[AXN500_COUNTERS];
+};
+
+struct axn500_span {
+	unsigned long long ns;
+	unsigned long long counter[AXN500_COUNTERS];
+};
+
+static struct axn500_profile {
+	int enabled;
+	int counter_fd[AXN500_COUNTERS];
+	int counter_errno;
+	unsigned long long start;
+	struct axn500_phase_stats phase[AXN500_PHASES];
+	struct axn500_phase_stats cmd[AXN500_PROFILE_CMDS];
+	unsigned long long allocs[AXN500_ALLOCS];
+	unsigned long long bytes[AXN500_ALLOCS];
+} axn500_profile;
+
+static unsigned long long axn500_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int axn500_perf_open(unsigned long long config)
+{
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	attr.inherit = 1;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static void axn500_profile_start(void)
+{
+	static const unsigned long long config[AXN500_COUNTERS] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_MISSES,
+	};
+	int i;
+
+	axn500_profile.enabled = 1;
+	axn500_profile.start = axn500_now();
+	for (i = 0; i < AXN500_COUNTERS; i++) {
+		axn500_profile.counter_fd[i] = axn500_perf_open(config[i]);
+		if (axn500_profile.counter_fd[i] < 0) {
+			axn500_profile.counter_errno = errno;
+			while (i--)
+				close(axn500_profile.counter_fd[i]);
+			axn500_profile.counter_fd[0] = -1;
+			break;
+		}
+	}
+}
+
+static void axn500_profile_read(unsigned long long *counter)
+{
+	int i;
+
+	for (i = 0; i < AXN500_COUNTERS; i++)
+		if (axn500_profile.counter_fd[0] < 0 ||
+		    read(axn500_profile.counter_fd[i], &counter[i],
+			 sizeof(counter[i])) != sizeof(counter[i]))
+			counter[i] = 0;
+}
+
+static void axn500_profile_begin(struct axn500_span *span)
+{
+	if (!axn500_profile.enabled)
+		return;
+	axn500_profile_read(span->counter);
+	span->ns = axn500_now();
+}
+
+static void axn500_profile_add(struct axn500_phase_stats *stats,
+			       struct axn500_span *span)
+{
+	unsigned long long counter[AXN500_COUNTERS], ns = axn500_now();
+	int i;
+
+	axn500_profile_read(counter);
+	__sync_fetch_and_add(&stats->calls, 1);
+	__sync_fetch_and_add(&stats->ns, ns - span->ns);
+	for (i = 0; i < AXN500_COUNTERS; i++)
+		__sync_fetch_and_add(&stats->counter[i],
+				     counter[i] - span->counter[i]);
+}
+
+static void axn500_profile_end(struct axn500_span *span, int phase)
+{
+	if (axn500_profile.enabled)
+		axn500_profile_add(&axn500_profile.phase[phase], span);
+}
+
+/* a fetch of command 'cmd', also accounted by command */
+static void axn500_profile_end_cmd(struct axn500_span *span, int cmd)
+{
+	if (!axn500_profile.enabled)
+		return;
+	axn500_profile_add(&axn500_profile.phase[AXN500_PHASE_FETCH], span);
+	if (cmd < AXN500_PROFILE_CMDS)
+		axn500_profile_add(&axn500_profile.cmd[cmd], span);
+}
+
+static void axn500_profile_alloc(int subsystem, size_t size)
+{
+	if (!axn500_profile.enabled)
+		return;
+	__sync_fetch_and_add(&axn500_profile.allocs[subsystem], 1);
+	__sync_fetch_and_add(&axn500_profile.bytes[subsystem], size);
+}
+
 #if 0
 Datagram socket - SOCK_DGRAM, IRDAPROTO_UNITDATA
 	SeqPacket sockets provides a reliable, datagram oriented, full duplex connection between two sockets on top of IrLMP.  There is no guarantees that the data arrives in order and there is  no
@@ -105,7 +366,8 @@ static void irda_get_hints(struct irda_device_info *info, char *buff, int size)
 	CHECK(HINT_OBEX, hint1);
 }
 
-static int irda_discover_devices(int fd, struct sockaddr_irda *addr, int max_devices)
+static int irda_discover_devices(int fd, struct sockaddr_irda *addr,
+				 unsigned short *hints, int max_devices)
 {
 	struct irda_device_list *list;
 	int i;
@@ -116,10 +378,16 @@ static int irda_discover_devices(int fd, struct sockaddr_irda *addr, int max_dev
 	tmp = malloc(size);
 	if (tmp == NULL)
 		return -1;
+	axn500_profile_alloc(AXN500_ALLOC_DISCOVER, size);
 
 	dprintf("Scanning...\n");
-	if (getsockopt(fd, SOL_IRLMP, IRLMP_ENUMDEVICES, tmp, &size))
+	if (getsockopt(fd, SOL_IRLMP, IRLMP_ENUMDEVICES, tmp, &size)) {
+		/* keep errno for the caller */
+		i = errno;
+		free(tmp);
+		errno = i;
 		return 1;
+	}
 
 	list = (struct irda_device_list *)tmp;
 	dprintf("Found %i devices:\n", list->len);
@@ -131,9 +399,83 @@ static int irda_discover_devices(int fd, struct sockaddr_irda *addr, int max_dev
 			list->dev[i].info);
 	}
 	addr->sir_addr = list->dev[0].daddr;
+	*hints = list->dev[0].hints[0] | (list->dev[0].hints[1] << 8);
+	free(tmp);
+	return 0;
+}
+
+/*
+ * Everything decoded from a dump (or an archive) is carved from an arena,
+ * sized up front from the amount of raw data, and released at once.
+ */
+#define AXN500_ARENA_ALIGN	16
+#define AXN500_ARENA_CHUNK	(64 * 1024)
+
+struct axn500_arena_chunk {
+	struct axn500_arena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[] __attribute__((aligned(AXN500_ARENA_ALIGN)));
+};
+
+struct axn500_arena {
+	struct axn500_arena_chunk *chunks;
+};
+
+static int axn500_arena_grow(struct axn500_arena *arena, size_t size)
+{
+	struct axn500_arena_chunk *chunk;
+
+	if (size < AXN500_ARENA_CHUNK)
+		size = AXN500_ARENA_CHUNK;
+	chunk = malloc(sizeof(*chunk) + size);
+	if (chunk == NULL)
+		return 1;
+	axn500_profile_alloc(AXN500_ALLOC_PARSE, sizeof(*chunk) + size);
+	chunk->size = size;
+	chunk->used = 0;
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
 	return 0;
 }
 
+static void *axn500_arena_alloc(struct axn500_arena *arena, size_t size)
+{
+	struct axn500_arena_chunk *chunk = arena->chunks;
+	void *ptr;
+
+	size = (size + AXN500_ARENA_ALIGN - 1) & ~(AXN500_ARENA_ALIGN - 1);
+	if (chunk == NULL || chunk->used + size > chunk->size) {
+		if (axn500_arena_grow(arena, size))
+			return NULL;
+		chunk = arena->chunks;
+	}
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	axn500_profile_alloc(AXN500_ALLOC_ARENA, size);
+	return ptr;
+}
+
+static void *axn500_arena_zalloc(struct axn500_arena *arena, size_t size)
+{
+	void *ptr = axn500_arena_alloc(arena, size);
+
+	if (ptr)
+		memset(ptr, 0, size);
+	return ptr;
+}
+
+static void axn500_arena_release(struct axn500_arena *arena)
+{
+	struct axn500_arena_chunk *chunk, *next;
+
+	for (chunk = arena->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	arena->chunks = NULL;
+}
+
 struct axn500_time {
 	unsigned char hour;
 	unsigned char minute;
@@ -158,9 +500,36 @@ struct axn500_marker {
 
 struct axn500_entry {
 	unsigned char hr;
+	unsigned char quality;		/* AXN500_SAMPLE_* */
 	signed short altitude;
 };
 
+/*
+ * Downsampled versions of the samples, used to plot long exercises without
+ * going through all of them. Level l has a point for each
+ * AXN500_PYRAMID_FANOUT^(l + 1) samples; the samples themselves are level 1x.
+ * Levels are added until one has a single point, so any number of points
+ * can be met, up to AXN500_PYRAMID_LEVELS.
+ */
+#define AXN500_PYRAMID_LEVELS	7
+#define AXN500_PYRAMID_SHIFT	4
+#define AXN500_PYRAMID_FANOUT	(1 << AXN500_PYRAMID_SHIFT)
+
+struct axn500_pyramid_point {
+	unsigned char hr_min;
+	unsigned char hr_max;
+	signed short alt_min;
+	signed short alt_max;
+	int count;
+	long long hr_sum;
+	long long alt_sum;
+};
+
+struct axn500_pyramid {
+	int points;
+	struct axn500_pyramid_point *point;
+};
+
 struct axn500_exercise {
 	struct axn500_date date;
 	struct axn500_time start_time;
@@ -175,6 +544,40 @@ struct axn500_exercise {
 	signed short max_alt;
 	int entries;
 	struct axn500_entry *data;	
+	int status;
+	unsigned int watch;		/* IrDA address of the watch */
+	unsigned short record_rate;	/* seconds between samples */
+	time_t start;			/* start_time with the full date */
+	int raw_offset;			/* where it is in the dump */
+	int raw_size;
+	int levels;			/* of the pyramid */
+	struct axn500_pyramid pyramid[AXN500_PYRAMID_LEVELS];
+};
+
+enum {
+	AXN500_EX_OK = 0,
+	AXN500_EX_BAD_START_TIME,
+	AXN500_EX_BAD_DURATION,
+	AXN500_EX_BAD_HEADER,
+	AXN500_EX_TRUNCATED,
+	AXN500_EX_MISSING,
+};
+
+static const char *axn500_ex_status[] = {
+	[AXN500_EX_OK] = "ok",
+	[AXN500_EX_BAD_START_TIME] = "invalid start time",
+	[AXN500_EX_BAD_DURATION] = "invalid duration",
+	[AXN500_EX_BAD_HEADER] = "incomplete header",
+	[AXN500_EX_TRUNCATED] = "truncated data",
+	[AXN500_EX_MISSING] = "not found",
+};
+
+/* one entry for each problem found while parsing in recovery mode */
+struct axn500_parse_error {
+	int exercise;
+	int status;
+	int offset;		/* where the bad exercise begins in the dump */
+	int skipped;		/* bytes skipped to find the next exercise */
 };
 
 struct axn500 {
@@ -194,6 +597,8 @@ struct axn500 {
 	unsigned char ampm;
 
 	struct axn500_date date;
+	/* the last 0x29 reply, written back with the changes when setting */
+	char time_raw[38];
 
 	struct axn500_settings {
 		struct axn500_date bday;
@@ -222,6 +627,9 @@ struct axn500 {
 	struct axn500_exercises {
 		int num;
 		struct axn500_exercise *exercise;
+		int num_errors;
+		struct axn500_parse_error *errors;
+		struct axn500_arena arena;
 	} exercises;
 };
 
@@ -233,6 +641,7 @@ enum {
 	AXN500_CMD_GET_REMINDER4,
 	AXN500_CMD_GET_REMINDER5,
 	AXN500_CMD_GET_SETTINGS,
+	AXN500_CMD_SET_TIME,
 };
 
 static char axn500_parse_byte(char byte, int capsonly)
@@ -340,9 +749,47 @@ static int axn500_parse_time_info(int cmd, struct axn500 *info, char *data)
 	info->date.month = data[pos + 1];
 	info->date.year = data[pos + 2];
 
+	memcpy(info->time_raw, data, sizeof(info->time_raw));
 	return 0;
 }
 
+#ifdef AXN500_SET_TIME
+static char axn500_encode_hex(int value)
+{
+	return ((value / 10) << 4) | (value % 10);
+}
+
+/*
+ * The 0x29 block with a new date and time, for writing it back. It starts
+ * from the last block read, so it must have been read first, and only the
+ * date and the hours and minutes of the selected clock are changed, every
+ * other byte goes back as the watch sent it.
+ */
+static int axn500_time_info_raw(int cmd, struct axn500 *info, char *raw,
+				int raw_size)
+{
+	char *data = raw - 1;	/* offsets include the command code */
+	struct axn500_time *clock = &info->timezone[info->enabled_timezone];
+	int pos;
+
+	if (raw_size < sizeof(info->time_raw) - 1)
+		return -1;
+	memcpy(raw, info->time_raw + 1, sizeof(info->time_raw) - 1);
+
+	pos = info->enabled_timezone? AXN500_TIMEZONE2_OFFSET:
+				      AXN500_TIMEZONE1_OFFSET;
+	data[pos] = axn500_encode_hex(clock->minute);
+	data[pos + 1] = axn500_encode_hex(clock->hour);
+
+	pos = AXN500_DATE_OFFSET;
+	data[pos] = info->date.day;
+	data[pos + 1] = info->date.month;
+	data[pos + 2] = info->date.year;
+
+	return sizeof(info->time_raw) - 1;
+}
+#endif
+
 /*
 reminder info
 cmd: 0x3501, 0x3502, 0x3503, 0x3504, 0x3505
@@ -555,9 +1002,24 @@ struct {
 	[AXN500_CMD_GET_REMINDER4] = { {0x35, 0x04,}, 2, 14, axn500_parse_reminder_info, NULL},
 	[AXN500_CMD_GET_REMINDER5] = { {0x35, 0x05,}, 2, 14, axn500_parse_reminder_info, NULL},
 	[AXN500_CMD_GET_SETTINGS] = { {0x2b,}, 1, 31, axn500_parse_settings, NULL},
+#ifdef AXN500_SET_TIME
+	/* the code the watch puts on its 0x29 replies, unconfirmed for writes */
+	[AXN500_CMD_SET_TIME] = { {0x28,}, 1, 0, NULL, axn500_time_info_raw},
+#endif
 	{},
 };
 
+/* for tracing and profiling: 0x29, 0x3501, ... */
+static unsigned int axn500_cmd_code(int cmd)
+{
+	unsigned int code = 0;
+	int i;
+
+	for (i = 0; i < axn500_commands[cmd].cmdsize; i++)
+		code = (code << 8) | (unsigned char)axn500_commands[cmd].cmd[i];
+	return code;
+}
+
 static void dump_context(char *ptr, int offset, int context)
 {
 	int i;
@@ -633,725 +1095,6496 @@ static void dump_context(char *ptr, int offset, int context)
 
 #define EX_HEADER_SIZE		95
 #define EX_MARKER_SIZE		22
-static int axn500_parse_exercises(char *data, int num_ex, int bytes, struct axn500 *info)
+#define EX_MAX_MARKERS		255	/* the count is a single byte */
+
+/*
+ * The exercise info always ends with 00 00 00 c1 01. 0xc1 is rare enough in
+ * the headers that looking for it with memchr() (which is vectorized by libc)
+ * and then checking the bytes around it is a lot cheaper than comparing the
+ * whole pattern at every position.
+ */
+static const char axn500_ex_header_end[] = { 0x00, 0x00, 0x00, 0xc1, 0x01 };
+#define EX_HEADER_END_SIZE	sizeof(axn500_ex_header_end)
+#define EX_HEADER_END_KEY	3
+
+static char *axn500_find_header_end(char *start, char *end)
 {
-	struct axn500_exercise *exercise;
-	int ex;
-	char *ptr;
+	char *p = start + EX_HEADER_END_KEY;
 
-	dprintf("Parsing data for %i exercises, %i bytes\n", num_ex, bytes);
-	info->exercises.num = num_ex;
-	info->exercises.exercise = malloc(sizeof(struct axn500_exercise) * num_ex);
-	if (info->exercises.exercise == NULL) {
-		fprintf(stderr, "Not enough memory\n");
-		return 1;
+	while (p < end - (EX_HEADER_END_SIZE - EX_HEADER_END_KEY - 1)) {
+		p = memchr(p, axn500_ex_header_end[EX_HEADER_END_KEY],
+			   end - p - (EX_HEADER_END_SIZE - EX_HEADER_END_KEY - 1));
+		if (p == NULL)
+			return NULL;
+		if (!memcmp(p - EX_HEADER_END_KEY, axn500_ex_header_end,
+			    EX_HEADER_END_SIZE))
+			return p - EX_HEADER_END_KEY;
+		p++;
 	}
+	return NULL;
+}
 
-	ptr = &data[5];
+static int axn500_valid_time(char *ptr)
+{
+	return axn500_parse_hex(ptr[0]) <= 59 &&
+	       axn500_parse_hex(ptr[1]) <= 59 &&
+	       axn500_parse_hex(ptr[2]) <= 23 &&
+	       (ptr[0] & 0x0f) <= 9 && (ptr[1] & 0x0f) <= 9 &&
+	       (ptr[2] & 0x0f) <= 9;
+}
 
-	/* now process each exercise */
-	for (ex = 0; ex < num_ex; ex++) {
-		int j;
+/*
+ * Bump this whenever a change in the parser changes what ends up in
+ * struct axn500_exercise, so the derived data is decoded again
+ */
+#define AXN500_PARSER_VERSION	2	/* 2: samples are never cleaned */
 
-		dprintf("====================================\n");
-		dprintf("Processing exercise %i of %i\n", ex + 1, num_ex);
-		exercise = &info->exercises.exercise[ex];
+/*
+ * Returns 0 or the AXN500_EX_* status describing why the header is no good
+ */
+static int axn500_parse_ex_header(char *ptr, struct axn500_exercise *exercise)
+{
+	int j;
+
+	exercise->date.day = ptr[EX_DAY_OFFSET];
+	/* FIXME - no other info other than day */
+
+	exercise->start_time.second = axn500_parse_hex(ptr[EX_START_TIME_OFFSET]);
+	exercise->start_time.minute = axn500_parse_hex(ptr[EX_START_TIME_OFFSET + 1]);
+	exercise->start_time.hour = axn500_parse_hex(ptr[EX_START_TIME_OFFSET + 2]);
+	if (exercise->start_time.hour > 23 ||
+	    exercise->start_time.minute > 59 ||
+	    exercise->start_time.second > 59) {
+		fprintf(stderr, "Error parsing exercise, invalid start "
+			"time (%i:%i:%i)\n",
+			exercise->start_time.hour,
+			exercise->start_time.minute,
+			exercise->start_time.second);
+		if (axn500_debug)
+			dump_context(ptr, EX_START_TIME_OFFSET, 5);
+		return AXN500_EX_BAD_START_TIME;
+	}
+	dprintf("Got start time %i:%i:%i\n", exercise->start_time.hour,
+		exercise->start_time.minute, exercise->start_time.second);
+
+	exercise->duration.second = axn500_parse_hex(ptr[EX_DURATION_OFFSET]);
+	exercise->duration.minute = axn500_parse_hex(ptr[EX_DURATION_OFFSET + 1]);
+	exercise->duration.hour = axn500_parse_hex(ptr[EX_DURATION_OFFSET + 2]);
+	if (exercise->duration.hour > 23 ||
+	    exercise->duration.minute > 59 ||
+	    exercise->duration.second > 59) {
+		fprintf(stderr, "Error parsing exercise, invalid duration "
+			"time (%i:%i:%i)\n",
+			exercise->duration.hour,
+			exercise->duration.minute,
+			exercise->duration.second);
+		if (axn500_debug)
+			dump_context(ptr, EX_DURATION_OFFSET, 5);
+		return AXN500_EX_BAD_DURATION;
+	}
+	dprintf("Got duration time %i:%i:%i\n", exercise->duration.hour,
+		exercise->duration.minute, exercise->duration.second);
 
-		#if 0
-		{
-		int i;
-		for (i = 0; i < 150; i++) {
-			unsigned char c = ptr[i];
-			if (i == 95)
-				printf("[%02hhx]", c);
-			else
-				printf(" %02hhx", c);
-			if (!((i + 1) % 8))
-				printf("\n");
-		}
-		printf("\n");
-		}
-		#endif
-
-		exercise->date.day = ptr[EX_DAY_OFFSET];
-		/* FIXME - no other info other than day */
-
-		exercise->start_time.second = axn500_parse_hex(ptr[EX_START_TIME_OFFSET]);
-		exercise->start_time.minute = axn500_parse_hex(ptr[EX_START_TIME_OFFSET + 1]);
-		exercise->start_time.hour = axn500_parse_hex(ptr[EX_START_TIME_OFFSET + 2]);
-		if (exercise->start_time.hour > 23 ||
-		    exercise->start_time.minute > 59 ||
-		    exercise->start_time.second > 59) {
-			fprintf(stderr, "Error parsing exercise, invalid start "
-				"time (%i:%i:%i)\n",
-				exercise->start_time.hour,
-				exercise->start_time.minute,
-				exercise->start_time.second);
-			if (axn500_debug)
-				dump_context(ptr, EX_START_TIME_OFFSET, 5);
-			return 1;
-		}
-		dprintf("Got start time %i:%i:%i\n", exercise->start_time.hour,
-			exercise->start_time.minute, exercise->start_time.second);
-
-		exercise->duration.second = axn500_parse_hex(ptr[EX_DURATION_OFFSET]);
-		exercise->duration.minute = axn500_parse_hex(ptr[EX_DURATION_OFFSET + 1]);
-		exercise->duration.hour = axn500_parse_hex(ptr[EX_DURATION_OFFSET + 2]);
-		if (exercise->duration.hour > 23 ||
-		    exercise->duration.minute > 59 ||
-		    exercise->duration.second > 59) {
-			fprintf(stderr, "Error parsing exercise, invalid duration "
-				"time (%i:%i:%i)\n",
-				exercise->duration.hour,
-				exercise->duration.minute,
-				exercise->duration.second);
-			if (axn500_debug)
-				dump_context(ptr, EX_DURATION_OFFSET, 5);
-			return 1;
-		}
-		dprintf("Got duration time %i:%i:%i\n", exercise->duration.hour,
-			exercise->duration.minute, exercise->duration.second);
+	for (j = 0; j < 3; j++) {
+		exercise->limits[j].lower = ptr[EX_LIMITS_OFFSET] + (j * 2);
+		exercise->limits[j].upper = ptr[EX_LIMITS_OFFSET] + (j * 2) + 1;
+	}
 
-		for (j = 0; j < 3; j++) {
-			exercise->limits[j].lower = ptr[EX_LIMITS_OFFSET] + (j * 2);
-			exercise->limits[j].upper = ptr[EX_LIMITS_OFFSET] + (j * 2) + 1;
-		}
-
-		exercise->num_markers = ptr[EX_MARKERNUM_OFFSET];
-		exercise->max_hr = ptr[EX_MAX_HR_OFFSET];
-		exercise->avg_hr = ptr[EX_AVG_HR_OFFSET];
-		exercise->min_alt = (((unsigned char)ptr[EX_MIN_ALT_OFFSET + 1] << 8) +
-					(unsigned char)ptr[EX_MIN_ALT_OFFSET]) - 0x300;
-
-		exercise->max_alt = ((ptr[EX_MAX_ALT_OFFSET + 1] << 8) +
-					(unsigned char)ptr[EX_MAX_ALT_OFFSET]) - 0x300;
-		exercise->kcal = (ptr[EX_KCAL_OFFSET + 1] << 8) + (unsigned char)ptr[EX_KCAL_OFFSET];
-
-		j = (exercise->duration.hour * 60 * 60) +
-		    (exercise->duration.minute * 60) +
-		    exercise->duration.second;
-		/* FIXME - we have fixed 5s periods. need to fetch this from the exercise */
-		exercise->entries = j / 5 + ((j % 5)? 1:0);
-		exercise->data = malloc(sizeof(struct axn500_entry) * exercise->entries);
-		if (exercise->data == NULL) {
-			fprintf(stderr, "No enough memory\n");
-			for ( ; ex >= 0; ex--) {
-				exercise = &info->exercises.exercise[ex];
-				free(exercise->data);
-			}
-			free(info->exercises.exercise);
-			return 1;
-		}
+	exercise->num_markers = ptr[EX_MARKERNUM_OFFSET];
+	exercise->max_hr = ptr[EX_MAX_HR_OFFSET];
+	exercise->avg_hr = ptr[EX_AVG_HR_OFFSET];
+	exercise->min_alt = (((unsigned char)ptr[EX_MIN_ALT_OFFSET + 1] << 8) +
+				(unsigned char)ptr[EX_MIN_ALT_OFFSET]) - 0x300;
 
-		/* now find where the data start */
-		ptr += EX_HEADER_SIZE +
-			(exercise->num_markers - 1) * EX_MARKER_SIZE;
+	exercise->max_alt = ((ptr[EX_MAX_ALT_OFFSET + 1] << 8) +
+				(unsigned char)ptr[EX_MAX_ALT_OFFSET]) - 0x300;
+	exercise->kcal = (ptr[EX_KCAL_OFFSET + 1] << 8) + (unsigned char)ptr[EX_KCAL_OFFSET];
 
-#if 0
-		dprintf("guessing the exercise data begins at %li, first "
-			"entries:\n", (ptr-data));
-		{
-		int i;
-		unsigned short *s;
-		unsigned char hr;
-		for (i = 0; i < 10 && i < exercise->entries; i++) {
-			hr = ptr[i * 3];
-			s = (unsigned short *)&ptr[(i * 3) + 1];
-			printf("HR: %hhu %#hhx\talt: %hu %#hx\n", hr,
-					ptr[i * 3], *s - 0x300, *s);
-		}
-		}
-#endif
+	j = (exercise->duration.hour * 60 * 60) +
+	    (exercise->duration.minute * 60) +
+	    exercise->duration.second;
+	/* FIXME - we have fixed 5s periods. need to fetch this from the exercise */
+	exercise->record_rate = 5;
+	exercise->entries = j / 5 + ((j % 5)? 1:0);
 
-		/* get all the entries */
-		for (j = 0; j < exercise->entries; j++) {
-			if ((ptr - data) > bytes) {
-				fprintf(stderr, "Expected more %i entries "
-					"but no enough data",
-					exercise->entries - j);
-				break;
-			}
-			exercise->data[j].hr = ptr[0];
-			/* the altitude is stored as little endian short, 0x300 is 0 */
-			exercise->data[j].altitude = ((ptr[2] << 8) +
-				(unsigned char)ptr[1]) - 0x300;
-			ptr += 3;
-		}
-	}
 	return 0;
 }
 
 /*
- *
- * Every 163 bytes packet begins with a 3 byte header:
- * 0b 00 53
- *       ^^ packet number
- * The packet number decrements until 01, when the command to send more data
- * (0x16, 0x2f) should not be used anymore
- * The data comes in an inverted fashion: first the last exercise header then
- * the last entry of the last exercise, then the last but one exercise header
- * and the last entry of the last but one exercise and so on.
+ * Parsing is done in two phases. The first one walks the headers, which is
+ * cheap, and figures out where each exercise header and samples are in the
+ * dump. Once that's known, the samples of each exercise can be decoded
+ * independently, so that's done by a few threads.
  */
-#define AXN500_EX_PKT_SIZE 163
-#define AXN500_EX_PKT_HDR_SIZE 3
-#define AXN500_EX_PKT_HDR_NUM 2
-#define AXN500_EX_PKT_PAYLOAD_SIZE (AXN500_EX_PKT_SIZE - AXN500_EX_PKT_HDR_SIZE)
-static char *axn500_get_exercise(int fd, unsigned char *num_ex, int *bytes, struct axn500 *info)
-{
-	char buff[AXN500_EX_PKT_SIZE], *all;
-	int i, rc;
-	unsigned char packet_count;
-	const char get_exercise_cmd[] = { 0x0b };
-	const char get_next_cmd[] = { 0x16, 0x2f };
-	const char get_exercisenum_cmd[] = { 0x15 };
+struct axn500_ex_bounds {
+	int header;
+	int samples;
+	int end;
+};
 
-	rc = write(fd, get_exercisenum_cmd, 1);
-	if (rc < 0) {
-		perror("Error writing get exercise count");
-		return NULL;
-	}
-	rc = read(fd, buff, sizeof(buff));
-	if (rc < 0) {
-		perror("Error getting exercise number");
-		return NULL;
-	}
-	if (rc != 7) {
-		fprintf(stderr, "Unexpected reply size while getting number "
-			"of exercises (expected 7, got %i)\n", rc);
-		return NULL;
-	}
-	*num_ex = buff[3];
+static int axn500_recover;
 
-	if (*num_ex == 0) {
-		printf("No exercises found on the watch\n");
-		return NULL;
+/*
+ * Looks for the next thing that looks like an exercise header after 'ptr':
+ * the end of header pattern, preceded by a header with a matching number of
+ * markers and sane start time and duration.
+ */
+static char *axn500_resync(char *data, int bytes, char *ptr)
+{
+	char *end, *hdr;
+	int markers;
+
+	end = ptr;
+	while ((end = axn500_find_header_end(end + 1, data + bytes))) {
+		for (markers = 1; markers <= EX_MAX_MARKERS; markers++) {
+			hdr = end + EX_HEADER_END_SIZE - EX_HEADER_SIZE -
+				(markers - 1) * EX_MARKER_SIZE;
+			if (hdr <= ptr)
+				break;
+			if ((unsigned char)hdr[EX_MARKERNUM_OFFSET] == markers &&
+			    axn500_valid_time(hdr + EX_START_TIME_OFFSET) &&
+			    axn500_valid_time(hdr + EX_DURATION_OFFSET))
+				return hdr;
+		}
 	}
+	return NULL;
+}
 
-	rc = write(fd, get_exercise_cmd, 1);
-	if (rc < 0) {
-		perror("Error writing get exercises data");
-		return NULL;
-	}
-	/*
-	 * we get the first package to have an idea of how much we'll need for
-	 * the full thing
-	 */
-	rc = read(fd, buff, sizeof(buff));
-	if (rc < 0) {
-		perror("Error getting exercise data");
-		return NULL;
-	}
-	if (rc < 11) {
-		fprintf(stderr, "Not enough data, got only %i bytes\n", rc);
-		return NULL;
-	}
+static void axn500_add_parse_error(struct axn500 *info, int ex, int status,
+				   int offset, int skipped)
+{
+	struct axn500_parse_error *err;
 
-	packet_count = buff[2];
-	dprintf("Got %i bytes on the first request for info, total packets: "
-		"%i\n", rc, packet_count);
+	err = &info->exercises.errors[info->exercises.num_errors++];
+	err->exercise = ex;
+	err->status = status;
+	err->offset = offset;
+	err->skipped = skipped;
+}
 
-	printf(".");
-	fflush(stdout);
-
-	all = malloc(AXN500_EX_PKT_SIZE * packet_count);
-	if (all == NULL) {
-		fprintf(stderr, "Not enough memory\n");
-		return NULL;
-	}
-	memset(all, 0, AXN500_EX_PKT_SIZE * packet_count);
-
-	memcpy(all, buff, rc);
-	*bytes = rc;
-
-	for (i = 1; i < packet_count; i++) {
-		unsigned char c;
+static int axn500_scan_exercises(char *data, int num_ex, int bytes,
+				 struct axn500 *info,
+				 struct axn500_ex_bounds *bounds)
+{
+	struct axn500_exercise *exercise;
+	char *ptr, *end, *next;
+	int ex, header_size, status;
 
-		rc = write(fd, get_next_cmd, 2);
-		if (rc < 0) {
-			perror("Error asking for more data");
-			free(all);
-			return NULL;
-		}
-		rc = read(fd, buff, sizeof(buff));
-		if (rc < 0) {
-			perror("Error getting more data");
-			free(all);
-			return NULL;
+	ptr = &data[5];
+	for (ex = 0; ex < num_ex; ex++) {
+		dprintf("====================================\n");
+		dprintf("Processing exercise %i of %i\n", ex + 1, num_ex);
+		exercise = &info->exercises.exercise[ex];
+		memset(exercise, 0, sizeof(*exercise));
+		if (ptr == NULL) {
+			exercise->status = AXN500_EX_MISSING;
+			continue;
 		}
-		printf(".");
-		fflush(stdout);
-		if (rc < AXN500_EX_PKT_SIZE && (i + 1) == packet_count)
-			fprintf(stderr, "Got less data than expected: %i of "
-				"%i, packet %i of %i\n", rc,
-				AXN500_EX_PKT_SIZE,
-				i + 1, packet_count);
-		c = buff[AXN500_EX_PKT_HDR_NUM];
-		if (c != (packet_count - i))
-			fprintf(stderr, "Unexpected packet number: %i, "
-				"expected %i\n", buff[AXN500_EX_PKT_HDR_NUM],
-				(packet_count - i));
-#if 0
-		{
-			int c;
-			for (c = 0; c < rc; c++) {
-				fprintf(stderr, "%hhx\t", buff[c]);
-				if (!(c % 8) && c != 0)
-					fprintf(stderr, "\n");
-			}
-			fprintf(stderr, "\n");
+		bounds[ex].header = bounds[ex].samples = bounds[ex].end = ptr - data;
+
+		status = AXN500_EX_BAD_HEADER;
+		if ((ptr - data) + EX_HEADER_SIZE <= bytes)
+			status = axn500_parse_ex_header(ptr, exercise);
+		if (status) {
+			if (status == AXN500_EX_BAD_HEADER)
+				fprintf(stderr, "Not enough data for exercise "
+					"%i header\n", ex + 1);
+			if (!axn500_recover)
+				return 1;
+
+			exercise->status = status;
+			exercise->entries = 0;
+			next = axn500_resync(data, bytes, ptr);
+			axn500_add_parse_error(info, ex, status, ptr - data,
+				next? next - ptr:bytes - (ptr - data));
+			if (next)
+				dprintf("Resynchronized %li bytes after exercise "
+					"%i\n", (long)(next - ptr), ex + 1);
+			else
+				fprintf(stderr, "Unable to find any other "
+					"exercise after exercise %i\n", ex + 1);
+			ptr = next;
+			continue;
 		}
-#endif
-		/* copy data to the buffer skipping the header present in each
-		 * packet */
-		memcpy(all + *bytes, &buff[AXN500_EX_PKT_HDR_SIZE],
-			AXN500_EX_PKT_PAYLOAD_SIZE);
-		*bytes += AXN500_EX_PKT_PAYLOAD_SIZE;
+
+		header_size = EX_HEADER_SIZE +
+			(exercise->num_markers - 1) * EX_MARKER_SIZE;
+		bounds[ex].samples = bounds[ex].header + header_size;
+		bounds[ex].end = bounds[ex].samples + exercise->entries * 3;
+		exercise->raw_offset = bounds[ex].header;
+		exercise->raw_size = ((bounds[ex].end < bytes)? bounds[ex].end:bytes) -
+			bounds[ex].header;
+
+		/* cross check the header size with the end of header pattern */
+		end = axn500_find_header_end(ptr, data + bytes);
+		if (end == NULL || end + EX_HEADER_END_SIZE != data + bounds[ex].samples)
+			dprintf("End of header pattern for exercise %i found "
+				"at %li, expected at %i\n", ex + 1,
+				end? (long)(end + EX_HEADER_END_SIZE - data):-1L,
+				bounds[ex].samples);
+
+		ptr = data + bounds[ex].end;
 	}
-	printf("\n");
-	dprintf("Receive complete, got %i packets\n", packet_count);
 
-	return all;
+	for (ex = 0; ex < num_ex; ex++)
+		if (info->exercises.exercise[ex].status == AXN500_EX_MISSING)
+			axn500_add_parse_error(info, ex, AXN500_EX_MISSING,
+					       -1, 0);
+	return 0;
 }
 
-static int axn500_get_data(int fd, int cmd, struct axn500 *info)
+static int axn500_pyramid_shift(int level)
 {
-	int i, rc;
-	char buff[100];
+	return (level + 1) * AXN500_PYRAMID_SHIFT;
+}
 
-	dprintf("size: %i, [%#x][%#x]\n", axn500_commands[cmd].cmdsize, axn500_commands[cmd].cmd[0],
-		axn500_commands[cmd].cmd[1]);
-	rc = write(fd, axn500_commands[cmd].cmd, axn500_commands[cmd].cmdsize);
-	if (rc < 0) {
-		perror("Error writing command");
-		return 1;
-	}
-	if (rc != axn500_commands[cmd].cmdsize) {
-		fprintf(stderr, "Short write on command %i\n", cmd);
-		return 1;
-	}
-	dprintf("Wrote cmd %i, waiting for answer...\n", cmd);
-	fflush(stdout);
+static int axn500_pyramid_points(int entries, int level)
+{
+	int shift = axn500_pyramid_shift(level);
 
-	rc = read(fd, buff, sizeof(buff));
-	if (rc < 0) {
-		perror("Error reading answer");
-		return 1;
-	}
-	if (axn500_commands[cmd].datasize &&
-	    rc != axn500_commands[cmd].datasize) {
-		fprintf(stderr, "Incorrect answer size: %i (expected %i) for cmd %i\n",
-			rc, axn500_commands[cmd].datasize, cmd);
-		return 1;
-	}
+	return ((long long)entries + (1 << shift) - 1) >> shift;
+}
 
-	dprintf("got %i bytes\n", rc);
-	{
-		char foo;
-		for (i = 0; i < rc; i++) {
-			foo = buff[i];
-			dprintf("%02x ", (unsigned char)foo);
-		}
-		dprintf("\n");
-	}
+/* up to the first level with a single point */
+static int axn500_pyramid_levels(int entries)
+{
+	int l = 0;
 
-	if (axn500_commands[cmd].parser(cmd, info, buff)) {
-		fprintf(stderr, "Error parsing reply to command %i\n", cmd);
-		return 1;
-	}
+	while (l < AXN500_PYRAMID_LEVELS - 1 && axn500_pyramid_points(entries, l) > 1)
+		l++;
+	return l + 1;
+}
 
-	return 0;
+/* memory needed to hold the samples of an exercise */
+static size_t axn500_samples_size(int entries)
+{
+	size_t size;
+	int l, levels = axn500_pyramid_levels(entries);
+
+	size = sizeof(struct axn500_entry) * entries + AXN500_ARENA_ALIGN;
+	for (l = 0; l < levels; l++)
+		size += sizeof(struct axn500_pyramid_point) *
+			axn500_pyramid_points(entries, l) + AXN500_ARENA_ALIGN;
+	return size;
 }
 
-static int axn500_set_data(int fd, int cmd, struct axn500 *info)
+static int axn500_alloc_samples(struct axn500_arena *arena,
+				struct axn500_exercise *e)
 {
-	int rc, size, cmdsize;
-	char raw[100];
+	int l;
 
-	if (axn500_commands[cmd].get_raw == NULL) {
-		fprintf(stderr, "BUG: Command %i doesn't have a get_raw method\n", cmd);
+	e->data = axn500_arena_alloc(arena, sizeof(struct axn500_entry) *
+				     e->entries);
+	if (e->data == NULL)
 		return 1;
+	e->levels = axn500_pyramid_levels(e->entries);
+	for (l = 0; l < e->levels; l++) {
+		e->pyramid[l].points = axn500_pyramid_points(e->entries, l);
+		e->pyramid[l].point = axn500_arena_alloc(arena,
+			sizeof(struct axn500_pyramid_point) * e->pyramid[l].points);
+		if (e->pyramid[l].point == NULL)
+			return 1;
 	}
+	return 0;
+}
 
-	cmdsize = axn500_commands[cmd].cmdsize;
-
-	size = axn500_commands[cmd].get_raw(cmd, info, raw + cmdsize, sizeof(raw) - cmdsize);
-	if (size < 0) {
-		dprintf("Error getting the raw data for command %i\n", cmd);
-		return 1;
+/* adds sample j to all levels, samples must be added in order */
+static void axn500_pyramid_add(struct axn500_exercise *e, int j)
+{
+	struct axn500_pyramid_point *p;
+	struct axn500_entry *entry = &e->data[j];
+	int l, shift;
+
+	for (l = 0; l < e->levels; l++) {
+		shift = axn500_pyramid_shift(l);
+		p = &e->pyramid[l].point[j >> shift];
+		if (!(j & ((1 << shift) - 1))) {
+			p->hr_min = p->hr_max = entry->hr;
+			p->alt_min = p->alt_max = entry->altitude;
+			p->hr_sum = entry->hr;
+			p->alt_sum = entry->altitude;
+			p->count = 1;
+			continue;
+		}
+		if (entry->hr < p->hr_min)
+			p->hr_min = entry->hr;
+		if (entry->hr > p->hr_max)
+			p->hr_max = entry->hr;
+		if (entry->altitude < p->alt_min)
+			p->alt_min = entry->altitude;
+		if (entry->altitude > p->alt_max)
+			p->alt_max = entry->altitude;
+		p->hr_sum += entry->hr;
+		p->alt_sum += entry->altitude;
+		p->count++;
 	}
+}
 
-	memcpy(raw, axn500_commands[cmd].cmd, cmdsize);
+/*
+ * Returns the finest level with no more than max_points points, -1 for the
+ * samples themselves
+ */
+static int axn500_pyramid_level(struct axn500_exercise *e, int max_points)
+{
+	int l;
 
-	rc = write(fd, raw, cmdsize + size);
-	if (rc < 0) {
-		perror("Error while writting command");
-		return 1;
-	}
+	if (e->entries <= max_points || e->levels == 0)
+		return -1;
+	for (l = 0; l < e->levels - 1; l++)
+		if (e->pyramid[l].points <= max_points)
+			break;
+	return l;
+}
 
-	/* now wait for the answer */	
-	rc = read(fd, raw, sizeof(raw));
-	if (rc < 0) {
-		perror("Error reading answer");
-		return 1;
-	}
+/*
+ * Sample cleaning
+ *
+ * Optional (-c) pass over the samples of each exercise, done by the
+ * decoding thread right after decoding them, while they're still in cache.
+ * Only what gets shown or exported is cleaned: the store, the archive and
+ * their derived data always keep the samples as the watch recorded them,
+ * so the cache never depends on the cleaning settings. A filter set to 0
+ * is off:
+ * - HR dropouts (0, the strap lost contact) of up to 'gap' samples are
+ *   filled linearly from the samples around them, longer ones stay 0
+ * - HR and altitude samples further than 'spike' bpm and 'jump' m from the
+ *   median of the 5 samples around them are replaced by that median
+ * - the altitude only changes when it gets more than 'hysteresis' m away
+ *   from the current value, which removes the barometer jitter
+ * All the windows are fixed, so each filter keeps a handful of values of
+ * state. Every sample gets AXN500_SAMPLE_* flags telling what was done to
+ * it.
+ */
+#define AXN500_SAMPLE_FILLED	0x01	/* interpolated HR dropout */
+#define AXN500_SAMPLE_NO_HR	0x02	/* dropout too long to fill */
+#define AXN500_SAMPLE_HR_SPIKE	0x04
+#define AXN500_SAMPLE_ALT_SPIKE	0x08
+#define AXN500_SAMPLE_ALT_HELD	0x10	/* change within the hysteresis */
+
+struct axn500_clean {
+	int enabled;
+	int gap;		/* samples */
+	int spike;		/* bpm */
+	int jump;		/* m */
+	int hysteresis;		/* m */
+};
 
-	if (rc != (cmdsize + 1)) {
-		fprintf(stderr, "Unexpected answer size: %i, %i expected\n",
-			rc, cmdsize + 1);
-		return 1;
-	}
+static struct axn500_clean axn500_clean = { 0, 12, 25, 30, 2 };
 
-	return 0;
-}
+#define AXN500_SORT2(a, b)	do { int _t = (a) < (b)? (a):(b); \
+				     (b) = (a) < (b)? (b):(a); (a) = _t; } while (0)
 
-void axn500_print_alarm(struct axn500 *info, int i)
+/* branchless median of 5, the comparisons compile to min/max */
+static int axn500_median5(int a, int b, int c, int d, int e)
 {
-	printf("%s\t%02i:%02i (%s)", info->alarms[i].desc,
-		info->alarms[i].time.hour,
-		info->alarms[i].time.minute,
-		info->alarms[i].enabled? "enabled":"disabled");
+	AXN500_SORT2(a, b);
+	AXN500_SORT2(d, e);
+	AXN500_SORT2(a, d);
+	AXN500_SORT2(b, e);
+	AXN500_SORT2(b, c);
+	AXN500_SORT2(c, d);
+	AXN500_SORT2(b, c);
+	return c;
 }
 
-void axn500_print_reminder(struct axn500 *info, int i)
+static void axn500_fill_dropouts(struct axn500_entry *s, int n, int gap)
 {
-	printf("%s\t%02i:%02i %02i/%02i/%02i (%s)",
-	       info->reminders[i].desc,
-	       info->reminders[i].time.hour,
-	       info->reminders[i].time.minute,
-	       info->reminders[i].date.day,
-	       info->reminders[i].date.month,
-	       info->reminders[i].date.year,
-	       info->reminders[i].enabled? "enabled":"disabled");
-}
+	int i, j, start = -1, last = -1;
 
-void axn500_print_timezone(struct axn500 *info, int i)
-{
-	printf("%02i:%02i (%s)",
-		info->timezone[i].hour,
-		info->timezone[i].minute,
-		(info->enabled_timezone == i)? "main":"");
+	for (i = 0; i < n; i++) {
+		if (s[i].hr == 0) {
+			if (start < 0)
+				start = i;
+			continue;
+		}
+		if (start >= 0) {
+			/* a dropout just ended, fill it if it's short */
+			for (j = start; j < i; j++) {
+				if (last >= 0 && i - start <= gap) {
+					s[j].hr = s[last].hr + (s[i].hr - s[last].hr) *
+						  (j - last) / (i - last);
+					s[j].quality |= AXN500_SAMPLE_FILLED;
+				} else
+					s[j].quality |= AXN500_SAMPLE_NO_HR;
+			}
+			start = -1;
+		}
+		last = i;
+	}
+	for (j = (start >= 0)? start:n; j < n; j++)
+		s[j].quality |= AXN500_SAMPLE_NO_HR;
 }
 
-void _axn500_print_date(struct axn500_date *date)
+static void axn500_despike_hr(struct axn500_entry *s, int n, int spike)
 {
-	printf("%02i/%02i/%02i", date->day, date->month, date->year);
+	int i, m, prev1, prev2;
+
+	if (n < 5)
+		return;
+	prev2 = s[0].hr;
+	prev1 = s[1].hr;
+	for (i = 2; i < n - 2; i++) {
+		m = axn500_median5(prev2, prev1, s[i].hr, s[i + 1].hr, s[i + 2].hr);
+		prev2 = prev1;
+		prev1 = s[i].hr;
+		/* the median means nothing next to a long dropout */
+		if (s[i].hr == 0 || m == 0)
+			continue;
+		if (abs(s[i].hr - m) > spike) {
+			s[i].hr = m;
+			s[i].quality |= AXN500_SAMPLE_HR_SPIKE;
+		}
+	}
 }
 
-void axn500_print_date(struct axn500 *info)
+static void axn500_clean_altitude(struct axn500_entry *s, int n, int jump,
+				  int hysteresis)
 {
-	_axn500_print_date(&info->date);
-}
+	int i, m, prev1, prev2, held;
+
+	if (n >= 5 && jump) {
+		prev2 = s[0].altitude;
+		prev1 = s[1].altitude;
+		for (i = 2; i < n - 2; i++) {
+			m = axn500_median5(prev2, prev1, s[i].altitude,
+					   s[i + 1].altitude, s[i + 2].altitude);
+			prev2 = prev1;
+			prev1 = s[i].altitude;
+			if (abs(s[i].altitude - m) > jump) {
+				s[i].altitude = m;
+				s[i].quality |= AXN500_SAMPLE_ALT_SPIKE;
+			}
+		}
+	}
 
-void axn500_print_birthday(struct axn500 *info)
-{
-	_axn500_print_date(&info->settings.bday);
+	held = n? s[0].altitude:0;
+	for (i = 1; i < n; i++) {
+		if (abs(s[i].altitude - held) > hysteresis)
+			held = s[i].altitude;
+		else if (s[i].altitude != held) {
+			s[i].altitude = held;
+			s[i].quality |= AXN500_SAMPLE_ALT_HELD;
+		}
+	}
 }
 
-void _axn500_print_limit(struct axn500_limit *limit)
+static void axn500_clean_samples(struct axn500_exercise *e)
 {
-	printf("%02i/%02i", limit->lower, limit->upper);
+	axn500_fill_dropouts(e->data, e->entries, axn500_clean.gap);
+	if (axn500_clean.spike)
+		axn500_despike_hr(e->data, e->entries, axn500_clean.spike);
+	axn500_clean_altitude(e->data, e->entries, axn500_clean.jump,
+			      axn500_clean.hysteresis);
 }
 
-void axn500_print_activity_level(struct axn500 *info)
+/*
+ * For the exercises that weren't cleaned while decoding: those read back
+ * from an archive or a store, or decoded to be stored first. Cleans them
+ * and rebuilds their summaries.
+ */
+static void axn500_clean_exercises(struct axn500 *info)
 {
-	switch (info->settings.activity) {
-	case AXN500_SETTINGS_ACTIVITY_LOW:
-		printf("low");
-		break;
-	case AXN500_SETTINGS_ACTIVITY_MEDIUM:
-		printf("medium");
-		break;
-	case AXN500_SETTINGS_ACTIVITY_HIGH:
-		printf("high");
-		break;
-	case AXN500_SETTINGS_ACTIVITY_TOP:
-		printf("top");
-		break;
+	struct axn500_exercise *e;
+	int i, j;
+
+	for (i = 0; i < info->exercises.num; i++) {
+		e = &info->exercises.exercise[i];
+		if (e->data == NULL)
+			continue;
+		axn500_clean_samples(e);
+		for (j = 0; j < e->entries; j++)
+			axn500_pyramid_add(e, j);
 	}
 }
 
-void axn500_print_activity_button_sound(struct axn500 *info)
+/* each sample is 3 bytes: the HR and the altitude */
+static void axn500_decode_entry(const char *ptr, struct axn500_entry *entry)
 {
-	printf("%s", (info->settings.activity_button_sound)? "on":"off");
+	entry->hr = ptr[0];
+	entry->quality = 0;
+	/* the altitude is stored as little endian short, 0x300 is 0 */
+	entry->altitude = ((ptr[2] << 8) + (unsigned char)ptr[1]) - 0x300;
 }
 
-void axn500_print_intro_animations(struct axn500 *info)
+static void axn500_decode_samples(char *data, int bytes,
+				  struct axn500_exercise *exercise,
+				  struct axn500_ex_bounds *bounds, int clean)
 {
-	printf("%s", (info->settings.intro_animations)? "on":"off");
-}
+	char *ptr = data + bounds->samples;
+	int j;
+
+	for (j = 0; j < exercise->entries; j++) {
+		if ((ptr - data) + 3 > bytes) {
+			fprintf(stderr, "Expected more %i entries "
+				"but no enough data\n",
+				exercise->entries - j);
+			exercise->status = AXN500_EX_TRUNCATED;
+			memset(&exercise->data[j], 0, sizeof(struct axn500_entry) *
+				(exercise->entries - j));
+			break;
+		}
+		axn500_decode_entry(ptr, &exercise->data[j]);
+		ptr += 3;
+	}
 
-void axn500_print_countdown(struct axn500 *info)
-{
-	printf("%02i:%02i:%02i",
-		info->settings.countdown.hour,
-		info->settings.countdown.minute,
-		info->settings.countdown.second);
+	if (clean)
+		axn500_clean_samples(exercise);
+	for (j = 0; j < exercise->entries; j++)
+		axn500_pyramid_add(exercise, j);
 }
 
-void axn500_print_sex(struct axn500 *info)
+static int axn500_threads;
+
+struct axn500_decode_job {
+	char *data;
+	int bytes;
+	struct axn500 *info;
+	struct axn500_ex_bounds *bounds;
+	int clean;
+	int next;
+};
+
+static void *axn500_decode_worker(void *arg)
 {
-	printf("%s", (info->settings.sex == AXN500_SETTINGS_SEX_MALE)? "male":"female");
+	struct axn500_decode_job *job = arg;
+	int ex;
+
+	while ((ex = __sync_fetch_and_add(&job->next, 1)) < job->info->exercises.num) {
+		axn500_trace(AXN500_TRACE_PARSE, AXN500_TRACE_PARSE_DECODE, ex);
+		axn500_decode_samples(job->data, job->bytes,
+				      &job->info->exercises.exercise[ex],
+				      &job->bounds[ex], job->clean);
+	}
+	return NULL;
 }
 
-void axn500_print_htouch(struct axn500 *info)
+static void axn500_decode_all(struct axn500_decode_job *job)
 {
-	switch (info->settings.htouch) {
-	case AXN500_SETTINGS_HTOUCH_OFF:
-		printf("off");
-		break;
-	case AXN500_SETTINGS_HTOUCH_LIGHT:
-		printf("light");
-		break;
-	case AXN500_SETTINGS_HTOUCH_SWITCH_DISPLAY:
-		printf("switch display");
-		break;
-	case AXN500_SETTINGS_HTOUCH_TAKE_LAP:
-		printf("take lap");
-		break;
+	pthread_t *threads;
+	int i, nthreads = axn500_threads;
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > job->info->exercises.num)
+		nthreads = job->info->exercises.num;
+
+	threads = NULL;
+	if (nthreads > 1) {
+		threads = malloc(sizeof(pthread_t) * (nthreads - 1));
+		axn500_profile_alloc(AXN500_ALLOC_PARSE,
+				     sizeof(pthread_t) * (nthreads - 1));
+	}
+	for (i = 0; threads && i < nthreads - 1; i++) {
+		if (pthread_create(&threads[i], NULL, axn500_decode_worker, job))
+			break;
 	}
+	dprintf("Decoding samples using %i threads\n", threads? i + 1:1);
+
+	/* this thread works too and picks whatever the others didn't */
+	axn500_decode_worker(job);
+	while (threads && i--)
+		pthread_join(threads[i], NULL);
+	free(threads);
 }
 
-static void axn500_print_info(struct axn500 *info)
+static void axn500_free_exercises(struct axn500 *info)
 {
-	int i;
+	axn500_arena_release(&info->exercises.arena);
+	info->exercises.num = 0;
+	info->exercises.exercise = NULL;
+	info->exercises.num_errors = 0;
+	info->exercises.errors = NULL;
+}
 
-	printf("Date: (dd/mm/yy)\n\t");
-	axn500_print_date(info);
-	printf("\n");
+/* 'clean' runs the -c cleaning on the samples while decoding them */
+static int axn500_parse_dump(char *data, int num_ex, int bytes,
+			     struct axn500 *info, int clean)
+{
+	struct axn500_decode_job job;
+	struct axn500_ex_bounds *bounds;
+	struct axn500_exercise *exercise;
+	int ex;
 
-	printf("Clock:\n");
-	for (i = 0; i < 2; i++) {
-		printf("\tTime %i", i);
-		axn500_print_timezone(info, i);
-		printf("\n");
+	dprintf("Parsing data for %i exercises, %i bytes\n", num_ex, bytes);
+	/*
+	 * there can't be more samples than 3 bytes each in the dump, so a
+	 * single chunk usually holds everything
+	 */
+	memset(&info->exercises, 0, sizeof(info->exercises));
+	if (axn500_arena_grow(&info->exercises.arena,
+			(sizeof(struct axn500_exercise) + sizeof(struct axn500_parse_error) +
+			 sizeof(struct axn500_ex_bounds) + 4 * AXN500_ARENA_ALIGN) * num_ex +
+			axn500_samples_size(bytes / 3) +
+			num_ex * AXN500_PYRAMID_LEVELS * (sizeof(struct axn500_pyramid_point) +
+							  AXN500_ARENA_ALIGN))) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
 	}
-	printf("Alarms:\n");
-	for (i = 0; i < 3; i++) {
-		printf("\t");
-		axn500_print_alarm(info, i);
-		printf("\n");
+	info->exercises.num = num_ex;
+	info->exercises.exercise = axn500_arena_zalloc(&info->exercises.arena,
+				sizeof(struct axn500_exercise) * num_ex);
+	info->exercises.errors = axn500_arena_alloc(&info->exercises.arena,
+				sizeof(struct axn500_parse_error) * num_ex);
+	bounds = axn500_arena_alloc(&info->exercises.arena,
+				sizeof(struct axn500_ex_bounds) * num_ex);
+	if (info->exercises.exercise == NULL || info->exercises.errors == NULL ||
+	    bounds == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		axn500_free_exercises(info);
+		return 1;
 	}
 
-	printf("Reminders:\n");
-	for (i = 0; i < 5; i++) {
-		printf("\t");
-		axn500_print_reminder(info, i);
-		printf("\n");
+	axn500_trace(AXN500_TRACE_PARSE, AXN500_TRACE_PARSE_SCAN, num_ex);
+	if (axn500_scan_exercises(data, num_ex, bytes, info, bounds)) {
+		axn500_free_exercises(info);
+		return 1;
 	}
 
-	printf("Settings:\n");
-	printf("\tBirthday: ");
-	axn500_print_birthday(info);
-	printf("\n");
-	printf("\tHeight: %icm\n", info->settings.height);
-	printf("\tWeight: %ilb\n", info->settings.weight);
-	printf("\tRecord Rate: %is\n", info->settings.record_rate);
-	printf("\tActivity level: ");
-	axn500_print_activity_level(info);
-	printf("\n");
-	printf("\tHR max: %i\n", info->settings.hrmax);
-	printf("\tVOmax: %i\n", info->settings.vomax);
-	printf("\tSit HR: %i\n", info->settings.sit_hr);
-	printf("\tActivity button sound: ");
-	axn500_print_activity_button_sound(info);
-	printf("\n");
-	printf("\tIntro animations: ");
-	axn500_print_intro_animations(info);
-	printf("\n");
-	printf("\tUnits: %s\n", (info->settings.imperial)? "imperial":"metric");
-	printf("\tDeclination: %i\n", info->settings.declination);
-	printf("\tCountdown (hh:mm:ss): ");
-	axn500_print_countdown(info);
-	printf("\n");
-	printf("\tSex: ");
-	axn500_print_sex(info);
-	printf("\n");
-	printf("\tHeart touch: ");
-	axn500_print_htouch(info);
-	printf("\n");
-}
+	for (ex = 0; ex < num_ex; ex++) {
+		exercise = &info->exercises.exercise[ex];
+		if (exercise->entries == 0)
+			continue;
+		if (axn500_alloc_samples(&info->exercises.arena, exercise)) {
+			fprintf(stderr, "No enough memory\n");
+			axn500_free_exercises(info);
+			return 1;
+		}
+	}
 
-int axn500_init(void)
-{
-	int fd;
+	job.data = data;
+	job.bytes = bytes;
+	job.info = info;
+	job.bounds = bounds;
+	job.clean = clean;
+	job.next = 0;
+	axn500_decode_all(&job);
+	axn500_trace(AXN500_TRACE_PARSE, AXN500_TRACE_PARSE_DONE, num_ex);
 
-	fd = socket(AF_IRDA, SOCK_STREAM, 0);
-	if (fd < 0)
-		perror("Unable to create socket");
+	for (ex = 0; ex < num_ex; ex++) {
+		exercise = &info->exercises.exercise[ex];
+		if (exercise->status == AXN500_EX_TRUNCATED)
+			axn500_add_parse_error(info, ex, AXN500_EX_TRUNCATED,
+					       bounds[ex].header, 0);
+	}
 
-	return fd;
+	return 0;
 }
 
-int axn500_connect(int fd, int wait)
+static int axn500_parse_exercises(char *data, int num_ex, int bytes,
+				  struct axn500 *info, int clean)
 {
-	struct sockaddr_irda addr;
+	struct axn500_span span;
+	int rc;
 
-	do {
-		if (irda_discover_devices(fd, &addr, 10)) {
-			if (errno == EAGAIN) {
-				/* keep trying */
-				sleep(1);
-				continue;
-			}
-			perror("Error scanning for devices");
-			return 1;
-		} else
-			break;
-	} while(wait);
+	axn500_profile_begin(&span);
+	rc = axn500_parse_dump(data, num_ex, bytes, info, clean);
+	axn500_profile_end(&span, AXN500_PHASE_PARSE);
+	return rc;
+}
 
-	addr.sir_family = AF_IRDA;
-	strncpy(addr.sir_name, "HRM", sizeof(addr.sir_name));
-	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
-		perror("Error connecting");
-		return 1;
+/* the lost exercises first, then the truncated ones, which kept some samples */
+static void axn500_print_parse_errors(struct axn500 *info, FILE *output)
+{
+	struct axn500_parse_error *err;
+	int i, truncated = 0;
+
+	for (i = 0; i < info->exercises.num_errors; i++)
+		if (info->exercises.errors[i].status == AXN500_EX_TRUNCATED)
+			truncated++;
+
+	if (info->exercises.num_errors > truncated)
+		fprintf(output, "%i of %i exercises couldn't be recovered:\n",
+			info->exercises.num_errors - truncated,
+			info->exercises.num);
+	for (i = 0; i < info->exercises.num_errors; i++) {
+		err = &info->exercises.errors[i];
+		if (err->status == AXN500_EX_TRUNCATED)
+			continue;
+		if (err->offset < 0)
+			fprintf(output, "\tExercise %i: %s\n", err->exercise,
+				axn500_ex_status[err->status]);
+		else
+			fprintf(output, "\tExercise %i: %s at offset %i, "
+				"skipped %i bytes\n", err->exercise,
+				axn500_ex_status[err->status], err->offset,
+				err->skipped);
 	}
-	dprintf("connected\n");
 
-	return 0;
+	if (truncated)
+		fprintf(output, "%i of %i exercises were only partly recovered:\n",
+			truncated, info->exercises.num);
+	for (i = 0; i < info->exercises.num_errors; i++) {
+		err = &info->exercises.errors[i];
+		if (err->status == AXN500_EX_TRUNCATED)
+			fprintf(output, "\tExercise %i: %s at offset %i, the "
+				"missing samples are 0\n", err->exercise,
+				axn500_ex_status[err->status], err->offset);
+	}
 }
 
-void axn500_set_debug(int debug)
+/*
+ * Views over the exercises of a dump, for when only a few header fields or
+ * a single exercise are wanted. Nothing is allocated: finding an exercise
+ * only walks the headers before it, the header fields are read from the
+ * dump when asked for and the samples are decoded while iterating over
+ * them. The dump (read or mmap()ed) must stay around while it's viewed.
+ */
+#define AXN500_VIEW_MAX_EX	256
+
+struct axn500_dump_view {
+	const char *data;
+	int bytes;
+	int num_ex;
+	int scanned;			/* exercises found so far */
+	int offset[AXN500_VIEW_MAX_EX];	/* of each header in data */
+};
+
+struct axn500_ex_view {
+	const char *header;
+	int header_size;
+	int entries;			/* expected from the duration */
+	int available;			/* actually in the dump */
+};
+
+struct axn500_sample_iter {
+	const char *ptr;
+	int index;
+	int end;
+};
+
+static void axn500_dump_view_init(struct axn500_dump_view *view,
+				  const char *data, int num_ex, int bytes)
 {
-	axn500_debug = debug;
+	view->data = data;
+	view->bytes = bytes;
+	view->num_ex = num_ex;
+	view->scanned = 0;
+	view->offset[0] = 5;
 }
 
-int axn500_fetch_all(int fd, struct axn500 *info)
+static void axn500_view_time(const char *ptr, struct axn500_time *t)
 {
-	int i, rc;
-	int cmds[] = { AXN500_CMD_GET_TIME,
-		       AXN500_CMD_GET_REMINDER1,
-		       AXN500_CMD_GET_REMINDER2,
-		       AXN500_CMD_GET_REMINDER3,
-		       AXN500_CMD_GET_REMINDER4,
-		       AXN500_CMD_GET_REMINDER5,
-		       AXN500_CMD_GET_SETTINGS,
-		       -1 };
+	t->second = axn500_parse_hex(ptr[0]);
+	t->minute = axn500_parse_hex(ptr[1]);
+	t->hour = axn500_parse_hex(ptr[2]);
+}
 
-	for (i = 0; cmds[i] != -1; i++) {
-		rc = axn500_get_data(fd, i, info);
-		if (rc)
-			return rc;
-	}
+static int axn500_view_time_ok(const char *ptr)
+{
+	struct axn500_time t;
 
+	axn500_view_time(ptr, &t);
+	return t.hour <= 23 && t.minute <= 59 && t.second <= 59;
+}
+
+static int axn500_view_check(struct axn500_dump_view *view, int offset)
+{
+	const char *ptr = view->data + offset;
+	int markers;
+
+	/* any count the parser and the resync accept, all of it in the dump */
+	if (offset + EX_HEADER_SIZE > view->bytes)
+		return AXN500_EX_BAD_HEADER;
+	markers = (unsigned char)ptr[EX_MARKERNUM_OFFSET];
+	if (markers < 1 || markers > EX_MAX_MARKERS ||
+	    offset + EX_HEADER_SIZE + (markers - 1) * EX_MARKER_SIZE > view->bytes)
+		return AXN500_EX_BAD_HEADER;
+	if (!axn500_view_time_ok(ptr + EX_START_TIME_OFFSET))
+		return AXN500_EX_BAD_START_TIME;
+	if (!axn500_view_time_ok(ptr + EX_DURATION_OFFSET))
+		return AXN500_EX_BAD_DURATION;
 	return 0;
 }
 
-/* client application */
-static int show_all(int wait)
+/*
+ * Points 'ex' at exercise 'n', returns 0 or the AXN500_EX_* status telling
+ * why it can't be found. Unlike the parser this doesn't resynchronize after
+ * a bad header.
+ */
+static int axn500_view_exercise(struct axn500_dump_view *view, int n,
+				struct axn500_ex_view *ex)
 {
-	int rc, fd = axn500_init();
-	struct axn500 info;
+	struct axn500_time t;
+	const char *ptr;
+	int offset, seconds, status;
+
+	if (n < 0 || n >= view->num_ex || n >= AXN500_VIEW_MAX_EX)
+		return AXN500_EX_MISSING;
+
+	for (;;) {
+		offset = view->offset[view->scanned < n? view->scanned:n];
+		status = axn500_view_check(view, offset);
+		if (status)
+			return status;
+		ptr = view->data + offset;
+		ex->header = ptr;
+		ex->header_size = EX_HEADER_SIZE +
+			((unsigned char)ptr[EX_MARKERNUM_OFFSET] - 1) * EX_MARKER_SIZE;
+		axn500_view_time(ptr + EX_DURATION_OFFSET, &t);
+		seconds = t.hour * 3600 + t.minute * 60 + t.second;
+		ex->entries = seconds / 5 + ((seconds % 5)? 1:0);
+		ex->available = (view->bytes - offset - ex->header_size) / 3;
+		if (ex->available > ex->entries)
+			ex->available = ex->entries;
+		if (ex->available < 0)
+			ex->available = 0;
+		if (view->scanned >= n)
+			return 0;
+
+		/* the next one begins right after the samples */
+		view->scanned++;
+		if (view->scanned < AXN500_VIEW_MAX_EX)
+			view->offset[view->scanned] = offset +
+				ex->header_size + ex->entries * 3;
+	}
+}
 
-	if (fd < 0)
-		return fd;
+static int axn500_view_day(struct axn500_ex_view *ex)
+{
+	return ex->header[EX_DAY_OFFSET];
+}
 
-	rc = axn500_connect(fd, wait);
-	if (rc)
-		return rc;
+static void axn500_view_start_time(struct axn500_ex_view *ex,
+				   struct axn500_time *t)
+{
+	axn500_view_time(ex->header + EX_START_TIME_OFFSET, t);
+}
 
-	rc = axn500_fetch_all(fd, &info);
-	if (rc)
-		return rc;
+static void axn500_view_duration(struct axn500_ex_view *ex,
+				 struct axn500_time *t)
+{
+	axn500_view_time(ex->header + EX_DURATION_OFFSET, t);
+}
 
-	axn500_print_info(&info);
-	return 0;
+static int axn500_view_max_hr(struct axn500_ex_view *ex)
+{
+	return (unsigned char)ex->header[EX_MAX_HR_OFFSET];
 }
 
-static int get_value(char *value, int wait)
+static int axn500_view_avg_hr(struct axn500_ex_view *ex)
 {
-	int rc, fd = axn500_init(), i, done_data = 0, multi = 0;
-	struct axn500 info;
-	char *ptr, *start = value, *saved;
-	struct {
-		char *name;
-		int cmd;
-	} values[] = {
-		/* FIXME: be more specific, e.g. alarm1.date */
-		{ "alarm1", AXN500_CMD_GET_TIME },
-		{ "alarm2", AXN500_CMD_GET_TIME },
-		{ "alarm3", AXN500_CMD_GET_TIME },
-		{ "reminder1", AXN500_CMD_GET_REMINDER1 },
-		{ "reminder2", AXN500_CMD_GET_REMINDER2 },
-		{ "reminder3", AXN500_CMD_GET_REMINDER3 },
-		{ "reminder4", AXN500_CMD_GET_REMINDER4 },
-		{ "reminder5", AXN500_CMD_GET_REMINDER5 },
-		{ "timezone1", AXN500_CMD_GET_TIME },
-		{ "timezone2", AXN500_CMD_GET_TIME },
-		{ "timezone", AXN500_CMD_GET_TIME },
-		{ "ampm", AXN500_CMD_GET_TIME },
-		{ "date", AXN500_CMD_GET_TIME },
-		{ "birthday", AXN500_CMD_GET_SETTINGS },
-		{ "height", AXN500_CMD_GET_SETTINGS },
-		{ "weight", AXN500_CMD_GET_SETTINGS },
-		{ "record_rate", AXN500_CMD_GET_SETTINGS },
-		{ "activity", AXN500_CMD_GET_SETTINGS },
-		{ "hrmax", AXN500_CMD_GET_SETTINGS },
-		{ "vomax", AXN500_CMD_GET_SETTINGS },
-		{ "sit_hr", AXN500_CMD_GET_SETTINGS },
-		{ "activity_button_sound", AXN500_CMD_GET_SETTINGS },
-		{ "intro_animations", AXN500_CMD_GET_SETTINGS },
-		{ "imperial", AXN500_CMD_GET_SETTINGS },
-		{ "declination", AXN500_CMD_GET_SETTINGS },
-		{ "countdown", AXN500_CMD_GET_SETTINGS },
-		{ "sex", AXN500_CMD_GET_SETTINGS },
-		{ "htouch", AXN500_CMD_GET_SETTINGS },
-		{ NULL, 0 },
-	};
+	return (unsigned char)ex->header[EX_AVG_HR_OFFSET];
+}
 
-	if (!strcmp(value, "help")) {
-		for (i = 0; values[i].name != NULL; i++)
-			printf("%s\n", values[i].name);
+static int axn500_view_kcal(struct axn500_ex_view *ex)
+{
+	return (unsigned short)((ex->header[EX_KCAL_OFFSET + 1] << 8) +
+				(unsigned char)ex->header[EX_KCAL_OFFSET]);
+}
+
+static void axn500_view_samples(struct axn500_ex_view *ex,
+				struct axn500_sample_iter *it)
+{
+	it->ptr = ex->header + ex->header_size;
+	it->index = 0;
+	it->end = ex->available;
+}
+
+/* decodes the next sample into 'entry', returns 0 when there are no more */
+static int axn500_view_next(struct axn500_sample_iter *it,
+			    struct axn500_entry *entry)
+{
+	if (it->index >= it->end)
 		return 0;
-	}
+	axn500_decode_entry(it->ptr, entry);
+	it->ptr += 3;
+	it->index++;
+	return 1;
+}
 
-	if (fd < 0)
-		return fd;
+/*
+ * Windowed analytics
+ *
+ * For every requested window: the best average HR (from prefix sums) and
+ * the best ascent (altitude difference across the window). Then the
+ * recoveries after the intervals: an interval peak is a sample that is the
+ * highest HR in the AXN500_PEAK_WINDOW seconds around it and at least
+ * AXN500_RECOVERY_DROP bpm above the lowest, and its recovery is the time
+ * until the HR drops that much, if that happens within
+ * AXN500_RECOVERY_MAX seconds. The window maximum and minimum come from
+ * monotonic deques, so everything is O(samples) whatever the windows.
+ */
+#define AXN500_MAX_WINDOWS	8
+#define AXN500_PEAK_WINDOW	120	/* s, each side */
+#define AXN500_RECOVERY_DROP	30	/* bpm */
+#define AXN500_RECOVERY_MAX	600	/* s */
+
+struct axn500_window {
+	int size;
+	int seconds;		/* size is in seconds instead of samples */
+};
 
-	rc = axn500_connect(fd, wait);
-	if (rc)
-		return rc;
+struct axn500_window_result {
+	int samples;		/* window size, 0 if longer than the exercise */
+	/* the ascent spans samples - 1 intervals, none with a single sample */
+	double best_hr;
+	int best_hr_start;
+	int best_ascent;	/* m */
+	int best_ascent_start;
+};
 
-	if (strchr(value, ',')) {
-		/* multiple values, fetch all the data */
-		rc = axn500_fetch_all(fd, &info);
-		if (rc)
-			return rc;
-		done_data = 1;
+struct axn500_analysis {
+	struct axn500_window_result window[AXN500_MAX_WINDOWS];
+	int recoveries;
+	int recovery_samples;	/* sum of all the recoveries */
+};
+
+static int axn500_window_samples(struct axn500_window *w,
+				 struct axn500_exercise *e)
+{
+	if (!w->seconds)
+		return w->size;
+	/* the nearest number of samples, the label shows what's really used */
+	return e->record_rate? (w->size + e->record_rate / 2) / e->record_rate:0;
+}
+
+/*
+ * out[i] is the maximum (sign 1) or the minimum (sign -1) of
+ * v[i - w] .. v[i + w]. 'deque' has room for n indexes.
+ */
+static void axn500_sliding_extreme(const int *v, int n, int w, int sign,
+				   int *out, int *deque)
+{
+	int i, head = 0, tail = 0;
+
+	for (i = 0; i < n + w; i++) {
+		if (i < n) {
+			while (tail > head && sign * v[deque[tail - 1]] <= sign * v[i])
+				tail--;
+			deque[tail++] = i;
+		}
+		if (deque[head] < i - 2 * w)
+			head++;
+		if (i >= w)
+			out[i - w] = v[deque[head]];
 	}
+}
 
-	while (1) {
-		ptr = strtok_r(start, ",", &saved);
-		if (ptr == NULL)
-			break;
-		start = NULL;
+static int axn500_analyze_exercise(struct axn500_exercise *e,
+				   struct axn500_window *windows, int num,
+				   struct axn500_analysis *a)
+{
+	struct axn500_window_result *r;
+	long long *sum;
+	int *hr, *wmax, *wmin, *deque;
+	int i, k, n = e->entries, w, peak_w, last_peak, target, end;
+
+	memset(a, 0, sizeof(*a));
+	sum = malloc(sizeof(*sum) * (n + 1));
+	hr = malloc(sizeof(*hr) * (n + 1) * 4);
+	if (sum == NULL || hr == NULL) {
+		free(sum);
+		free(hr);
+		return 1;
+	}
+	wmax = hr + n + 1;
+	wmin = wmax + n + 1;
+	deque = wmin + n + 1;
+
+	sum[0] = 0;
+	for (i = 0; i < n; i++) {
+		hr[i] = e->data[i].hr;
+		sum[i + 1] = sum[i] + hr[i];
+	}
 
-		for (i = 0; values[i].name != NULL && strcmp(values[i].name, ptr); i++)
-			;
+	for (k = 0; k < num; k++) {
+		r = &a->window[k];
+		w = axn500_window_samples(&windows[k], e);
+		if (w <= 0 || w > n)
+			continue;
+		r->samples = w;
+		r->best_ascent = INT_MIN;
+		for (i = 0; i + w <= n; i++) {
+			if (sum[i + w] - sum[i] > r->best_hr * w) {
+				r->best_hr = (double)(sum[i + w] - sum[i]) / w;
+				r->best_hr_start = i;
+			}
+			if (w > 1 &&
+			    e->data[i + w - 1].altitude - e->data[i].altitude >
+			    r->best_ascent) {
+				r->best_ascent = e->data[i + w - 1].altitude -
+						 e->data[i].altitude;
+				r->best_ascent_start = i;
+			}
+		}
+	}
 
-		if (values[i].name == NULL) {
-			fprintf(stderr, "value %s unsupported\n", ptr);
-			return -1;
+	peak_w = e->record_rate? AXN500_PEAK_WINDOW / e->record_rate:0;
+	if (peak_w > 0 && n > 0) {
+		axn500_sliding_extreme(hr, n, peak_w, 1, wmax, deque);
+		axn500_sliding_extreme(hr, n, peak_w, -1, wmin, deque);
+		last_peak = -peak_w - 1;
+		for (i = 0; i < n; i++) {
+			if (hr[i] != wmax[i] || i - last_peak <= peak_w ||
+			    hr[i] - wmin[i] < AXN500_RECOVERY_DROP)
+				continue;
+			last_peak = i;
+			target = hr[i] - AXN500_RECOVERY_DROP;
+			end = i + AXN500_RECOVERY_MAX / e->record_rate;
+			for (k = i + 1; k < n && k <= end && hr[k] > target; k++)
+				;
+			/* 0 is a dropout, not a recovery */
+			if (k < n && k <= end && hr[k] > 0) {
+				a->recoveries++;
+				a->recovery_samples += k - i;
+			}
 		}
+	}
 
-		if (done_data == 0) {
-			rc = axn500_get_data(fd, values[i].cmd, &info);
-			if (rc)
-				return -1;
-		} 
+	free(sum);
+	free(hr);
+	return 0;
+}
 
-		if (multi)
-			printf(";");
+struct axn500_analysis_job {
+	struct axn500 *info;
+	struct axn500_window *windows;
+	int num_windows;
+	struct axn500_analysis *results;
+	int next;
+	int failed;
+};
 
-		if (!strcmp(values[i].name, "alarm1")) {
-			axn500_print_alarm(&info, 0);
-		} else if (!strcmp(values[i].name, "alarm2")) {
-			axn500_print_alarm(&info, 1);
-		} else if (!strcmp(values[i].name, "alarm3")) {
-			axn500_print_alarm(&info, 2);
-		} else if (!strcmp(values[i].name, "reminder1")) {
-			axn500_print_reminder(&info, 0);
-		} else if (!strcmp(values[i].name, "reminder2")) {
-			axn500_print_reminder(&info, 1);
+static void *axn500_analysis_worker(void *arg)
+{
+	struct axn500_analysis_job *job = arg;
+	int ex;
+
+	while ((ex = __sync_fetch_and_add(&job->next, 1)) < job->info->exercises.num)
+		if (axn500_analyze_exercise(&job->info->exercises.exercise[ex],
+					    job->windows, job->num_windows,
+					    &job->results[ex]))
+			job->failed = 1;
+	return NULL;
+}
+
+/* analyzes all the exercises, spread over the decoding threads */
+static int axn500_analyze_all(struct axn500 *info, struct axn500_window *windows,
+			      int num_windows, struct axn500_analysis *results)
+{
+	struct axn500_analysis_job job = { info, windows, num_windows,
+					   results, 0, 0 };
+	pthread_t *threads;
+	int i, nthreads = axn500_threads;
+
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads > info->exercises.num)
+		nthreads = info->exercises.num;
+
+	threads = NULL;
+	if (nthreads > 1)
+		threads = malloc(sizeof(pthread_t) * (nthreads - 1));
+	for (i = 0; threads && i < nthreads - 1; i++)
+		if (pthread_create(&threads[i], NULL, axn500_analysis_worker, &job))
+			break;
+
+	axn500_analysis_worker(&job);
+	while (threads && i--)
+		pthread_join(threads[i], NULL);
+	free(threads);
+
+	return job.failed;
+}
+
+/*
+ * Exporters
+ *
+ * Each exporter writes the exercises in some format to its own stream.
+ * axn500_export() walks the decoded exercises once and hands each sample to
+ * all the exporters, so writing several formats costs a single pass. The
+ * timestamps are absolute, in UTC: the start of the exercise plus the
+ * record rate times the sample number.
+ */
+struct axn500_export_sample {
+	int exercise;
+	int index;
+	time_t time;
+	char stamp[24];			/* time in ISO 8601 */
+	struct axn500_entry *entry;
+};
+
+struct axn500_exporter;
+
+struct axn500_export_format {
+	const char *name;
+	int (*begin)(struct axn500_exporter *x, struct axn500 *info);
+	void (*exercise)(struct axn500_exporter *x, int ex,
+			 struct axn500_exercise *e, const char *stamp);
+	void (*sample)(struct axn500_exporter *x,
+		       struct axn500_export_sample *s);
+	void (*end_exercise)(struct axn500_exporter *x);
+	void (*end)(struct axn500_exporter *x);
+};
+
+struct axn500_exporter {
+	const struct axn500_export_format *format;
+	FILE *output;
+};
+
+static void axn500_iso_time(time_t t, char *buff, size_t len)
+{
+	struct tm tm;
+
+	gmtime_r(&t, &tm);
+	strftime(buff, len, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+static int axn500_export_duration(struct axn500_exercise *e)
+{
+	return e->duration.hour * 3600 + e->duration.minute * 60 +
+	       e->duration.second;
+}
+
+static int axn500_csv_begin(struct axn500_exporter *x, struct axn500 *info)
+{
+	fprintf(x->output, "exercise,sample,time,hr,altitude,quality\n");
+	return 0;
+}
+
+static void axn500_csv_sample(struct axn500_exporter *x,
+			      struct axn500_export_sample *s)
+{
+	fprintf(x->output, "%i,%i,%s,%i,%i,%i\n", s->exercise, s->index,
+		s->stamp, s->entry->hr, s->entry->altitude, s->entry->quality);
+}
+
+/*
+ * JSON Lines: an "exercise" object with the header fields, followed by a
+ * "sample" object for each of its samples
+ */
+static void axn500_jsonl_exercise(struct axn500_exporter *x, int ex,
+				  struct axn500_exercise *e, const char *stamp)
+{
+	fprintf(x->output, "{\"type\":\"exercise\",\"exercise\":%i,"
+		"\"watch\":%u,\"start\":\"%s\",\"duration\":%i,"
+		"\"record_rate\":%i,\"samples\":%i,\"avg_hr\":%i,"
+		"\"max_hr\":%i,\"kcal\":%i,\"min_alt\":%i,\"max_alt\":%i,"
+		"\"status\":\"%s\"}\n", ex, e->watch, stamp,
+		axn500_export_duration(e), e->record_rate, e->entries,
+		e->avg_hr, e->max_hr, e->kcal, e->min_alt, e->max_alt,
+		axn500_ex_status[e->status]);
+}
+
+static void axn500_jsonl_sample(struct axn500_exporter *x,
+				struct axn500_export_sample *s)
+{
+	fprintf(x->output, "{\"type\":\"sample\",\"exercise\":%i,\"sample\":%i,"
+		"\"time\":\"%s\",\"hr\":%i,\"altitude\":%i,\"quality\":%i}\n",
+		s->exercise, s->index, s->stamp, s->entry->hr,
+		s->entry->altitude, s->entry->quality);
+}
+
+/*
+ * Garmin Training Center XML, an activity with a single lap for each
+ * exercise. There's no position so GPX, which needs one for each point,
+ * isn't an option.
+ */
+static int axn500_tcx_begin(struct axn500_exporter *x, struct axn500 *info)
+{
+	fprintf(x->output, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<TrainingCenterDatabase xmlns=\"http://www.garmin.com/"
+		"xmlschemas/TrainingCenterDatabase/v2\">\n"
+		" <Activities>\n");
+	return 0;
+}
+
+static void axn500_tcx_exercise(struct axn500_exporter *x, int ex,
+				struct axn500_exercise *e, const char *stamp)
+{
+	fprintf(x->output, "  <Activity Sport=\"Other\">\n"
+		"   <Id>%s</Id>\n"
+		"   <Lap StartTime=\"%s\">\n"
+		"    <TotalTimeSeconds>%i</TotalTimeSeconds>\n"
+		"    <DistanceMeters>0</DistanceMeters>\n"
+		"    <Calories>%i</Calories>\n", stamp, stamp,
+		axn500_export_duration(e), e->kcal);
+	if (e->avg_hr)
+		fprintf(x->output, "    <AverageHeartRateBpm><Value>%i</Value>"
+			"</AverageHeartRateBpm>\n", e->avg_hr);
+	if (e->max_hr)
+		fprintf(x->output, "    <MaximumHeartRateBpm><Value>%i</Value>"
+			"</MaximumHeartRateBpm>\n", e->max_hr);
+	fprintf(x->output, "    <Intensity>Active</Intensity>\n"
+		"    <TriggerMethod>Manual</TriggerMethod>\n"
+		"    <Track>\n");
+}
+
+static void axn500_tcx_sample(struct axn500_exporter *x,
+			      struct axn500_export_sample *s)
+{
+	fprintf(x->output, "     <Trackpoint><Time>%s</Time>"
+		"<AltitudeMeters>%i</AltitudeMeters>", s->stamp,
+		s->entry->altitude);
+	/* a HR of 0 is no HR at all, the schema doesn't allow it */
+	if (s->entry->hr)
+		fprintf(x->output, "<HeartRateBpm><Value>%i</Value>"
+			"</HeartRateBpm>", s->entry->hr);
+	fprintf(x->output, "</Trackpoint>\n");
+}
+
+static void axn500_tcx_end_exercise(struct axn500_exporter *x)
+{
+	fprintf(x->output, "    </Track>\n   </Lap>\n  </Activity>\n");
+}
+
+static void axn500_tcx_end(struct axn500_exporter *x)
+{
+	fprintf(x->output, " </Activities>\n</TrainingCenterDatabase>\n");
+}
+
+/*
+ * NumPy .npy, version 1.0: a one dimensional array of records with a field
+ * for each column, little endian and packed. The header, padded so the data
+ * is 64 byte aligned, has the number of records so they're counted first.
+ */
+#define AXN500_NPY_RECORD	18
+
+static int axn500_npy_begin(struct axn500_exporter *x, struct axn500 *info)
+{
+	char header[256];
+	unsigned char prefix[10] = { 0x93, 'N', 'U', 'M', 'P', 'Y', 1, 0 };
+	long long records = 0;
+	int ex, len, pad;
+
+	for (ex = 0; ex < info->exercises.num; ex++)
+		if (info->exercises.exercise[ex].data)
+			records += info->exercises.exercise[ex].entries;
+
+	len = snprintf(header, sizeof(header), "{'descr': [('exercise', '<u2'), "
+		       "('sample', '<u4'), ('time', '<i8'), ('hr', '|u1'), "
+		       "('quality', '|u1'), ('altitude', '<i2')], "
+		       "'fortran_order': False, 'shape': (%lli,), }", records);
+	pad = 64 - (sizeof(prefix) + len + 1) % 64;
+	if (pad == 64)
+		pad = 0;
+	memset(header + len, ' ', pad);
+	len += pad;
+	header[len++] = '\n';
+	prefix[8] = len & 0xff;
+	prefix[9] = len >> 8;
+
+	if (fwrite(prefix, sizeof(prefix), 1, x->output) != 1 ||
+	    fwrite(header, len, 1, x->output) != 1)
+		return 1;
+	return 0;
+}
+
+static void axn500_npy_sample(struct axn500_exporter *x,
+			      struct axn500_export_sample *s)
+{
+	unsigned char rec[AXN500_NPY_RECORD];
+	long long t = s->time;
+	int i;
+
+	rec[0] = s->exercise;
+	rec[1] = s->exercise >> 8;
+	for (i = 0; i < 4; i++)
+		rec[2 + i] = s->index >> (i * 8);
+	for (i = 0; i < 8; i++)
+		rec[6 + i] = t >> (i * 8);
+	rec[14] = s->entry->hr;
+	rec[15] = s->entry->quality;
+	rec[16] = s->entry->altitude & 0xff;
+	rec[17] = (s->entry->altitude >> 8) & 0xff;
+	fwrite(rec, sizeof(rec), 1, x->output);
+}
+
+static const struct axn500_export_format axn500_export_formats[] = {
+	{
+		.name = "csv",
+		.begin = axn500_csv_begin,
+		.sample = axn500_csv_sample,
+	},
+	{
+		.name = "jsonl",
+		.exercise = axn500_jsonl_exercise,
+		.sample = axn500_jsonl_sample,
+	},
+	{
+		.name = "tcx",
+		.begin = axn500_tcx_begin,
+		.exercise = axn500_tcx_exercise,
+		.sample = axn500_tcx_sample,
+		.end_exercise = axn500_tcx_end_exercise,
+		.end = axn500_tcx_end,
+	},
+	{
+		.name = "npy",
+		.begin = axn500_npy_begin,
+		.sample = axn500_npy_sample,
+	},
+};
+#define AXN500_EXPORT_FORMATS \
+	(sizeof(axn500_export_formats) / sizeof(axn500_export_formats[0]))
+
+static const struct axn500_export_format *axn500_export_format(const char *name)
+{
+	int i;
+
+	for (i = 0; i < AXN500_EXPORT_FORMATS; i++)
+		if (!strcmp(axn500_export_formats[i].name, name))
+			return &axn500_export_formats[i];
+	return NULL;
+}
+
+/*
+ * Writes the exercises that have samples with all 'num' exporters, returns
+ * non zero if any of the streams had an error
+ */
+static int axn500_export(struct axn500 *info, struct axn500_exporter *x,
+			 int num)
+{
+	struct axn500_export_sample s;
+	struct axn500_exercise *e;
+	char stamp[24];
+	int ex, i, rc = 0;
+
+	for (i = 0; i < num; i++) {
+		if (x[i].format->begin && x[i].format->begin(&x[i], info))
+			rc = 1;
+	}
+
+	for (ex = 0; ex < info->exercises.num; ex++) {
+		e = &info->exercises.exercise[ex];
+		if (e->data == NULL)
+			continue;
+		axn500_iso_time(e->start, stamp, sizeof(stamp));
+		for (i = 0; i < num; i++)
+			if (x[i].format->exercise)
+				x[i].format->exercise(&x[i], ex, e, stamp);
+
+		s.exercise = ex;
+		for (s.index = 0; s.index < e->entries; s.index++) {
+			s.time = e->start + s.index * e->record_rate;
+			s.entry = &e->data[s.index];
+			axn500_iso_time(s.time, s.stamp, sizeof(s.stamp));
+			for (i = 0; i < num; i++)
+				x[i].format->sample(&x[i], &s);
+		}
+
+		for (i = 0; i < num; i++)
+			if (x[i].format->end_exercise)
+				x[i].format->end_exercise(&x[i]);
+	}
+
+	for (i = 0; i < num; i++) {
+		if (x[i].format->end)
+			x[i].format->end(&x[i]);
+		if (fflush(x[i].output) || ferror(x[i].output))
+			rc = 1;
+	}
+	return rc;
+}
+
+/*
+ * Compressed exercise archive
+ *
+ * Decoded exercises can be appended to an archive file. Each exercise is
+ * stored as a self contained record:
+ *
+ * | magic | size | exercise header | block directory | payloads | padding |
+ *   4       4      31 (45)           13 * 2 * blocks
+ *
+ * magic is "AXZ" followed by the record version. Version 2 adds to the
+ * header the watch address (u32), the absolute start time (s64) and the
+ * record rate (u16), so the samples can be placed on a global timeline.
+ * The HR and altitude columns are split in blocks of AXN500_Z_BLOCK
+ * samples, and each block is stored as its first value plus the zigzag
+ * encoded deltas between consecutive samples, bit packed using the
+ * smallest width that fits all deltas in the block. The block directory
+ * has, for each block of each column:
+ *	sample count (u16), min (s16), max (s16), first value (s16),
+ *	bits per delta (u8), payload offset from the record start (u32)
+ * All values are little endian. The padding at the end makes sure the
+ * unpacker can always load 8 bytes at once.
+ */
+#define AXN500_Z_MAGIC		"AXZ"
+#define AXN500_Z_VERSION	2
+#define AXN500_Z_BLOCK		128
+#define AXN500_Z_HDR_SIZE_V1	39
+#define AXN500_Z_HDR_SIZE	53
+#define AXN500_Z_BLKHDR_SIZE	13
+#define AXN500_Z_PADDING	8
+
+enum {
+	AXN500_Z_HR = 0,
+	AXN500_Z_ALT,
+	AXN500_Z_COLUMNS,
+};
+
+struct axn500_zblock {
+	int count;
+	int min;
+	int max;
+	int first;
+	int bits;
+	unsigned int offset;
+};
+
+struct axn500_buf {
+	unsigned char *data;
+	int len;
+	int size;
+};
+
+static int axn500_buf_reserve(struct axn500_buf *buf, int len)
+{
+	unsigned char *tmp;
+	int size;
+
+	if (buf->len + len <= buf->size)
+		return 0;
+	size = buf->size? buf->size:4096;
+	while (size < buf->len + len)
+		size *= 2;
+	tmp = realloc(buf->data, size);
+	if (tmp == NULL)
+		return 1;
+	buf->data = tmp;
+	buf->size = size;
+	return 0;
+}
+
+static void axn500_put8(unsigned char *p, unsigned int v)
+{
+	p[0] = v;
+}
+
+static void axn500_put16(unsigned char *p, unsigned int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void axn500_put32(unsigned char *p, unsigned int v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static void axn500_put64(unsigned char *p, unsigned long long v)
+{
+	axn500_put32(p, v);
+	axn500_put32(p + 4, v >> 32);
+}
+
+static unsigned int axn500_get16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static unsigned int axn500_get32(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static long long axn500_get64(const unsigned char *p)
+{
+	return axn500_get32(p) | ((unsigned long long)axn500_get32(p + 4) << 32);
+}
+
+static int axn500_column_value(struct axn500_exercise *e, int column, int i)
+{
+	if (column == AXN500_Z_HR)
+		return e->data[i].hr;
+	return e->data[i].altitude;
+}
+
+static void axn500_put_zblock(unsigned char *p, struct axn500_zblock *b)
+{
+	axn500_put16(p, b->count);
+	axn500_put16(p + 2, b->min);
+	axn500_put16(p + 4, b->max);
+	axn500_put16(p + 6, b->first);
+	axn500_put8(p + 8, b->bits);
+	axn500_put32(p + 9, b->offset);
+}
+
+static void axn500_get_zblock(const unsigned char *p, struct axn500_zblock *b)
+{
+	b->count = axn500_get16(p);
+	b->min = (signed short)axn500_get16(p + 2);
+	b->max = (signed short)axn500_get16(p + 4);
+	b->first = (signed short)axn500_get16(p + 6);
+	b->bits = p[8];
+	b->offset = axn500_get32(p + 9);
+}
+
+/* packs one block of a column, returns the payload size */
+static int axn500_pack_block(struct axn500_exercise *e, int column, int start,
+			     struct axn500_zblock *b, unsigned char *out)
+{
+	unsigned int zz[AXN500_Z_BLOCK], maxzz = 0;
+	unsigned long long acc = 0;
+	int i, v, prev, nbits = 0, len = 0;
+
+	b->count = e->entries - start;
+	if (b->count > AXN500_Z_BLOCK)
+		b->count = AXN500_Z_BLOCK;
+
+	prev = b->first = b->min = b->max = axn500_column_value(e, column, start);
+	for (i = 1; i < b->count; i++) {
+		v = axn500_column_value(e, column, start + i);
+		if (v < b->min)
+			b->min = v;
+		if (v > b->max)
+			b->max = v;
+		zz[i] = ((unsigned int)(v - prev) << 1) ^ ((v - prev) >> 31);
+		maxzz |= zz[i];
+		prev = v;
+	}
+	for (b->bits = 0; maxzz; maxzz >>= 1)
+		b->bits++;
+
+	for (i = 1; i < b->count; i++) {
+		acc |= (unsigned long long)zz[i] << nbits;
+		nbits += b->bits;
+		while (nbits >= 8) {
+			out[len++] = acc;
+			acc >>= 8;
+			nbits -= 8;
+		}
+	}
+	if (nbits)
+		out[len++] = acc;
+	return len;
+}
+
+/*
+ * Unpacking doesn't depend on the previous value until the very last loop,
+ * so the first two loops are easily vectorized by the compiler.
+ */
+static void axn500_unpack_block(const unsigned char *payload,
+				struct axn500_zblock *b, int *out)
+{
+	unsigned long long w, mask = (1ULL << b->bits) - 1;
+	unsigned int zz[AXN500_Z_BLOCK];
+	int i, pos;
+
+	for (i = 1; i < b->count; i++) {
+		pos = (i - 1) * b->bits;
+		memcpy(&w, payload + (pos >> 3), sizeof(w));
+		zz[i] = (le64toh(w) >> (pos & 7)) & mask;
+	}
+	for (i = 1; i < b->count; i++)
+		out[i] = (zz[i] >> 1) ^ -(zz[i] & 1);
+	out[0] = b->first;
+	for (i = 1; i < b->count; i++)
+		out[i] += out[i - 1];
+}
+
+static int axn500_compress_exercise(struct axn500_exercise *e,
+				    struct axn500_buf *buf)
+{
+	struct axn500_zblock block;
+	unsigned char *rec, *dir;
+	int nblocks, col, i, start, max_size, len;
+
+	nblocks = (e->entries + AXN500_Z_BLOCK - 1) / AXN500_Z_BLOCK;
+	/* worst case is 32 bits per delta */
+	max_size = AXN500_Z_HDR_SIZE +
+		nblocks * AXN500_Z_COLUMNS * (AXN500_Z_BLKHDR_SIZE + AXN500_Z_BLOCK * 4) +
+		AXN500_Z_PADDING;
+	if (axn500_buf_reserve(buf, max_size))
+		return 1;
+
+	rec = buf->data + buf->len;
+	memcpy(rec, AXN500_Z_MAGIC, 3);
+	axn500_put8(rec + 3, AXN500_Z_VERSION);
+	axn500_put8(rec + 8, e->date.day);
+	axn500_put8(rec + 9, e->date.month);
+	axn500_put8(rec + 10, e->date.year);
+	axn500_put8(rec + 11, e->start_time.hour);
+	axn500_put8(rec + 12, e->start_time.minute);
+	axn500_put8(rec + 13, e->start_time.second);
+	axn500_put8(rec + 14, e->duration.hour);
+	axn500_put8(rec + 15, e->duration.minute);
+	axn500_put8(rec + 16, e->duration.second);
+	for (i = 0; i < 3; i++) {
+		axn500_put8(rec + 17 + i * 2, e->limits[i].lower);
+		axn500_put8(rec + 18 + i * 2, e->limits[i].upper);
+	}
+	axn500_put8(rec + 23, e->max_hr);
+	axn500_put8(rec + 24, e->avg_hr);
+	axn500_put8(rec + 25, e->num_markers);
+	axn500_put8(rec + 26, e->status);
+	axn500_put16(rec + 27, e->kcal);
+	axn500_put16(rec + 29, e->min_alt);
+	axn500_put16(rec + 31, e->max_alt);
+	axn500_put32(rec + 33, e->entries);
+	axn500_put16(rec + 37, nblocks);
+	axn500_put32(rec + 39, e->watch);
+	axn500_put64(rec + 43, e->start);
+	axn500_put16(rec + 51, e->record_rate);
+
+	dir = rec + AXN500_Z_HDR_SIZE;
+	len = AXN500_Z_HDR_SIZE + nblocks * AXN500_Z_COLUMNS * AXN500_Z_BLKHDR_SIZE;
+	for (col = 0; col < AXN500_Z_COLUMNS; col++) {
+		for (i = 0, start = 0; i < nblocks; i++, start += AXN500_Z_BLOCK) {
+			block.offset = len;
+			len += axn500_pack_block(e, col, start, &block, rec + len);
+			axn500_put_zblock(dir, &block);
+			dir += AXN500_Z_BLKHDR_SIZE;
+		}
+	}
+	memset(rec + len, 0, AXN500_Z_PADDING);
+	len += AXN500_Z_PADDING;
+	axn500_put32(rec + 4, len);
+	buf->len += len;
+
+	return 0;
+}
+
+static int axn500_zheader_size(const unsigned char *rec)
+{
+	return (rec[3] == 1)? AXN500_Z_HDR_SIZE_V1:AXN500_Z_HDR_SIZE;
+}
+
+/*
+ * Checks the record and returns its size, 0 if it's not valid
+ */
+static int axn500_zrecord_size(const unsigned char *rec, int len)
+{
+	int size, nblocks;
+
+	if (len < AXN500_Z_HDR_SIZE_V1 || memcmp(rec, AXN500_Z_MAGIC, 3) ||
+	    rec[3] < 1 || rec[3] > AXN500_Z_VERSION ||
+	    len < axn500_zheader_size(rec))
+		return 0;
+	size = axn500_get32(rec + 4);
+	nblocks = axn500_get16(rec + 37);
+	if (size > len || size < axn500_zheader_size(rec) + AXN500_Z_PADDING +
+	    nblocks * AXN500_Z_COLUMNS * AXN500_Z_BLKHDR_SIZE)
+		return 0;
+	return size;
+}
+
+/*
+ * Decodes a record of 'size' bytes, already checked by zrecord_size(). The
+ * blocks have to cover exactly all the samples and their payloads have to
+ * be within the record, or the record is rejected.
+ */
+static int axn500_decompress_exercise(const unsigned char *rec, int size,
+				      struct axn500_exercise *e,
+				      struct axn500_arena *arena)
+{
+	struct axn500_zblock block;
+	const unsigned char *dir;
+	int i, j, col, nblocks, start, count, payload, values[AXN500_Z_BLOCK];
+
+	memset(e, 0, sizeof(*e));
+	e->date.day = rec[8];
+	e->date.month = rec[9];
+	e->date.year = rec[10];
+	e->start_time.hour = rec[11];
+	e->start_time.minute = rec[12];
+	e->start_time.second = rec[13];
+	e->duration.hour = rec[14];
+	e->duration.minute = rec[15];
+	e->duration.second = rec[16];
+	for (i = 0; i < 3; i++) {
+		e->limits[i].lower = rec[17 + i * 2];
+		e->limits[i].upper = rec[18 + i * 2];
+	}
+	e->max_hr = rec[23];
+	e->avg_hr = rec[24];
+	e->num_markers = rec[25];
+	e->status = rec[26];
+	e->kcal = axn500_get16(rec + 27);
+	e->min_alt = axn500_get16(rec + 29);
+	e->max_alt = axn500_get16(rec + 31);
+	e->entries = axn500_get32(rec + 33);
+	nblocks = axn500_get16(rec + 37);
+	e->record_rate = 5;
+	if (rec[3] >= 2) {
+		e->watch = axn500_get32(rec + 39);
+		e->start = axn500_get64(rec + 43);
+		e->record_rate = axn500_get16(rec + 51);
+	}
+	if (e->entries > INT_MAX - AXN500_Z_BLOCK ||
+	    nblocks != (e->entries + AXN500_Z_BLOCK - 1) / AXN500_Z_BLOCK)
+		return 1;
+	if (e->entries == 0)
+		return 0;
+
+	if (axn500_alloc_samples(arena, e))
+		return 1;
+
+	dir = rec + axn500_zheader_size(rec);
+	payload = dir - rec + nblocks * AXN500_Z_COLUMNS * AXN500_Z_BLKHDR_SIZE;
+	for (col = 0; col < AXN500_Z_COLUMNS; col++) {
+		for (i = 0, start = 0; i < nblocks; i++, start += AXN500_Z_BLOCK) {
+			axn500_get_zblock(dir, &block);
+			dir += AXN500_Z_BLKHDR_SIZE;
+			count = e->entries - start;
+			if (count > AXN500_Z_BLOCK)
+				count = AXN500_Z_BLOCK;
+			/* the unpacker loads 8 bytes at once, up to the padding */
+			if (block.count != count || block.bits > 32 ||
+			    block.offset < payload ||
+			    (long long)block.offset +
+			    ((count - 1) * block.bits + 7) / 8 >
+			    size - AXN500_Z_PADDING)
+				return 1;
+			axn500_unpack_block(rec + block.offset, &block, values);
+			for (j = 0; j < block.count; j++) {
+				if (col == AXN500_Z_HR) {
+					e->data[start + j].hr = values[j];
+					e->data[start + j].quality = 0;
+				}
+				else
+					e->data[start + j].altitude = values[j];
+			}
+		}
+	}
+	for (j = 0; j < e->entries; j++)
+		axn500_pyramid_add(e, j);
+	return 0;
+}
+
+/*
+ * Reads the header and the block directory of the record at 'offset' in
+ * *rec, which is reallocated as needed
+ */
+static int axn500_read_zdir(int fd, long long offset, unsigned char **rec,
+			    int *nblocks)
+{
+	unsigned char *tmp;
+	int hdr_size, dir_size;
+
+	tmp = realloc(*rec, AXN500_Z_HDR_SIZE);
+	if (tmp == NULL)
+		goto nomem;
+	*rec = tmp;
+	if (pread(fd, tmp, AXN500_Z_HDR_SIZE, offset) < AXN500_Z_HDR_SIZE_V1 ||
+	    memcmp(tmp, AXN500_Z_MAGIC, 3))
+		goto invalid;
+	hdr_size = axn500_zheader_size(tmp);
+	*nblocks = axn500_get16(tmp + 37);
+	dir_size = *nblocks * AXN500_Z_COLUMNS * AXN500_Z_BLKHDR_SIZE;
+	tmp = realloc(*rec, hdr_size + dir_size);
+	if (tmp == NULL)
+		goto nomem;
+	*rec = tmp;
+	if (pread(fd, tmp + hdr_size, dir_size, offset + hdr_size) != dir_size)
+		goto invalid;
+	return 0;
+
+nomem:
+	fprintf(stderr, "Not enough memory\n");
+	return 1;
+invalid:
+	fprintf(stderr, "Invalid archive record at offset %lli\n", offset);
+	return 1;
+}
+
+/*
+ * Archive index
+ *
+ * The index lives next to the archive (<archive>.idx). After the "AXI2"
+ * magic it has one fixed size entry per record:
+ *	watch (u32), record size (u32), record offset (u64),
+ *	first sample time (s64), time after the last sample (s64),
+ *	duration in seconds (u32), kcal (u16), max hr (u8), avg hr (u8),
+ *	min altitude (s16), max altitude (s16),
+ *	min and max of the hr samples (s16, s16),
+ *	min and max of the altitude samples (s16, s16),
+ *	start time in seconds since midnight (u32)
+ * The sample min/max (the zone map of the exercise) come from the block
+ * directory, and are 32767/-32768 if there are no samples.
+ * It's derived data: whatever is in the archive and not in the index yet is
+ * added by looking only at the record headers and directories. Indexes
+ * without the magic are from an older version and are rebuilt.
+ */
+#define AXN500_IDX_MAGIC	"AXI2"
+#define AXN500_IDX_HDR_SIZE	4
+#define AXN500_IDX_ENTRY_SIZE	56
+
+struct axn500_index_entry {
+	unsigned int watch;
+	unsigned int size;
+	long long offset;
+	long long start;
+	long long end;
+	unsigned int duration;
+	unsigned int time_of_day;
+	int kcal;
+	int max_hr;
+	int avg_hr;
+	int min_alt;
+	int max_alt;
+	int zone_min[AXN500_Z_COLUMNS];
+	int zone_max[AXN500_Z_COLUMNS];
+};
+
+static void axn500_get_index_entry(const unsigned char *p,
+				   struct axn500_index_entry *entry)
+{
+	entry->watch = axn500_get32(p);
+	entry->size = axn500_get32(p + 4);
+	entry->offset = axn500_get64(p + 8);
+	entry->start = axn500_get64(p + 16);
+	entry->end = axn500_get64(p + 24);
+	entry->duration = axn500_get32(p + 32);
+	entry->kcal = axn500_get16(p + 36);
+	entry->max_hr = p[38];
+	entry->avg_hr = p[39];
+	entry->min_alt = (signed short)axn500_get16(p + 40);
+	entry->max_alt = (signed short)axn500_get16(p + 42);
+	entry->zone_min[AXN500_Z_HR] = (signed short)axn500_get16(p + 44);
+	entry->zone_max[AXN500_Z_HR] = (signed short)axn500_get16(p + 46);
+	entry->zone_min[AXN500_Z_ALT] = (signed short)axn500_get16(p + 48);
+	entry->zone_max[AXN500_Z_ALT] = (signed short)axn500_get16(p + 50);
+	entry->time_of_day = axn500_get32(p + 52);
+}
+
+static void axn500_put_index_entry(unsigned char *p,
+				   struct axn500_index_entry *entry)
+{
+	axn500_put32(p, entry->watch);
+	axn500_put32(p + 4, entry->size);
+	axn500_put64(p + 8, entry->offset);
+	axn500_put64(p + 16, entry->start);
+	axn500_put64(p + 24, entry->end);
+	axn500_put32(p + 32, entry->duration);
+	axn500_put16(p + 36, entry->kcal);
+	axn500_put8(p + 38, entry->max_hr);
+	axn500_put8(p + 39, entry->avg_hr);
+	axn500_put16(p + 40, entry->min_alt);
+	axn500_put16(p + 42, entry->max_alt);
+	axn500_put16(p + 44, entry->zone_min[AXN500_Z_HR]);
+	axn500_put16(p + 46, entry->zone_max[AXN500_Z_HR]);
+	axn500_put16(p + 48, entry->zone_min[AXN500_Z_ALT]);
+	axn500_put16(p + 50, entry->zone_max[AXN500_Z_ALT]);
+	axn500_put32(p + 52, entry->time_of_day);
+}
+
+/* fills an index entry from the record header and block directory */
+static int axn500_index_fill(const unsigned char *rec, int nblocks,
+			     struct axn500_index_entry *entry)
+{
+	struct axn500_zblock block;
+	const unsigned char *dir;
+	int col, b, rate = 5;
+
+	entry->watch = 0;
+	entry->start = 0;
+	if (rec[3] >= 2) {
+		entry->watch = axn500_get32(rec + 39);
+		entry->start = axn500_get64(rec + 43);
+		rate = axn500_get16(rec + 51);
+	}
+	entry->size = axn500_get32(rec + 4);
+	entry->end = entry->start + (long long)axn500_get32(rec + 33) * rate;
+	entry->time_of_day = rec[11] * 3600 + rec[12] * 60 + rec[13];
+	entry->duration = rec[14] * 3600 + rec[15] * 60 + rec[16];
+	entry->max_hr = rec[23];
+	entry->avg_hr = rec[24];
+	entry->kcal = axn500_get16(rec + 27);
+	entry->min_alt = (signed short)axn500_get16(rec + 29);
+	entry->max_alt = (signed short)axn500_get16(rec + 31);
+
+	dir = rec + axn500_zheader_size(rec);
+	for (col = 0; col < AXN500_Z_COLUMNS; col++) {
+		entry->zone_min[col] = SHRT_MAX;
+		entry->zone_max[col] = SHRT_MIN;
+		for (b = 0; b < nblocks; b++, dir += AXN500_Z_BLKHDR_SIZE) {
+			axn500_get_zblock(dir, &block);
+			if (block.count > AXN500_Z_BLOCK)
+				return 1;
+			if (block.count == 0)
+				continue;
+			if (block.min < entry->zone_min[col])
+				entry->zone_min[col] = block.min;
+			if (block.max > entry->zone_max[col])
+				entry->zone_max[col] = block.max;
+		}
+	}
+	return 0;
+}
+
+static char *axn500_index_name(const char *archive)
+{
+	char *name = malloc(strlen(archive) + 5);
+
+	if (name)
+		sprintf(name, "%s.idx", archive);
+	return name;
+}
+
+/*
+ * Brings the index up to date with the archive and returns all its entries
+ */
+static int axn500_index_sync(const char *archive,
+			     struct axn500_index_entry **entries, int *num)
+{
+	unsigned char *rec = NULL, raw[AXN500_IDX_ENTRY_SIZE];
+	struct axn500_index_entry *list = NULL, *tmp, *entry;
+	struct stat st;
+	long long pos = 0;
+	off_t len;
+	int afd, ifd, n = 0, alloc = 0, rc = 1, nblocks, got;
+	char *name;
+
+	name = axn500_index_name(archive);
+	if (name == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	afd = open(archive, O_RDONLY);
+	if (afd < 0) {
+		perror("Unable to open archive");
+		free(name);
+		return 1;
+	}
+	ifd = open(name, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+	if (ifd < 0) {
+		perror("Unable to open archive index");
+		goto out;
+	}
+	if (fstat(afd, &st)) {
+		perror("Unable to get archive size");
+		goto out;
+	}
+	if (read(ifd, raw, AXN500_IDX_HDR_SIZE) != AXN500_IDX_HDR_SIZE ||
+	    memcmp(raw, AXN500_IDX_MAGIC, AXN500_IDX_HDR_SIZE)) {
+		dprintf("Rebuilding the archive index\n");
+		if (ftruncate(ifd, 0) || lseek(ifd, 0, SEEK_SET) ||
+		    write(ifd, AXN500_IDX_MAGIC, AXN500_IDX_HDR_SIZE) !=
+		    AXN500_IDX_HDR_SIZE) {
+			perror("Error writing archive index");
+			goto out;
+		}
+	}
+
+	while (1) {
+		if (n == alloc) {
+			alloc = alloc? alloc * 2:64;
+			tmp = realloc(list, sizeof(*list) * alloc);
+			if (tmp == NULL) {
+				fprintf(stderr, "Not enough memory\n");
+				goto out;
+			}
+			list = tmp;
+		}
+		entry = &list[n];
+
+		/* first whatever is already indexed */
+		got = read(ifd, raw, sizeof(raw));
+		if (got == sizeof(raw)) {
+			axn500_get_index_entry(raw, entry);
+			pos = entry->offset + entry->size;
+			n++;
+			continue;
+		}
+		if (got) {
+			/* an entry cut short while appending, index it again */
+			dprintf("Dropping a partial archive index entry\n");
+			len = AXN500_IDX_HDR_SIZE + (off_t)n * AXN500_IDX_ENTRY_SIZE;
+			if (got < 0 || ftruncate(ifd, len) ||
+			    lseek(ifd, len, SEEK_SET) != len) {
+				perror("Error reading archive index");
+				goto out;
+			}
+		}
+		/* then the records appended since */
+		if (pos >= st.st_size)
+			break;
+		if (axn500_read_zdir(afd, pos, &rec, &nblocks))
+			goto out;
+		if (pos + axn500_get32(rec + 4) > st.st_size ||
+		    axn500_index_fill(rec, nblocks, entry)) {
+			fprintf(stderr, "Invalid archive record at offset "
+				"%lli\n", pos);
+			goto out;
+		}
+		entry->offset = pos;
+		axn500_put_index_entry(raw, entry);
+		if (write(ifd, raw, sizeof(raw)) != sizeof(raw)) {
+			perror("Error writing archive index");
+			goto out;
+		}
+		pos += entry->size;
+		n++;
+	}
+	rc = 0;
+	*entries = list;
+	*num = n;
+	list = NULL;
+out:
+	free(rec);
+	free(list);
+	free(name);
+	if (ifd >= 0)
+		close(ifd);
+	close(afd);
+	return rc;
+}
+
+struct axn500_sample_query {
+	int any_watch;
+	unsigned int watch;
+	long long from;
+	long long to;
+	int column;
+};
+
+/*
+ * Calls 'cb' for every sample of 'column' in the [from, to) interval. Only
+ * the index, the headers of the matching records and the blocks that
+ * overlap the interval are read.
+ */
+static int axn500_archive_query(const char *archive, struct axn500_sample_query *q,
+				void (*cb)(void *arg, unsigned int watch,
+					   time_t when, int value),
+				void *arg)
+{
+	struct axn500_index_entry *entries, *entry;
+	struct axn500_zblock block;
+	unsigned char *rec = NULL, payload[AXN500_Z_BLOCK * 4 + AXN500_Z_PADDING];
+	int fd, i, b, j, n, nblocks, hdr_size, len, rate, values[AXN500_Z_BLOCK];
+	long long first, when;
+
+	if (axn500_index_sync(archive, &entries, &n))
+		return 1;
+
+	fd = open(archive, O_RDONLY);
+	if (fd < 0) {
+		perror("Unable to open archive");
+		free(entries);
+		return 1;
+	}
+
+	for (i = 0; i < n; i++) {
+		entry = &entries[i];
+		if ((!q->any_watch && entry->watch != q->watch) ||
+		    entry->end <= q->from || entry->start >= q->to)
+			continue;
+
+		if (axn500_read_zdir(fd, entry->offset, &rec, &nblocks))
+			goto error;
+		hdr_size = axn500_zheader_size(rec);
+		rate = (rec[3] >= 2)? axn500_get16(rec + 51):5;
+
+		for (b = 0; b < nblocks; b++) {
+			axn500_get_zblock(rec + hdr_size +
+				(q->column * nblocks + b) * AXN500_Z_BLKHDR_SIZE,
+				&block);
+			if (block.count > AXN500_Z_BLOCK || block.bits > 32)
+				goto short_read;
+			first = entry->start + (long long)b * AXN500_Z_BLOCK * rate;
+			if (first >= q->to ||
+			    first + (long long)block.count * rate <= q->from)
+				continue;
+
+			len = ((block.count - 1) * block.bits + 7) / 8;
+			memset(payload, 0, sizeof(payload));
+			if (pread(fd, payload, len, entry->offset + block.offset) != len)
+				goto short_read;
+			axn500_unpack_block(payload, &block, values);
+			for (j = 0; j < block.count; j++) {
+				when = first + (long long)j * rate;
+				if (when >= q->from && when < q->to)
+					cb(arg, entry->watch, when, values[j]);
+			}
+		}
+	}
+	free(rec);
+	free(entries);
+	close(fd);
+	return 0;
+
+short_read:
+	fprintf(stderr, "Invalid archive record at offset %lli\n", entry->offset);
+error:
+	free(rec);
+	free(entries);
+	close(fd);
+	return 1;
+}
+
+/*
+ * Exercise queries
+ *
+ * A query is a range of accepted values for some of the fields below. The
+ * header fields are checked against the index alone. For hr and alt an
+ * exercise matches if some of its samples are in range (in all the
+ * ranges, when both are given): the zone map in the index skips the
+ * exercises that can't have any, and the block min/max in the record
+ * directory the blocks that can't, so only the blocks that may hold
+ * matching samples are read and decoded.
+ */
+enum {
+	AXN500_Q_DATE = 0,
+	AXN500_Q_START,
+	AXN500_Q_DURATION,
+	AXN500_Q_MAX_HR,
+	AXN500_Q_AVG_HR,
+	AXN500_Q_KCAL,
+	AXN500_Q_MIN_ALT,
+	AXN500_Q_MAX_ALT,
+	AXN500_Q_WATCH,
+	AXN500_Q_HR,		/* AXN500_Q_HR + AXN500_Z_* for the columns */
+	AXN500_Q_ALT,
+	AXN500_Q_FIELDS,
+};
+
+static const char *axn500_query_fields[AXN500_Q_FIELDS] = {
+	"date", "start", "duration", "max_hr", "avg_hr", "kcal", "min_alt",
+	"max_alt", "watch", "hr", "alt",
+};
+
+struct axn500_ex_query {
+	unsigned int used;		/* fields with a range */
+	long long min[AXN500_Q_FIELDS];
+	long long max[AXN500_Q_FIELDS];
+};
+
+struct axn500_query_stats {
+	int exercises;
+	int matched;
+	int blocks;
+	int blocks_read;
+};
+
+static void axn500_query_init(struct axn500_ex_query *q)
+{
+	int i;
+
+	q->used = 0;
+	for (i = 0; i < AXN500_Q_FIELDS; i++) {
+		q->min[i] = LLONG_MIN;
+		q->max[i] = LLONG_MAX;
+	}
+}
+
+/* narrows the accepted range of a field */
+static void axn500_query_range(struct axn500_ex_query *q, int field,
+			       long long min, long long max)
+{
+	if (min > q->min[field])
+		q->min[field] = min;
+	if (max < q->max[field])
+		q->max[field] = max;
+	q->used |= 1 << field;
+}
+
+/* true if some value in [min, max] can be accepted */
+static int axn500_query_overlaps(struct axn500_ex_query *q, int field,
+				 long long min, long long max)
+{
+	if (!(q->used & (1 << field)))
+		return 1;
+	return max >= q->min[field] && min <= q->max[field];
+}
+
+static long long axn500_entry_field(struct axn500_index_entry *entry,
+				    int field)
+{
+	switch (field) {
+	case AXN500_Q_DATE:
+		return entry->start;
+	case AXN500_Q_START:
+		return entry->time_of_day;
+	case AXN500_Q_DURATION:
+		return entry->duration;
+	case AXN500_Q_MAX_HR:
+		return entry->max_hr;
+	case AXN500_Q_AVG_HR:
+		return entry->avg_hr;
+	case AXN500_Q_KCAL:
+		return entry->kcal;
+	case AXN500_Q_MIN_ALT:
+		return entry->min_alt;
+	case AXN500_Q_MAX_ALT:
+		return entry->max_alt;
+	case AXN500_Q_WATCH:
+		return entry->watch;
+	}
+	return 0;
+}
+
+/*
+ * Counts the samples of a record matching the sample ranges of the query,
+ * looking only at the blocks whose min/max overlap them
+ */
+static int axn500_query_samples(int fd, struct axn500_index_entry *entry,
+				struct axn500_ex_query *q, unsigned char **rec,
+				struct axn500_query_stats *stats)
+{
+	struct axn500_zblock block[AXN500_Z_COLUMNS];
+	unsigned char payload[AXN500_Z_BLOCK * 4 + AXN500_Z_PADDING];
+	int values[AXN500_Z_COLUMNS][AXN500_Z_BLOCK];
+	int b, j, col, len, nblocks, hdr_size, skip, samples = 0;
+
+	if (axn500_read_zdir(fd, entry->offset, rec, &nblocks))
+		return -1;
+	hdr_size = axn500_zheader_size(*rec);
+
+	for (b = 0; b < nblocks; b++) {
+		stats->blocks++;
+		skip = 0;
+		for (col = 0; col < AXN500_Z_COLUMNS; col++) {
+			axn500_get_zblock(*rec + hdr_size +
+				(col * nblocks + b) * AXN500_Z_BLKHDR_SIZE,
+				&block[col]);
+			if (block[col].count > AXN500_Z_BLOCK || block[col].bits > 32)
+				goto invalid;
+			if (block[col].count == 0 ||
+			    !axn500_query_overlaps(q, AXN500_Q_HR + col,
+						   block[col].min, block[col].max))
+				skip = 1;
+		}
+		if (skip)
+			continue;
+
+		stats->blocks_read++;
+		for (col = 0; col < AXN500_Z_COLUMNS; col++) {
+			if (!(q->used & (1 << (AXN500_Q_HR + col))))
+				continue;
+			len = ((block[col].count - 1) * block[col].bits + 7) / 8;
+			memset(payload, 0, sizeof(payload));
+			if (pread(fd, payload, len, entry->offset +
+				  block[col].offset) != len)
+				goto invalid;
+			axn500_unpack_block(payload, &block[col], values[col]);
+		}
+		for (j = 0; j < block[AXN500_Z_HR].count; j++) {
+			for (col = 0; col < AXN500_Z_COLUMNS; col++)
+				if ((q->used & (1 << (AXN500_Q_HR + col))) &&
+				    !axn500_query_overlaps(q, AXN500_Q_HR + col,
+							   values[col][j],
+							   values[col][j]))
+					break;
+			if (col == AXN500_Z_COLUMNS)
+				samples++;
+		}
+	}
+	return samples;
+
+invalid:
+	fprintf(stderr, "Invalid archive record at offset %lli\n", entry->offset);
+	return -1;
+}
+
+/*
+ * Calls 'cb' for every exercise of the archive matching the query, with the
+ * number of matching samples or -1 if the query has no sample ranges
+ */
+static int axn500_archive_select(const char *archive, struct axn500_ex_query *q,
+				 void (*cb)(void *arg,
+					    struct axn500_index_entry *entry,
+					    int samples),
+				 void *arg, struct axn500_query_stats *stats)
+{
+	struct axn500_index_entry *entries, *entry;
+	unsigned char *rec = NULL;
+	int fd, i, n, field, col, samples;
+	long long value;
+
+	memset(stats, 0, sizeof(*stats));
+	if (axn500_index_sync(archive, &entries, &n))
+		return 1;
+
+	fd = open(archive, O_RDONLY);
+	if (fd < 0) {
+		perror("Unable to open archive");
+		free(entries);
+		return 1;
+	}
+
+	stats->exercises = n;
+	for (i = 0; i < n; i++) {
+		entry = &entries[i];
+		for (field = 0; field < AXN500_Q_HR; field++) {
+			value = axn500_entry_field(entry, field);
+			if (!axn500_query_overlaps(q, field, value, value))
+				break;
+		}
+		if (field < AXN500_Q_HR)
+			continue;
+		for (col = 0; col < AXN500_Z_COLUMNS; col++)
+			if (!axn500_query_overlaps(q, AXN500_Q_HR + col,
+						   entry->zone_min[col],
+						   entry->zone_max[col]))
+				break;
+		if (col < AXN500_Z_COLUMNS)
+			continue;
+
+		samples = -1;
+		if (q->used & (1 << AXN500_Q_HR | 1 << AXN500_Q_ALT)) {
+			samples = axn500_query_samples(fd, entry, q, &rec, stats);
+			if (samples < 0)
+				break;
+			if (samples == 0)
+				continue;
+		}
+		stats->matched++;
+		cb(arg, entry, samples);
+	}
+	free(rec);
+	free(entries);
+	close(fd);
+
+	return i < n;
+}
+
+/*
+ * The exercises only have the day they were done. The month and year are
+ * the ones of the most recent date with that day not after 'ref', which is
+ * the date of the watch when the exercises were transferred.
+ */
+static void axn500_date_exercises(struct axn500 *info, struct tm *ref,
+				  unsigned int watch)
+{
+	struct axn500_exercise *e;
+	struct tm tm;
+	int ex, tries;
+
+	for (ex = 0; ex < info->exercises.num; ex++) {
+		e = &info->exercises.exercise[ex];
+		e->watch = watch;
+		if (e->status != AXN500_EX_OK && e->status != AXN500_EX_TRUNCATED)
+			continue;
+
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_year = ref->tm_year;
+		tm.tm_mon = ref->tm_mon;
+		if (e->date.day > ref->tm_mday) {
+			tm.tm_mon--;
+			if (tm.tm_mon < 0) {
+				tm.tm_mon = 11;
+				tm.tm_year--;
+			}
+		}
+		/* skip the months that don't have that day */
+		for (tries = 0; tries < 12; tries++) {
+			tm.tm_mday = e->date.day;
+			tm.tm_hour = e->start_time.hour;
+			tm.tm_min = e->start_time.minute;
+			tm.tm_sec = e->start_time.second;
+			tm.tm_isdst = -1;
+			e->start = mktime(&tm);
+			if (tm.tm_mday == e->date.day)
+				break;
+			/* mktime() normalized it into the next month */
+			tm.tm_year -= (tm.tm_mon < 2)? 1:0;
+			tm.tm_mon = (tm.tm_mon + 10) % 12;
+		}
+		e->date.month = tm.tm_mon + 1;
+		e->date.year = tm.tm_year % 100;
+	}
+}
+
+static int axn500_archive_append(const char *filename, struct axn500 *info)
+{
+	struct axn500_index_entry *entries;
+	struct axn500_buf buf = { NULL, 0, 0 };
+	int fd, ex, rc;
+
+	for (ex = 0; ex < info->exercises.num; ex++) {
+		if (axn500_compress_exercise(&info->exercises.exercise[ex], &buf)) {
+			fprintf(stderr, "Not enough memory\n");
+			free(buf.data);
+			return 1;
+		}
+	}
+
+	fd = open(filename, O_CREAT | O_WRONLY | O_APPEND, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		perror("Error opening archive");
+		free(buf.data);
+		return 1;
+	}
+	dprintf("Appending %i exercises, %i bytes\n", info->exercises.num, buf.len);
+	rc = write(fd, buf.data, buf.len);
+	if (rc != buf.len) {
+		if (rc < 0)
+			perror("Error writing archive");
+		else
+			fprintf(stderr, "Short write on archive\n");
+		close(fd);
+		free(buf.data);
+		return 1;
+	}
+	close(fd);
+	free(buf.data);
+
+	if (axn500_index_sync(filename, &entries, &ex))
+		return 1;
+	free(entries);
+
+	return 0;
+}
+
+static unsigned char *axn500_read_file(const char *filename, int *size)
+{
+	struct stat st;
+	unsigned char *data;
+	int fd, rc;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		perror("Unable to open file");
+		return NULL;
+	}
+	if (fstat(fd, &st)) {
+		perror("Unable to get file size");
+		close(fd);
+		return NULL;
+	}
+	data = malloc(st.st_size + 1);
+	if (data == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		close(fd);
+		return NULL;
+	}
+	rc = read(fd, data, st.st_size);
+	close(fd);
+	if (rc != st.st_size) {
+		fprintf(stderr, "Short read while reading %s\n", filename);
+		free(data);
+		return NULL;
+	}
+	*size = st.st_size;
+	return data;
+}
+
+/* decodes all the records in 'data' */
+static int axn500_archive_decode(const unsigned char *data, int size,
+				 struct axn500 *info)
+{
+	unsigned int entries;
+	size_t mem;
+	int pos, len, num;
+
+	/*
+	 * size the arena by looking at the record headers first, records with
+	 * more samples than their blocks hold are rejected by the decoding
+	 */
+	mem = 0;
+	for (pos = 0, num = 0; pos < size; pos += len, num++) {
+		len = axn500_zrecord_size(data + pos, size - pos);
+		if (len == 0)
+			break;
+		mem += sizeof(struct axn500_exercise);
+		entries = axn500_get32(data + pos + 33);
+		if (entries <= axn500_get16(data + pos + 37) * AXN500_Z_BLOCK)
+			mem += axn500_samples_size(entries);
+	}
+
+	memset(&info->exercises, 0, sizeof(info->exercises));
+	if (axn500_arena_grow(&info->exercises.arena, mem + AXN500_ARENA_ALIGN))
+		goto nomem;
+	info->exercises.exercise = axn500_arena_zalloc(&info->exercises.arena,
+				sizeof(struct axn500_exercise) * num);
+	if (info->exercises.exercise == NULL)
+		goto nomem;
+
+	for (pos = 0; pos < size; pos += len) {
+		len = axn500_zrecord_size(data + pos, size - pos);
+		if (len == 0) {
+			fprintf(stderr, "Invalid archive record at offset %i\n", pos);
+			break;
+		}
+		if (axn500_decompress_exercise(data + pos, len,
+				&info->exercises.exercise[info->exercises.num],
+				&info->exercises.arena)) {
+			fprintf(stderr, "Unable to decode archive record at "
+				"offset %i\n", pos);
+			continue;
+		}
+		info->exercises.num++;
+	}
+
+	return pos < size;
+
+nomem:
+	fprintf(stderr, "Not enough memory\n");
+	axn500_free_exercises(info);
+	return 1;
+}
+
+static int axn500_archive_read(const char *filename, struct axn500 *info)
+{
+	struct axn500_span span;
+	unsigned char *data;
+	int size, rc;
+
+	memset(info, 0, sizeof(*info));
+	data = axn500_read_file(filename, &size);
+	if (data == NULL)
+		return 1;
+	axn500_profile_begin(&span);
+	rc = axn500_archive_decode(data, size, info);
+	axn500_profile_end(&span, AXN500_PHASE_PARSE);
+	free(data);
+	return rc;
+}
+
+/*
+ * 64 bit hash of the raw exercise data. This is XXH64, which is simple
+ * enough to carry here and fast enough to not matter next to the IrDA
+ * transfer.
+ */
+#define XXH_PRIME1	11400714785074694791ULL
+#define XXH_PRIME2	14029467366897019727ULL
+#define XXH_PRIME3	1609587929392839161ULL
+#define XXH_PRIME4	9650029242287828579ULL
+#define XXH_PRIME5	2870177450012600261ULL
+
+static unsigned long long axn500_rotl64(unsigned long long x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static unsigned long long axn500_xxh_round(unsigned long long acc,
+					   unsigned long long input)
+{
+	acc += input * XXH_PRIME2;
+	acc = axn500_rotl64(acc, 31);
+	return acc * XXH_PRIME1;
+}
+
+static unsigned long long axn500_xxh_merge(unsigned long long acc,
+					   unsigned long long val)
+{
+	acc ^= axn500_xxh_round(0, val);
+	return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static unsigned long long axn500_hash(const unsigned char *p, size_t len)
+{
+	const unsigned char *end = p + len;
+	unsigned long long h, v1, v2, v3, v4;
+
+	if (len >= 32) {
+		v1 = XXH_PRIME1 + XXH_PRIME2;
+		v2 = XXH_PRIME2;
+		v3 = 0;
+		v4 = -XXH_PRIME1;
+		do {
+			v1 = axn500_xxh_round(v1, axn500_get64(p));
+			v2 = axn500_xxh_round(v2, axn500_get64(p + 8));
+			v3 = axn500_xxh_round(v3, axn500_get64(p + 16));
+			v4 = axn500_xxh_round(v4, axn500_get64(p + 24));
+			p += 32;
+		} while (p <= end - 32);
+		h = axn500_rotl64(v1, 1) + axn500_rotl64(v2, 7) +
+		    axn500_rotl64(v3, 12) + axn500_rotl64(v4, 18);
+		h = axn500_xxh_merge(h, v1);
+		h = axn500_xxh_merge(h, v2);
+		h = axn500_xxh_merge(h, v3);
+		h = axn500_xxh_merge(h, v4);
+	} else
+		h = XXH_PRIME5;
+	h += len;
+
+	for (; p + 8 <= end; p += 8) {
+		h ^= axn500_xxh_round(0, axn500_get64(p));
+		h = axn500_rotl64(h, 27) * XXH_PRIME1 + XXH_PRIME4;
+	}
+	if (p + 4 <= end) {
+		h ^= (unsigned long long)axn500_get32(p) * XXH_PRIME1;
+		h = axn500_rotl64(h, 23) * XXH_PRIME2 + XXH_PRIME3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * XXH_PRIME5;
+		h = axn500_rotl64(h, 11) * XXH_PRIME1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME2;
+	h ^= h >> 29;
+	h *= XXH_PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ * Content addressed exercise store
+ *
+ * <dir>/objects/xx/yyyyyyyyyyyyyy	raw exercise (header and samples), named
+ *					after its hash
+ * <dir>/manifests/<date>-<pid>.<n>-<watch>
+ *					one line per exercise of a transfer:
+ *					hash, date and start time
+ * <dir>/bloom				bloom filter of the stored hashes
+ *
+ * The bloom filter answers most "is it there already?" questions for new
+ * exercises without touching the objects directory.
+ */
+#define AXN500_BLOOM_BITS	(1 << 20)
+#define AXN500_BLOOM_HASHES	4
+
+struct axn500_store {
+	char *dir;
+	unsigned char *bloom;
+};
+
+static char *axn500_path(const char *dir, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+
+static char *axn500_path(const char *dir, const char *fmt, ...)
+{
+	va_list ap;
+	char *path;
+	int len;
+
+	len = strlen(dir) + 1;
+	va_start(ap, fmt);
+	len += vsnprintf(NULL, 0, fmt, ap) + 1;
+	va_end(ap);
+	path = malloc(len);
+	if (path == NULL)
+		return NULL;
+	len = sprintf(path, "%s/", dir);
+	va_start(ap, fmt);
+	vsprintf(path + len, fmt, ap);
+	va_end(ap);
+	return path;
+}
+
+static int axn500_mkdir(const char *dir, const char *sub)
+{
+	char *path = axn500_path(dir, "%s", sub);
+	int rc;
+
+	if (path == NULL)
+		return 1;
+	rc = mkdir(path, S_IRWXU) && errno != EEXIST;
+	if (rc)
+		perror(path);
+	free(path);
+	return rc;
+}
+
+/* writes a whole file under a temporary name and renames it in place */
+static int axn500_write_file(const char *path, const void *data, int len)
+{
+	char tmp[strlen(path) + 8];
+	int fd, rc;
+
+	sprintf(tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		perror(tmp);
+		return 1;
+	}
+	rc = write(fd, data, len);
+	if (rc != len || fsync(fd)) {
+		perror(path);
+		close(fd);
+		unlink(tmp);
+		return 1;
+	}
+	close(fd);
+	if (rename(tmp, path)) {
+		perror(path);
+		unlink(tmp);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Same, but an existing file is never replaced: returns -1 if there's one
+ * at 'path' already
+ */
+static int axn500_create_file(const char *path, const void *data, int len)
+{
+	char tmp[strlen(path) + 8];
+	int fd, rc;
+
+	sprintf(tmp, "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0) {
+		perror(tmp);
+		return 1;
+	}
+	rc = write(fd, data, len);
+	if (rc != len || fsync(fd)) {
+		perror(path);
+		close(fd);
+		unlink(tmp);
+		return 1;
+	}
+	close(fd);
+	rc = link(tmp, path)? errno:0;
+	if (rc && rc != EEXIST)
+		perror(path);
+	unlink(tmp);
+	if (rc == EEXIST)
+		return -1;
+	return rc != 0;
+}
+
+static int axn500_store_open(struct axn500_store *store, const char *dir)
+{
+	char *path;
+	int fd;
+
+	store->dir = strdup(dir);
+	store->bloom = MAP_FAILED;
+	if (store->dir == NULL)
+		return 1;
+	if (mkdir(dir, S_IRWXU) && errno != EEXIST) {
+		perror(dir);
+		return 1;
+	}
+	if (axn500_mkdir(dir, "objects") || axn500_mkdir(dir, "manifests"))
+		return 1;
+
+	path = axn500_path(dir, "bloom");
+	if (path == NULL)
+		return 1;
+	fd = open(path, O_CREAT | O_RDWR, S_IRUSR | S_IWUSR);
+	free(path);
+	if (fd < 0 || ftruncate(fd, AXN500_BLOOM_BITS / 8)) {
+		perror("Unable to open the bloom filter");
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+	store->bloom = mmap(NULL, AXN500_BLOOM_BITS / 8, PROT_READ | PROT_WRITE,
+			    MAP_SHARED, fd, 0);
+	close(fd);
+	if (store->bloom == MAP_FAILED) {
+		perror("Unable to map the bloom filter");
+		return 1;
+	}
+	return 0;
+}
+
+static void axn500_store_close(struct axn500_store *store)
+{
+	if (store->bloom != MAP_FAILED)
+		munmap(store->bloom, AXN500_BLOOM_BITS / 8);
+	free(store->dir);
+}
+
+static int axn500_bloom(struct axn500_store *store, unsigned long long hash,
+			int set)
+{
+	unsigned int h1 = hash, h2 = hash >> 32, bit;
+	int i, found = 1;
+
+	for (i = 0; i < AXN500_BLOOM_HASHES; i++) {
+		bit = (h1 + i * h2) & (AXN500_BLOOM_BITS - 1);
+		if (!(store->bloom[bit / 8] & (1 << (bit % 8))))
+			found = 0;
+		if (set)
+			store->bloom[bit / 8] |= 1 << (bit % 8);
+	}
+	return found;
+}
+
+static char *axn500_object_path(struct axn500_store *store,
+				unsigned long long hash)
+{
+	return axn500_path(store->dir, "objects/%02llx/%014llx", hash >> 56,
+			   hash & 0xffffffffffffffULL);
+}
+
+/*
+ * Returns 0 if the object was added, 1 if it was there already and -1 on
+ * errors
+ */
+static int axn500_store_put(struct axn500_store *store, unsigned long long hash,
+			    const char *data, int len)
+{
+	struct stat st;
+	char *path, sub[16];
+	int rc;
+
+	path = axn500_object_path(store, hash);
+	if (path == NULL)
+		return -1;
+	if (axn500_bloom(store, hash, 0) && stat(path, &st) == 0) {
+		free(path);
+		return 1;
+	}
+
+	sprintf(sub, "objects/%02llx", hash >> 56);
+	rc = -1;
+	if (axn500_mkdir(store->dir, sub) == 0 &&
+	    axn500_write_file(path, data, len) == 0) {
+		axn500_bloom(store, hash, 1);
+		rc = 0;
+	}
+	free(path);
+	return rc;
+}
+
+/*
+ * Derived data
+ *
+ * <dir>/derived/xx/yyyyyyyyyyyyyy holds the decoded exercise of the object
+ * with the same name, as an archive record after a stamp:
+ *	magic "AXD1", parser version (u32), hash of the raw data (u64)
+ * Entries are replaced atomically, so they can be read while they're being
+ * recomputed. Only the ones with a different stamp are recomputed when the
+ * parser changes.
+ */
+#define AXN500_DERIVED_MAGIC	"AXD1"
+#define AXN500_DERIVED_HDR_SIZE	16
+
+static char *axn500_derived_path(const char *dir, unsigned long long hash)
+{
+	return axn500_path(dir, "derived/%02llx/%014llx", hash >> 56,
+			   hash & 0xffffffffffffffULL);
+}
+
+static int axn500_derived_current(const unsigned char *stamp,
+				  unsigned long long hash)
+{
+	return !memcmp(stamp, AXN500_DERIVED_MAGIC, 4) &&
+	       axn500_get32(stamp + 4) == AXN500_PARSER_VERSION &&
+	       (unsigned long long)axn500_get64(stamp + 8) == hash;
+}
+
+/* true if the derived data of 'hash' is there and up to date */
+static int axn500_derived_check(const char *dir, unsigned long long hash)
+{
+	unsigned char stamp[AXN500_DERIVED_HDR_SIZE];
+	char *path = axn500_derived_path(dir, hash);
+	int fd, rc = 0;
+
+	if (path == NULL)
+		return 0;
+	fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		rc = read(fd, stamp, sizeof(stamp)) == sizeof(stamp) &&
+		     axn500_derived_current(stamp, hash);
+		close(fd);
+	}
+	free(path);
+	return rc;
+}
+
+static int axn500_derived_write(const char *dir, unsigned long long hash,
+				struct axn500_exercise *e)
+{
+	struct axn500_buf buf = { NULL, 0, 0 };
+	char *path, sub[16];
+	int rc = 1;
+
+	if (axn500_buf_reserve(&buf, AXN500_DERIVED_HDR_SIZE)) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	memcpy(buf.data, AXN500_DERIVED_MAGIC, 4);
+	axn500_put32(buf.data + 4, AXN500_PARSER_VERSION);
+	axn500_put64(buf.data + 8, hash);
+	buf.len = AXN500_DERIVED_HDR_SIZE;
+	if (axn500_compress_exercise(e, &buf)) {
+		fprintf(stderr, "Not enough memory\n");
+		free(buf.data);
+		return 1;
+	}
+
+	sprintf(sub, "derived/%02llx", hash >> 56);
+	path = axn500_derived_path(dir, hash);
+	if (path && axn500_mkdir(dir, "derived") == 0 &&
+	    axn500_mkdir(dir, sub) == 0)
+		rc = axn500_write_file(path, buf.data, buf.len);
+	free(path);
+	free(buf.data);
+	return rc;
+}
+
+/*
+ * The context of an object: what the raw data doesn't say about the
+ * exercise, taken from the manifests
+ */
+struct axn500_object_ctx {
+	unsigned long long hash;
+	int day;
+	int month;
+	int year;
+	unsigned int watch;
+};
+
+static int axn500_ctx_compare(const void *a, const void *b)
+{
+	const struct axn500_object_ctx *x = a, *y = b;
+
+	return (x->hash > y->hash) - (x->hash < y->hash);
+}
+
+static int axn500_load_manifests(const char *dir,
+				 struct axn500_object_ctx **list, int *num)
+{
+	struct axn500_object_ctx ctx, *tmp;
+	struct dirent *d;
+	char *path, *p, line[128];
+	DIR *mdir;
+	FILE *file;
+	int alloc = 0;
+
+	*list = NULL;
+	*num = 0;
+	path = axn500_path(dir, "manifests");
+	if (path == NULL)
+		return 1;
+	mdir = opendir(path);
+	if (mdir == NULL) {
+		perror(path);
+		free(path);
+		return 1;
+	}
+	free(path);
+
+	while ((d = readdir(mdir))) {
+		if (d->d_name[0] == '.' || (p = strrchr(d->d_name, '-')) == NULL)
+			continue;
+		ctx.watch = strtoul(p + 1, NULL, 16);
+		path = axn500_path(dir, "manifests/%s", d->d_name);
+		file = path? fopen(path, "r"):NULL;
+		free(path);
+		if (file == NULL)
+			continue;
+		while (fgets(line, sizeof(line), file)) {
+			if (sscanf(line, "%llx %d/%d/%d", &ctx.hash, &ctx.day,
+				   &ctx.month, &ctx.year) != 4)
+				continue;
+			if (*num == alloc) {
+				alloc = alloc? alloc * 2:256;
+				tmp = realloc(*list, sizeof(*tmp) * alloc);
+				if (tmp == NULL) {
+					fprintf(stderr, "Not enough memory\n");
+					fclose(file);
+					closedir(mdir);
+					return 1;
+				}
+				*list = tmp;
+			}
+			(*list)[(*num)++] = ctx;
+		}
+		fclose(file);
+	}
+	closedir(mdir);
+
+	qsort(*list, *num, sizeof(**list), axn500_ctx_compare);
+	return 0;
+}
+
+/* decodes a stored object the same way it was decoded from the dump */
+static int axn500_derive_object(const char *dir, unsigned long long hash,
+				struct axn500_object_ctx *ctx)
+{
+	struct axn500 info;
+	struct tm ref;
+	unsigned char *raw;
+	char *path, *data;
+	int size, rc;
+
+	path = axn500_path(dir, "objects/%02llx/%014llx", hash >> 56,
+			   hash & 0xffffffffffffffULL);
+	raw = path? axn500_read_file(path, &size):NULL;
+	free(path);
+	if (raw == NULL)
+		return 1;
+	/* the parser wants the exercises where they are in a dump */
+	data = calloc(1, size + 5);
+	if (data == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		free(raw);
+		return 1;
+	}
+	memcpy(data + 5, raw, size);
+	free(raw);
+
+	rc = axn500_parse_exercises(data, 1, size + 5, &info, 0);
+	free(data);
+	if (rc || (info.exercises.exercise[0].status != AXN500_EX_OK &&
+		   info.exercises.exercise[0].status != AXN500_EX_TRUNCATED)) {
+		fprintf(stderr, "Unable to decode object %016llx\n", hash);
+		if (rc == 0)
+			axn500_free_exercises(&info);
+		return 1;
+	}
+
+	if (ctx) {
+		memset(&ref, 0, sizeof(ref));
+		ref.tm_mday = ctx->day;
+		ref.tm_mon = ctx->month - 1;
+		ref.tm_year = ctx->year + 100;
+		axn500_date_exercises(&info, &ref, ctx->watch);
+	}
+	rc = axn500_derived_write(dir, hash, &info.exercises.exercise[0]);
+	axn500_free_exercises(&info);
+	return rc;
+}
+
+/*
+ * Brings the derived data of a store up to date, recomputing only what a
+ * different parser version would decode differently
+ */
+static int axn500_store_reprocess(const char *dir)
+{
+	struct axn500_object_ctx *ctx, key;
+	struct dirent *d, *o;
+	DIR *objects, *sub;
+	char *path;
+	int num, current = 0, derived = 0, failed = 0;
+
+	if (axn500_load_manifests(dir, &ctx, &num))
+		return 1;
+	path = axn500_path(dir, "objects");
+	objects = path? opendir(path):NULL;
+	if (objects == NULL) {
+		perror("Unable to open the store objects");
+		free(path);
+		free(ctx);
+		return 1;
+	}
+
+	while ((d = readdir(objects))) {
+		if (strlen(d->d_name) != 2)
+			continue;
+		free(path);
+		path = axn500_path(dir, "objects/%s", d->d_name);
+		sub = path? opendir(path):NULL;
+		if (sub == NULL)
+			continue;
+		while ((o = readdir(sub))) {
+			if (strlen(o->d_name) != 14)
+				continue;
+			key.hash = strtoull(d->d_name, NULL, 16) << 56 |
+				   strtoull(o->d_name, NULL, 16);
+			if (axn500_derived_check(dir, key.hash)) {
+				current++;
+				continue;
+			}
+			if (axn500_derive_object(dir, key.hash,
+					bsearch(&key, ctx, num, sizeof(*ctx),
+						axn500_ctx_compare)))
+				failed++;
+			else
+				derived++;
+		}
+		closedir(sub);
+	}
+	closedir(objects);
+	free(path);
+	free(ctx);
+
+	printf("%i exercises decoded again, %i up to date, %i failed\n",
+	       derived, current, failed);
+	return failed != 0;
+}
+
+static int axn500_start_compare(const void *a, const void *b)
+{
+	const struct axn500_exercise *x = a, *y = b;
+
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+/*
+ * Reads the up to date derived data of a store, whatever is being
+ * recomputed at the same time, in the order the exercises were done
+ */
+static int axn500_store_read(const char *dir, struct axn500 *info)
+{
+	struct axn500_buf buf = { NULL, 0, 0 };
+	struct dirent *d, *o;
+	DIR *derived, *sub;
+	unsigned char *data;
+	char *path;
+	int size, stale = 0, rc = 1;
+
+	memset(info, 0, sizeof(*info));
+	path = axn500_path(dir, "derived");
+	derived = path? opendir(path):NULL;
+	free(path);
+	if (derived == NULL) {
+		perror("Unable to open the store derived data");
+		return 1;
+	}
+	while ((d = readdir(derived))) {
+		if (strlen(d->d_name) != 2)
+			continue;
+		path = axn500_path(dir, "derived/%s", d->d_name);
+		sub = path? opendir(path):NULL;
+		free(path);
+		if (sub == NULL)
+			continue;
+		while ((o = readdir(sub))) {
+			if (strlen(o->d_name) != 14)
+				continue;
+			path = axn500_path(dir, "derived/%s/%s", d->d_name,
+					   o->d_name);
+			data = path? axn500_read_file(path, &size):NULL;
+			free(path);
+			if (data == NULL)
+				continue;
+			if (size < AXN500_DERIVED_HDR_SIZE ||
+			    !axn500_derived_current(data, strtoull(d->d_name, NULL, 16) << 56 |
+						    strtoull(o->d_name, NULL, 16)))
+				stale++;
+			else if (axn500_buf_reserve(&buf, size)) {
+				fprintf(stderr, "Not enough memory\n");
+				free(data);
+				closedir(sub);
+				goto out;
+			} else {
+				memcpy(buf.data + buf.len, data + AXN500_DERIVED_HDR_SIZE,
+				       size - AXN500_DERIVED_HDR_SIZE);
+				buf.len += size - AXN500_DERIVED_HDR_SIZE;
+			}
+			free(data);
+		}
+		closedir(sub);
+	}
+	if (stale)
+		fprintf(stderr, "%i exercises need to be decoded again (-R)\n",
+			stale);
+	rc = axn500_archive_decode(buf.data, buf.len, info);
+	if (info->exercises.num)
+		qsort(info->exercises.exercise, info->exercises.num,
+		      sizeof(struct axn500_exercise), axn500_start_compare);
+out:
+	closedir(derived);
+	free(buf.data);
+	return rc;
+}
+
+static int axn500_store_exercises(const char *dir, char *raw,
+				  struct axn500 *info)
+{
+	struct axn500_store store;
+	struct axn500_exercise *e;
+	struct axn500_buf manifest = { NULL, 0, 0 };
+	unsigned long long hash;
+	static unsigned int manifests;
+	char name[64];
+	char *path;
+	time_t now = time(NULL);
+	int ex, rc = 1, added = 0, present = 0;
+
+	if (axn500_store_open(&store, dir))
+		goto out;
+
+	for (ex = 0; ex < info->exercises.num; ex++) {
+		e = &info->exercises.exercise[ex];
+		if (e->raw_size == 0)
+			continue;
+		hash = axn500_hash((unsigned char *)raw + e->raw_offset, e->raw_size);
+		switch (axn500_store_put(&store, hash, raw + e->raw_offset,
+					 e->raw_size)) {
+		case 0:
+			added++;
+			break;
+		case 1:
+			present++;
+			break;
+		default:
+			goto out;
+		}
+		if (!axn500_derived_check(dir, hash) &&
+		    axn500_derived_write(dir, hash, e))
+			goto out;
+		if (axn500_buf_reserve(&manifest, 64))
+			goto out;
+		manifest.len += sprintf((char *)manifest.data + manifest.len,
+			"%016llx %02i/%02i/%02i %02i:%02i:%02i\n", hash,
+			e->date.day, e->date.month, e->date.year,
+			e->start_time.hour, e->start_time.minute,
+			e->start_time.second);
+	}
+
+	/* unique across processes and threads storing in the same second */
+	strftime(name, sizeof(name), "manifests/%Y%m%d-%H%M%S", localtime(&now));
+	do {
+		path = axn500_path(dir, "%s-%i.%u-%08x", name, (int)getpid(),
+				   __sync_fetch_and_add(&manifests, 1),
+				   info->exercises.num?
+				   info->exercises.exercise[0].watch:0);
+		if (path == NULL)
+			goto out;
+		ex = axn500_create_file(path, manifest.data, manifest.len);
+		free(path);
+	} while (ex < 0);
+	if (ex)
+		goto out;
+	printf("Stored %i new exercises, %i were already stored\n", added,
+	       present);
+	rc = 0;
+out:
+	free(manifest.data);
+	axn500_store_close(&store);
+	return rc;
+}
+
+/*
+ * Rollups
+ *
+ * <archive>.rollup keeps per watch totals by day, week (starting on
+ * Monday) and month, so the training load of any period is read instead
+ * of computed from the samples:
+ *	magic "AXR1", number of exercises (u32), number of periods (u32),
+ *	exercises: watch (u32), start (s64), totals
+ *	periods: watch (u32), kind (u32), start of the period (s64), totals
+ * with the totals being exercises, duration (s), kcal, seconds within each
+ * of the three limits and load (all u32). The load is Edwards' TRIMP, the
+ * seconds in each 10% band from 50% of AXN500_LOAD_HRMAX up weighted 1 to
+ * 5, in seconds.
+ *
+ * The exercises part remembers what each exercise added to the periods,
+ * so an exercise ingested again, possibly with different data, replaces
+ * its previous contribution instead of being counted twice. A report only
+ * reads the periods, skipping it. Both parts are sorted by watch, kind and
+ * start, so entries are found with a binary search. The file is replaced
+ * atomically.
+ */
+#define AXN500_ROLLUP_MAGIC	"AXR1"
+#define AXN500_ROLLUP_HDR_SIZE	12
+#define AXN500_ROLLUP_EX_SIZE	40
+#define AXN500_ROLLUP_PERIOD_SIZE	44
+#define AXN500_LOAD_HRMAX	190
+
+enum {
+	AXN500_ROLLUP_DAY = 0,
+	AXN500_ROLLUP_WEEK,
+	AXN500_ROLLUP_MONTH,
+	AXN500_ROLLUP_KINDS,
+};
+
+static const char *axn500_rollup_kinds[AXN500_ROLLUP_KINDS] = {
+	"day", "week", "month",
+};
+
+struct axn500_totals {
+	unsigned int exercises;
+	unsigned int duration;
+	unsigned int kcal;
+	unsigned int zone[3];
+	unsigned int load;
+};
+#define AXN500_TOTALS_FIELDS	7
+
+struct axn500_rollup_entry {
+	unsigned int watch;
+	unsigned int kind;	/* AXN500_ROLLUP_*, not used for exercises */
+	long long start;
+	struct axn500_totals totals;
+};
+
+struct axn500_rollup {
+	int num_ex;
+	int alloc_ex;
+	struct axn500_rollup_entry *ex;
+	int num_periods;
+	int alloc_periods;
+	struct axn500_rollup_entry *periods;
+};
+
+static void axn500_exercise_totals(struct axn500_exercise *e,
+				   struct axn500_totals *t)
+{
+	int i, j, band;
+
+	memset(t, 0, sizeof(*t));
+	t->exercises = 1;
+	t->duration = e->duration.hour * 3600 + e->duration.minute * 60 +
+		      e->duration.second;
+	t->kcal = e->kcal;
+	for (i = 0; i < e->entries; i++) {
+		for (j = 0; j < 3; j++)
+			if (e->data[i].hr >= e->limits[j].lower &&
+			    e->data[i].hr <= e->limits[j].upper)
+				t->zone[j] += e->record_rate;
+		band = e->data[i].hr * 10 / AXN500_LOAD_HRMAX - 4;
+		if (band > 5)
+			band = 5;
+		if (band > 0)
+			t->load += band * e->record_rate;
+	}
+}
+
+static void axn500_totals_add(struct axn500_totals *to,
+			      struct axn500_totals *t, int sign)
+{
+	unsigned int *a = &to->exercises, *b = &t->exercises;
+	int i;
+
+	for (i = 0; i < AXN500_TOTALS_FIELDS; i++)
+		a[i] += sign * b[i];
+}
+
+static void axn500_put_totals(unsigned char *p, struct axn500_totals *t)
+{
+	unsigned int *v = &t->exercises;
+	int i;
+
+	for (i = 0; i < AXN500_TOTALS_FIELDS; i++)
+		axn500_put32(p + i * 4, v[i]);
+}
+
+static void axn500_get_totals(const unsigned char *p, struct axn500_totals *t)
+{
+	unsigned int *v = &t->exercises;
+	int i;
+
+	for (i = 0; i < AXN500_TOTALS_FIELDS; i++)
+		v[i] = axn500_get32(p + i * 4);
+}
+
+/* start of the day, week or month of 't', local time */
+static time_t axn500_period_start(time_t t, int kind)
+{
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+	if (kind == AXN500_ROLLUP_WEEK)
+		tm.tm_mday -= (tm.tm_wday + 6) % 7;
+	else if (kind == AXN500_ROLLUP_MONTH)
+		tm.tm_mday = 1;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+static char *axn500_rollup_name(const char *archive)
+{
+	char *name = malloc(strlen(archive) + 8);
+
+	if (name)
+		sprintf(name, "%s.rollup", archive);
+	return name;
+}
+
+static void axn500_rollup_free(struct axn500_rollup *r)
+{
+	free(r->ex);
+	free(r->periods);
+}
+
+static int axn500_rollup_entry_compare(const void *a, const void *b)
+{
+	const struct axn500_rollup_entry *x = a, *y = b;
+
+	if (x->watch != y->watch)
+		return (x->watch > y->watch) - (x->watch < y->watch);
+	if (x->kind != y->kind)
+		return (x->kind > y->kind) - (x->kind < y->kind);
+	return (x->start > y->start) - (x->start < y->start);
+}
+
+/*
+ * Reads the rollups of an archive, none if there's no file yet. With
+ * 'periods_only' the exercises part is skipped and left empty.
+ */
+static int axn500_rollup_read(const char *archive, struct axn500_rollup *r,
+			      int periods_only)
+{
+	unsigned char hdr[AXN500_ROLLUP_HDR_SIZE], *data, *p;
+	struct stat st;
+	long long len, offset;
+	char *name;
+	int fd, i;
+
+	memset(r, 0, sizeof(*r));
+	name = axn500_rollup_name(archive);
+	if (name == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	fd = open(name, O_RDONLY);
+	if (fd < 0 && errno == ENOENT) {
+		free(name);
+		return 0;
+	}
+	if (fd < 0 || fstat(fd, &st)) {
+		perror(name);
+		free(name);
+		if (fd >= 0)
+			close(fd);
+		return 1;
+	}
+	free(name);
+	if (pread(fd, hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    memcmp(hdr, AXN500_ROLLUP_MAGIC, 4) ||
+	    st.st_size != AXN500_ROLLUP_HDR_SIZE +
+		    (long long)axn500_get32(hdr + 4) * AXN500_ROLLUP_EX_SIZE +
+		    (long long)axn500_get32(hdr + 8) * AXN500_ROLLUP_PERIOD_SIZE) {
+		fprintf(stderr, "Invalid rollup file for %s\n", archive);
+		close(fd);
+		return 1;
+	}
+	r->num_ex = periods_only? 0:axn500_get32(hdr + 4);
+	r->num_periods = axn500_get32(hdr + 8);
+	offset = AXN500_ROLLUP_HDR_SIZE + (long long)(axn500_get32(hdr + 4) -
+		 r->num_ex) * AXN500_ROLLUP_EX_SIZE;
+	len = st.st_size - offset;
+
+	r->alloc_ex = r->num_ex + 1;
+	r->alloc_periods = r->num_periods + 1;
+	r->ex = calloc(r->alloc_ex, sizeof(*r->ex));
+	r->periods = calloc(r->alloc_periods, sizeof(*r->periods));
+	data = malloc(len + 1);
+	if (r->ex == NULL || r->periods == NULL || data == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		goto error;
+	}
+	if (pread(fd, data, len, offset) != len) {
+		fprintf(stderr, "Short read while reading the rollups of %s\n",
+			archive);
+		goto error;
+	}
+	close(fd);
+
+	p = data;
+	for (i = 0; i < r->num_ex; i++, p += AXN500_ROLLUP_EX_SIZE) {
+		r->ex[i].watch = axn500_get32(p);
+		r->ex[i].start = axn500_get64(p + 4);
+		axn500_get_totals(p + 12, &r->ex[i].totals);
+	}
+	for (i = 0; i < r->num_periods; i++, p += AXN500_ROLLUP_PERIOD_SIZE) {
+		r->periods[i].watch = axn500_get32(p);
+		r->periods[i].kind = axn500_get32(p + 4);
+		r->periods[i].start = axn500_get64(p + 8);
+		axn500_get_totals(p + 16, &r->periods[i].totals);
+	}
+	free(data);
+	/* AXR1 files written before they were kept sorted */
+	qsort(r->ex, r->num_ex, sizeof(*r->ex), axn500_rollup_entry_compare);
+	qsort(r->periods, r->num_periods, sizeof(*r->periods),
+	      axn500_rollup_entry_compare);
+	return 0;
+
+error:
+	close(fd);
+	free(data);
+	axn500_rollup_free(r);
+	return 1;
+}
+
+static int axn500_rollup_write(const char *archive, struct axn500_rollup *r)
+{
+	unsigned char *data, *p;
+	char *name;
+	int len, i, rc = 1;
+
+	len = AXN500_ROLLUP_HDR_SIZE + r->num_ex * AXN500_ROLLUP_EX_SIZE +
+	      r->num_periods * AXN500_ROLLUP_PERIOD_SIZE;
+	data = malloc(len);
+	name = axn500_rollup_name(archive);
+	if (data == NULL || name == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		goto out;
+	}
+	memcpy(data, AXN500_ROLLUP_MAGIC, 4);
+	axn500_put32(data + 4, r->num_ex);
+	axn500_put32(data + 8, r->num_periods);
+	p = data + AXN500_ROLLUP_HDR_SIZE;
+	for (i = 0; i < r->num_ex; i++, p += AXN500_ROLLUP_EX_SIZE) {
+		axn500_put32(p, r->ex[i].watch);
+		axn500_put64(p + 4, r->ex[i].start);
+		axn500_put_totals(p + 12, &r->ex[i].totals);
+	}
+	for (i = 0; i < r->num_periods; i++, p += AXN500_ROLLUP_PERIOD_SIZE) {
+		axn500_put32(p, r->periods[i].watch);
+		axn500_put32(p + 4, r->periods[i].kind);
+		axn500_put64(p + 8, r->periods[i].start);
+		axn500_put_totals(p + 16, &r->periods[i].totals);
+	}
+	rc = axn500_write_file(name, data, len);
+out:
+	free(name);
+	free(data);
+	return rc;
+}
+
+/* finds an entry, adding an empty one in its place if needed */
+static struct axn500_rollup_entry *axn500_rollup_entry(
+	struct axn500_rollup_entry **list, int *num, int *alloc,
+	unsigned int watch, unsigned int kind, long long start)
+{
+	struct axn500_rollup_entry key, *tmp;
+	int lo = 0, hi = *num, mid;
+
+	memset(&key, 0, sizeof(key));
+	key.watch = watch;
+	key.kind = kind;
+	key.start = start;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (axn500_rollup_entry_compare(&(*list)[mid], &key) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo < *num && axn500_rollup_entry_compare(&(*list)[lo], &key) == 0)
+		return &(*list)[lo];
+
+	if (*num == *alloc) {
+		*alloc = *alloc? *alloc * 2:256;
+		tmp = realloc(*list, sizeof(*tmp) * *alloc);
+		if (tmp == NULL)
+			return NULL;
+		*list = tmp;
+	}
+	memmove(&(*list)[lo + 1], &(*list)[lo], sizeof(key) * (*num - lo));
+	(*list)[lo] = key;
+	(*num)++;
+	return &(*list)[lo];
+}
+
+static int axn500_rollup_compare(const void *a, const void *b)
+{
+	const struct axn500_rollup_entry *x = a, *y = b;
+
+	if (x->start != y->start)
+		return (x->start > y->start) - (x->start < y->start);
+	return (x->watch > y->watch) - (x->watch < y->watch);
+}
+
+/* adds (sign 1) or removes (sign -1) an exercise from its periods */
+static int axn500_rollup_apply(struct axn500_rollup *r,
+			       struct axn500_rollup_entry *ex, int sign)
+{
+	struct axn500_rollup_entry *period;
+	int kind, i;
+
+	for (kind = 0; kind < AXN500_ROLLUP_KINDS; kind++) {
+		period = axn500_rollup_entry(&r->periods, &r->num_periods,
+				&r->alloc_periods, ex->watch, kind,
+				axn500_period_start(ex->start, kind));
+		if (period == NULL)
+			return 1;
+		axn500_totals_add(&period->totals, &ex->totals, sign);
+		/* forget the periods left without exercises */
+		if (period->totals.exercises == 0) {
+			i = period - r->periods;
+			memmove(period, period + 1,
+				sizeof(*period) * (--r->num_periods - i));
+		}
+	}
+	return 0;
+}
+
+/*
+ * Adds the exercises to the rollups of an archive, replacing whatever they
+ * added before if they were already there
+ */
+static int axn500_rollup_exercises(const char *archive, struct axn500 *info)
+{
+	struct axn500_rollup r;
+	struct axn500_rollup_entry *entry;
+	struct axn500_totals totals;
+	struct axn500_exercise *e;
+	int ex, rc = 1;
+
+	if (axn500_rollup_read(archive, &r, 0))
+		return 1;
+	for (ex = 0; ex < info->exercises.num; ex++) {
+		e = &info->exercises.exercise[ex];
+		if (e->start == 0 ||
+		    (e->status != AXN500_EX_OK && e->status != AXN500_EX_TRUNCATED))
+			continue;
+		axn500_exercise_totals(e, &totals);
+		entry = axn500_rollup_entry(&r.ex, &r.num_ex, &r.alloc_ex,
+					    e->watch, 0, e->start);
+		if (entry == NULL)
+			goto nomem;
+		if (entry->totals.exercises) {
+			if (!memcmp(&entry->totals, &totals, sizeof(totals)))
+				continue;
+			dprintf("Replacing the totals of the exercise at %lli\n",
+				entry->start);
+			if (axn500_rollup_apply(&r, entry, -1))
+				goto nomem;
+		}
+		entry->totals = totals;
+		if (axn500_rollup_apply(&r, entry, 1))
+			goto nomem;
+	}
+	rc = axn500_rollup_write(archive, &r);
+	axn500_rollup_free(&r);
+	return rc;
+
+nomem:
+	fprintf(stderr, "Not enough memory\n");
+	axn500_rollup_free(&r);
+	return rc;
+}
+
+/*
+ * Similarity index
+ *
+ * <archive>.sim has a feature vector for each exercise, so the exercises
+ * most like a given one can be found without decoding the archive:
+ *	magic "AXS1", dimension (u32), number of exercises (u32), unused (u32)
+ *	for each exercise: watch (u32), start (s64), the features (floats)
+ * The features are the HR and the altitude (relative to the average one)
+ * resampled to AXN500_SIM_POINTS points, the share of time in each of the
+ * zones and a few totals. Everything is scaled so a typical difference is
+ * about 1 and each part weighs about the same in the distance.
+ */
+#define AXN500_SIM_MAGIC	"AXS1"
+#define AXN500_SIM_HDR_SIZE	16
+#define AXN500_SIM_POINTS	32
+#define AXN500_SIM_HR		0
+#define AXN500_SIM_ALT		AXN500_SIM_POINTS
+#define AXN500_SIM_ZONES	(2 * AXN500_SIM_POINTS)
+#define AXN500_SIM_STATS	(AXN500_SIM_ZONES + 3)
+#define AXN500_SIM_DIM		(AXN500_SIM_STATS + 5)
+#define AXN500_SIM_REC_SIZE	(12 + AXN500_SIM_DIM * 4)
+#define AXN500_SIM_CURVE_WEIGHT	0.25f
+#define AXN500_SIM_RERANK	4	/* candidates per result for DTW */
+#define AXN500_SIM_DTW_BAND	4
+
+struct axn500_sim_key {
+	unsigned int watch;
+	long long start;
+};
+
+/* the vectors are 32 byte aligned, one after the other */
+struct axn500_sim {
+	int num;
+	int alloc;
+	struct axn500_sim_key *keys;
+	float *vectors;
+};
+
+struct axn500_sim_match {
+	int index;
+	float distance;
+};
+
+typedef float axn500_v8sf __attribute__((vector_size(32)));
+
+static void axn500_sim_features(struct axn500_exercise *e, float *v)
+{
+	struct axn500_totals totals;
+	long long alt_sum = 0;
+	int i, p, from, to, count, ascent = 0;
+	float hr, alt, avg_alt;
+
+	memset(v, 0, sizeof(float) * AXN500_SIM_DIM);
+	if (e->entries == 0)
+		return;
+
+	for (i = 0; i < e->entries; i++) {
+		alt_sum += e->data[i].altitude;
+		if (i && e->data[i].altitude > e->data[i - 1].altitude)
+			ascent += e->data[i].altitude - e->data[i - 1].altitude;
+	}
+	avg_alt = (float)alt_sum / e->entries;
+
+	for (p = 0; p < AXN500_SIM_POINTS; p++) {
+		from = (long long)p * e->entries / AXN500_SIM_POINTS;
+		to = (long long)(p + 1) * e->entries / AXN500_SIM_POINTS;
+		if (to == from)
+			to = from + 1;
+		hr = alt = 0;
+		count = 0;
+		for (i = from; i < to; i++) {
+			/* no HR is a dropout, not a rest */
+			if (e->data[i].hr) {
+				hr += e->data[i].hr;
+				count++;
+			}
+			alt += e->data[i].altitude;
+		}
+		if (count)
+			v[AXN500_SIM_HR + p] = hr / count / 200 *
+					       AXN500_SIM_CURVE_WEIGHT;
+		v[AXN500_SIM_ALT + p] = (alt / (to - from) - avg_alt) / 500 *
+					AXN500_SIM_CURVE_WEIGHT;
+	}
+
+	axn500_exercise_totals(e, &totals);
+	for (i = 0; i < 3; i++)
+		v[AXN500_SIM_ZONES + i] = (float)totals.zone[i] /
+			(e->entries * e->record_rate);
+	v[AXN500_SIM_STATS] = totals.duration / (3 * 3600.0f);
+	v[AXN500_SIM_STATS + 1] = e->avg_hr / 200.0f;
+	v[AXN500_SIM_STATS + 2] = e->max_hr / 200.0f;
+	v[AXN500_SIM_STATS + 3] = ascent / 1000.0f;
+	v[AXN500_SIM_STATS + 4] = totals.load / (3 * 3600.0f);
+}
+
+static void axn500_sim_free(struct axn500_sim *sim)
+{
+	free(sim->keys);
+	free(sim->vectors);
+	memset(sim, 0, sizeof(*sim));
+}
+
+static int axn500_sim_grow(struct axn500_sim *sim, int num)
+{
+	struct axn500_sim_key *keys;
+	float *vectors;
+	int alloc = sim->alloc? sim->alloc:64;
+
+	if (num <= sim->alloc)
+		return 0;
+	while (alloc < num)
+		alloc *= 2;
+	keys = realloc(sim->keys, sizeof(*keys) * alloc);
+	if (keys == NULL)
+		return 1;
+	sim->keys = keys;
+	if (posix_memalign((void **)&vectors, sizeof(axn500_v8sf),
+			   sizeof(float) * AXN500_SIM_DIM * alloc))
+		return 1;
+	if (sim->num)
+		memcpy(vectors, sim->vectors,
+		       sizeof(float) * AXN500_SIM_DIM * sim->num);
+	free(sim->vectors);
+	sim->vectors = vectors;
+	sim->alloc = alloc;
+	return 0;
+}
+
+static char *axn500_sim_name(const char *archive)
+{
+	char *name = malloc(strlen(archive) + 5);
+
+	if (name)
+		sprintf(name, "%s.sim", archive);
+	return name;
+}
+
+/* a missing index is an empty one, 'missing' tells which */
+static int axn500_sim_read(const char *archive, struct axn500_sim *sim,
+			   int *missing)
+{
+	unsigned char *data, *p;
+	unsigned int bits;
+	char *name;
+	int size, num, i, j;
+
+	memset(sim, 0, sizeof(*sim));
+	*missing = 0;
+	name = axn500_sim_name(archive);
+	if (name == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	if (access(name, F_OK)) {
+		free(name);
+		*missing = 1;
+		return 0;
+	}
+	data = axn500_read_file(name, &size);
+	free(name);
+	if (data == NULL)
+		return 1;
+	if (size < AXN500_SIM_HDR_SIZE || memcmp(data, AXN500_SIM_MAGIC, 4) ||
+	    axn500_get32(data + 4) != AXN500_SIM_DIM ||
+	    size != AXN500_SIM_HDR_SIZE +
+		    axn500_get32(data + 8) * AXN500_SIM_REC_SIZE) {
+		/* different features, they have to be computed again */
+		dprintf("Ignoring similarity index of %s\n", archive);
+		free(data);
+		*missing = 1;
+		return 0;
+	}
+	num = axn500_get32(data + 8);
+	if (axn500_sim_grow(sim, num)) {
+		fprintf(stderr, "Not enough memory\n");
+		axn500_sim_free(sim);
+		free(data);
+		return 1;
+	}
+	p = data + AXN500_SIM_HDR_SIZE;
+	for (i = 0; i < num; i++, p += AXN500_SIM_REC_SIZE) {
+		sim->keys[i].watch = axn500_get32(p);
+		sim->keys[i].start = axn500_get64(p + 4);
+		for (j = 0; j < AXN500_SIM_DIM; j++) {
+			bits = axn500_get32(p + 12 + j * 4);
+			memcpy(&sim->vectors[i * AXN500_SIM_DIM + j], &bits, 4);
+		}
+	}
+	sim->num = num;
+	free(data);
+	return 0;
+}
+
+static int axn500_sim_write(const char *archive, struct axn500_sim *sim)
+{
+	unsigned char *data, *p;
+	unsigned int bits;
+	char *name;
+	int len, i, j, rc = 1;
+
+	len = AXN500_SIM_HDR_SIZE + sim->num * AXN500_SIM_REC_SIZE;
+	data = calloc(len, 1);
+	name = axn500_sim_name(archive);
+	if (data == NULL || name == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		goto out;
+	}
+	memcpy(data, AXN500_SIM_MAGIC, 4);
+	axn500_put32(data + 4, AXN500_SIM_DIM);
+	axn500_put32(data + 8, sim->num);
+	p = data + AXN500_SIM_HDR_SIZE;
+	for (i = 0; i < sim->num; i++, p += AXN500_SIM_REC_SIZE) {
+		axn500_put32(p, sim->keys[i].watch);
+		axn500_put64(p + 4, sim->keys[i].start);
+		for (j = 0; j < AXN500_SIM_DIM; j++) {
+			memcpy(&bits, &sim->vectors[i * AXN500_SIM_DIM + j], 4);
+			axn500_put32(p + 12 + j * 4, bits);
+		}
+	}
+	rc = axn500_write_file(name, data, len);
+out:
+	free(name);
+	free(data);
+	return rc;
+}
+
+static int axn500_sim_find(struct axn500_sim *sim, unsigned int watch,
+			   long long start)
+{
+	int i;
+
+	for (i = 0; i < sim->num; i++)
+		if (sim->keys[i].watch == watch && sim->keys[i].start == start)
+			return i;
+	return -1;
+}
+
+/* adds or replaces the features of the exercises in 'info' */
+static int axn500_sim_update(struct axn500_sim *sim, struct axn500 *info)
+{
+	struct axn500_exercise *e;
+	int ex, i;
+
+	for (ex = 0; ex < info->exercises.num; ex++) {
+		e = &info->exercises.exercise[ex];
+		if (e->start == 0 || e->data == NULL ||
+		    (e->status != AXN500_EX_OK && e->status != AXN500_EX_TRUNCATED))
+			continue;
+		i = axn500_sim_find(sim, e->watch, e->start);
+		if (i < 0) {
+			if (axn500_sim_grow(sim, sim->num + 1)) {
+				fprintf(stderr, "Not enough memory\n");
+				return 1;
+			}
+			i = sim->num++;
+			sim->keys[i].watch = e->watch;
+			sim->keys[i].start = e->start;
+		}
+		axn500_sim_features(e, &sim->vectors[i * AXN500_SIM_DIM]);
+	}
+	return 0;
+}
+
+/*
+ * Reads the index, building it from the whole archive if there's none yet
+ * or it has other features
+ */
+static int axn500_sim_load(const char *archive, struct axn500_sim *sim)
+{
+	struct axn500 info;
+	int missing, rc;
+
+	if (axn500_sim_read(archive, sim, &missing))
+		return 1;
+	if (!missing)
+		return 0;
+
+	dprintf("Building the similarity index of %s\n", archive);
+	rc = 0;
+	memset(&info, 0, sizeof(info));
+	if (access(archive, F_OK) == 0) {
+		rc = axn500_archive_read(archive, &info) ||
+		     axn500_sim_update(sim, &info);
+		axn500_free_exercises(&info);
+	}
+	if (rc == 0)
+		rc = axn500_sim_write(archive, sim);
+	if (rc)
+		axn500_sim_free(sim);
+	return rc;
+}
+
+static int axn500_sim_exercises(const char *archive, struct axn500 *info)
+{
+	struct axn500_sim sim;
+	int rc;
+
+	if (axn500_sim_load(archive, &sim))
+		return 1;
+	rc = axn500_sim_update(&sim, info) || axn500_sim_write(archive, &sim);
+	axn500_sim_free(&sim);
+	return rc;
+}
+
+/* squared euclidean distance, 8 floats at a time */
+static float axn500_sim_distance(const float *a, const float *b)
+{
+	const axn500_v8sf *va = (const axn500_v8sf *)a;
+	const axn500_v8sf *vb = (const axn500_v8sf *)b;
+	axn500_v8sf d, sum = { 0 };
+	float total = 0;
+	int i;
+
+	for (i = 0; i < AXN500_SIM_DIM / 8; i++) {
+		d = va[i] - vb[i];
+		sum += d * d;
+	}
+	for (i = 0; i < 8; i++)
+		total += sum[i];
+	return total;
+}
+
+/*
+ * Dynamic time warping between the HR and altitude curves, so an exercise
+ * with the same shape but a longer warm up is still close. Only a band
+ * around the diagonal is considered.
+ */
+static float axn500_sim_dtw(const float *a, const float *b)
+{
+	float cost[AXN500_SIM_POINTS + 1][AXN500_SIM_POINTS + 1];
+	float dh, da, best;
+	int i, j;
+
+	for (i = 0; i <= AXN500_SIM_POINTS; i++)
+		for (j = 0; j <= AXN500_SIM_POINTS; j++)
+			cost[i][j] = 1e30f;
+	cost[0][0] = 0;
+	for (i = 1; i <= AXN500_SIM_POINTS; i++) {
+		for (j = i - AXN500_SIM_DTW_BAND; j <= i + AXN500_SIM_DTW_BAND; j++) {
+			if (j < 1 || j > AXN500_SIM_POINTS)
+				continue;
+			dh = a[AXN500_SIM_HR + i - 1] - b[AXN500_SIM_HR + j - 1];
+			da = a[AXN500_SIM_ALT + i - 1] - b[AXN500_SIM_ALT + j - 1];
+			best = cost[i - 1][j - 1];
+			if (cost[i - 1][j] < best)
+				best = cost[i - 1][j];
+			if (cost[i][j - 1] < best)
+				best = cost[i][j - 1];
+			cost[i][j] = best + dh * dh + da * da;
+		}
+	}
+	return cost[AXN500_SIM_POINTS][AXN500_SIM_POINTS];
+}
+
+/* keeps the 'k' smallest distances sorted, returns how many there are */
+static int axn500_sim_insert(struct axn500_sim_match *best, int num, int k,
+			     int index, float distance)
+{
+	int i;
+
+	if (num == k && distance >= best[k - 1].distance)
+		return num;
+	if (num < k)
+		num++;
+	for (i = num - 1; i > 0 && best[i - 1].distance > distance; i--)
+		best[i] = best[i - 1];
+	best[i].index = index;
+	best[i].distance = distance;
+	return num;
+}
+
+static int axn500_sim_match_compare(const void *a, const void *b)
+{
+	const struct axn500_sim_match *x = a, *y = b;
+
+	return (x->distance > y->distance) - (x->distance < y->distance);
+}
+
+/*
+ * Finds the (at most) 'k' exercises closest to 'query', which has to be 32
+ * byte aligned, skipping the exercise 'skip'. With 'dtw', the closest
+ * k * AXN500_SIM_RERANK are ranked again replacing the distance between the
+ * curves with their DTW distance. 'best' must have room for that many.
+ */
+static int axn500_sim_search(struct axn500_sim *sim, const float *query,
+			     int skip, int k, int dtw,
+			     struct axn500_sim_match *best)
+{
+	const float *v;
+	float curves;
+	int i, j, num = 0, wanted = dtw? k * AXN500_SIM_RERANK:k;
+
+	for (i = 0; i < sim->num; i++)
+		if (i != skip)
+			num = axn500_sim_insert(best, num, wanted, i,
+				axn500_sim_distance(query,
+					&sim->vectors[i * AXN500_SIM_DIM]));
+	if (!dtw)
+		return num;
+
+	for (i = 0; i < num; i++) {
+		v = &sim->vectors[best[i].index * AXN500_SIM_DIM];
+		curves = 0;
+		for (j = 0; j < AXN500_SIM_ZONES; j++)
+			curves += (query[j] - v[j]) * (query[j] - v[j]);
+		best[i].distance += axn500_sim_dtw(query, v) - curves;
+	}
+	qsort(best, num, sizeof(*best), axn500_sim_match_compare);
+	return num < k? num:k;
+}
+
+/*
+ * Ingest checkpoint
+ *
+ * <archive>.ckpt says how much of the archive was committed and which
+ * exercises (by hash of their raw data) are in it:
+ *	magic "AXC1", archive length (u64), number of hashes (u32),
+ *	sorted hashes (u64 each)
+ * It's replaced atomically after the archive is synced. Anything in the
+ * archive after the committed length comes from an interrupted ingest and
+ * is dropped on the next start, and the exercises already committed are
+ * never appended again, whichever dump they come from.
+ */
+#define AXN500_CKPT_MAGIC	"AXC1"
+#define AXN500_CKPT_HDR_SIZE	16
+
+struct axn500_checkpoint {
+	const char *archive;
+	char *name;
+	long long length;
+	int num;
+	int alloc;
+	unsigned long long *hashes;
+};
+
+static int axn500_checkpoint_find(struct axn500_checkpoint *ckpt,
+				  unsigned long long hash)
+{
+	int lo = 0, hi = ckpt->num, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (ckpt->hashes[mid] < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static int axn500_checkpoint_has(struct axn500_checkpoint *ckpt,
+				 unsigned long long hash)
+{
+	int i = axn500_checkpoint_find(ckpt, hash);
+
+	return i < ckpt->num && ckpt->hashes[i] == hash;
+}
+
+static int axn500_checkpoint_add(struct axn500_checkpoint *ckpt,
+				 unsigned long long hash)
+{
+	unsigned long long *tmp;
+	int i;
+
+	if (ckpt->num == ckpt->alloc) {
+		ckpt->alloc = ckpt->alloc? ckpt->alloc * 2:256;
+		tmp = realloc(ckpt->hashes, sizeof(*tmp) * ckpt->alloc);
+		if (tmp == NULL)
+			return 1;
+		ckpt->hashes = tmp;
+	}
+	i = axn500_checkpoint_find(ckpt, hash);
+	memmove(&ckpt->hashes[i + 1], &ckpt->hashes[i],
+		sizeof(*ckpt->hashes) * (ckpt->num - i));
+	ckpt->hashes[i] = hash;
+	ckpt->num++;
+	return 0;
+}
+
+static void axn500_checkpoint_free(struct axn500_checkpoint *ckpt)
+{
+	free(ckpt->hashes);
+	free(ckpt->name);
+}
+
+static int axn500_checkpoint_save(struct axn500_checkpoint *ckpt)
+{
+	unsigned char *data;
+	int i, len, rc;
+
+	len = AXN500_CKPT_HDR_SIZE + ckpt->num * 8;
+	data = malloc(len);
+	if (data == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	memcpy(data, AXN500_CKPT_MAGIC, 4);
+	axn500_put64(data + 4, ckpt->length);
+	axn500_put32(data + 12, ckpt->num);
+	for (i = 0; i < ckpt->num; i++)
+		axn500_put64(data + AXN500_CKPT_HDR_SIZE + i * 8, ckpt->hashes[i]);
+	rc = axn500_write_file(ckpt->name, data, len);
+	free(data);
+	return rc;
+}
+
+static int axn500_checkpoint_exists(const char *archive)
+{
+	char name[strlen(archive) + 6];
+
+	sprintf(name, "%s.ckpt", archive);
+	return access(name, F_OK) == 0;
+}
+
+/*
+ * Writers of an archive with a checkpoint hold an exclusive lock on
+ * <archive>.lock from loading the checkpoint until it's saved, so none of
+ * them takes the records another one is still appending for uncommitted
+ * bytes. Returns the descriptor to close to unlock, -1 on errors.
+ */
+static int axn500_archive_lock(const char *archive)
+{
+	char name[strlen(archive) + 6];
+	int fd;
+
+	sprintf(name, "%s.lock", archive);
+	fd = open(name, O_CREAT | O_RDWR | O_CLOEXEC, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		perror(name);
+		return -1;
+	}
+	while (flock(fd, LOCK_EX)) {
+		if (errno == EINTR)
+			continue;
+		perror(name);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * Loads the checkpoint of an archive and rolls the archive back to it. An
+ * archive without a checkpoint is taken as committed as it is.
+ */
+static int axn500_checkpoint_load(const char *archive,
+				  struct axn500_checkpoint *ckpt)
+{
+	unsigned char *data;
+	struct stat st;
+	char *index;
+	int size, i;
+
+	memset(ckpt, 0, sizeof(*ckpt));
+	ckpt->archive = archive;
+	ckpt->name = malloc(strlen(archive) + 6);
+	if (ckpt->name == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	sprintf(ckpt->name, "%s.ckpt", archive);
+
+	if (stat(archive, &st)) {
+		if (errno != ENOENT) {
+			perror(archive);
+			return 1;
+		}
+		st.st_size = 0;
+	}
+	if (access(ckpt->name, F_OK)) {
+		ckpt->length = st.st_size;
+		return axn500_checkpoint_save(ckpt);
+	}
+
+	data = axn500_read_file(ckpt->name, &size);
+	if (data == NULL)
+		return 1;
+	if (size < AXN500_CKPT_HDR_SIZE || memcmp(data, AXN500_CKPT_MAGIC, 4) ||
+	    size != AXN500_CKPT_HDR_SIZE + axn500_get32(data + 12) * 8) {
+		fprintf(stderr, "Invalid checkpoint %s\n", ckpt->name);
+		free(data);
+		return 1;
+	}
+	ckpt->length = axn500_get64(data + 4);
+	ckpt->num = ckpt->alloc = axn500_get32(data + 12);
+	ckpt->hashes = malloc(sizeof(*ckpt->hashes) * (ckpt->num + 1));
+	if (ckpt->hashes == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		free(data);
+		return 1;
+	}
+	for (i = 0; i < ckpt->num; i++)
+		ckpt->hashes[i] = axn500_get64(data + AXN500_CKPT_HDR_SIZE + i * 8);
+	free(data);
+
+	if (st.st_size > ckpt->length) {
+		fprintf(stderr, "Dropping %lli uncommitted bytes from %s\n",
+			(long long)st.st_size - ckpt->length, archive);
+		if (truncate(archive, ckpt->length)) {
+			perror(archive);
+			return 1;
+		}
+		/* the index may describe the dropped records */
+		index = axn500_index_name(archive);
+		if (index)
+			unlink(index);
+		free(index);
+	} else if (st.st_size < ckpt->length) {
+		fprintf(stderr, "%s is shorter than its checkpoint\n", archive);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Appends to the archive the exercises that aren't in the checkpoint yet,
+ * then commits them. Returns the number of exercises added, -1 on errors.
+ */
+static int axn500_ingest_commit(struct axn500_checkpoint *ckpt, char *raw,
+				struct axn500 *info)
+{
+	struct axn500_index_entry *entries;
+	struct axn500_buf buf = { NULL, 0, 0 };
+	struct axn500_exercise *e;
+	unsigned long long *hashes;
+	int fd, ex, num, added = 0, rc = -1;
+
+	hashes = malloc(sizeof(*hashes) * (info->exercises.num + 1));
+	if (hashes == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		return -1;
+	}
+	for (ex = 0; ex < info->exercises.num; ex++) {
+		e = &info->exercises.exercise[ex];
+		if (e->raw_size == 0 ||
+		    (e->status != AXN500_EX_OK && e->status != AXN500_EX_TRUNCATED))
+			continue;
+		hashes[added] = axn500_hash((unsigned char *)raw + e->raw_offset,
+					    e->raw_size);
+		if (axn500_checkpoint_has(ckpt, hashes[added]))
+			continue;
+		if (axn500_compress_exercise(e, &buf)) {
+			fprintf(stderr, "Not enough memory\n");
+			goto out;
+		}
+		added++;
+	}
+	rc = 0;
+	if (added == 0)
+		goto out;
+
+	rc = -1;
+	fd = open(ckpt->archive, O_CREAT | O_WRONLY, S_IRUSR | S_IWUSR);
+	if (fd < 0) {
+		perror("Error opening archive");
+		goto out;
+	}
+	if (pwrite(fd, buf.data, buf.len, ckpt->length) != buf.len ||
+	    fsync(fd)) {
+		perror("Error writing archive");
+		close(fd);
+		goto out;
+	}
+	close(fd);
+
+	ckpt->length += buf.len;
+	/* before the checkpoint: if we don't get there, this is done again */
+	if (axn500_rollup_exercises(ckpt->archive, info) ||
+	    axn500_sim_exercises(ckpt->archive, info))
+		goto out;
+	for (ex = 0; ex < added; ex++)
+		if (axn500_checkpoint_add(ckpt, hashes[ex])) {
+			fprintf(stderr, "Not enough memory\n");
+			goto out;
+		}
+	if (axn500_checkpoint_save(ckpt))
+		goto out;
+	if (axn500_index_sync(ckpt->archive, &entries, &num))
+		goto out;
+	free(entries);
+	rc = added;
+out:
+	free(hashes);
+	free(buf.data);
+	return rc;
+}
+
+/*
+ * Compaction
+ *
+ * Rewrites an archive with more exercises merged in, sorted by watch and
+ * start time and with a single copy of each exercise, in a bounded amount
+ * of memory. The records are collected in a run buffer and, whenever it
+ * fills up half the budget (buffers grow by doubling), sorted and spilled
+ * to a temporary run file next to the archive. The runs are then merged,
+ * as many at once as fit in the budget with AXN500_COMPACT_READ bytes of
+ * read buffer each, in as many passes as needed. Of the records of an
+ * exercise the one with the most samples is kept, the others are copies or
+ * were transferred before the exercise was complete. Records without a
+ * start time can't be told apart and are all kept.
+ */
+#define AXN500_COMPACT_READ	(64 * 1024)
+#define AXN500_COMPACT_MAX_RECORD	(16 << 20)
+
+struct axn500_compact_key {
+	unsigned int watch;
+	long long start;
+	unsigned int entries;
+	unsigned long long hash;	/* picks among copies just as long */
+};
+
+struct axn500_compact_item {
+	struct axn500_compact_key key;
+	int offset;
+	int size;
+};
+
+struct axn500_compact {
+	const char *archive;
+	size_t budget;
+	struct axn500_buf buf;
+	struct axn500_compact_item *items;
+	int num_items;
+	int alloc_items;
+	char **runs;
+	int num_runs;
+	int alloc_runs;
+	/* for the report */
+	int records;
+	int archived;		/* of the records, read from the archive */
+	int kept;
+	int duplicates;
+	int spilled;
+	int merges;
+};
+
+struct axn500_compact_reader {
+	FILE *file;
+	const char *name;
+	unsigned char *rec;
+	int size;
+	int alloc;
+	struct axn500_compact_key key;
+};
+
+/* where the records of the final pass go */
+struct axn500_compact_out {
+	char *name;
+	FILE *file;
+	struct axn500_buf batch;
+	int limit;
+	int records;
+};
+
+typedef int (*axn500_compact_emit)(void *arg, const unsigned char *rec,
+				   int size);
+
+static void axn500_compact_key(const unsigned char *rec,
+			       struct axn500_compact_key *key)
+{
+	struct tm tm;
+
+	key->entries = axn500_get32(rec + 33);
+	key->hash = axn500_hash(rec, axn500_get32(rec + 4));
+	if (rec[3] >= 2) {
+		key->watch = axn500_get32(rec + 39);
+		key->start = axn500_get64(rec + 43);
+		return;
+	}
+	/* version 1 records only have the date */
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_mday = rec[8];
+	tm.tm_mon = rec[9] - 1;
+	tm.tm_year = rec[10] + 100;
+	tm.tm_hour = rec[11];
+	tm.tm_min = rec[12];
+	tm.tm_sec = rec[13];
+	tm.tm_isdst = -1;
+	key->watch = 0;
+	key->start = rec[8]? mktime(&tm):0;
+}
+
+/* by watch and start, the longest copy first */
+static int axn500_compact_compare_keys(const struct axn500_compact_key *a,
+				       const struct axn500_compact_key *b)
+{
+	if (a->watch != b->watch)
+		return a->watch < b->watch? -1:1;
+	if (a->start != b->start)
+		return a->start < b->start? -1:1;
+	if (a->entries != b->entries)
+		return a->entries > b->entries? -1:1;
+	if (a->hash != b->hash)
+		return a->hash < b->hash? -1:1;
+	return 0;
+}
+
+static int axn500_compact_compare(const void *a, const void *b)
+{
+	const struct axn500_compact_item *x = a, *y = b;
+
+	return axn500_compact_compare_keys(&x->key, &y->key);
+}
+
+static void axn500_compact_init(struct axn500_compact *c, const char *archive,
+				size_t budget)
+{
+	memset(c, 0, sizeof(*c));
+	c->archive = archive;
+	c->budget = budget;
+}
+
+/* removes the runs left, after an error too */
+static void axn500_compact_free(struct axn500_compact *c)
+{
+	int i;
+
+	for (i = 0; i < c->num_runs; i++) {
+		unlink(c->runs[i]);
+		free(c->runs[i]);
+	}
+	free(c->runs);
+	free(c->items);
+	free(c->buf.data);
+	memset(c, 0, sizeof(*c));
+}
+
+/* creates a new run, added to the list so it's removed whatever happens */
+static FILE *axn500_compact_run(struct axn500_compact *c)
+{
+	char **tmp, *name;
+	FILE *file;
+	int fd;
+
+	if (c->num_runs == c->alloc_runs) {
+		c->alloc_runs = c->alloc_runs? c->alloc_runs * 2:16;
+		tmp = realloc(c->runs, sizeof(*tmp) * c->alloc_runs);
+		if (tmp == NULL)
+			goto nomem;
+		c->runs = tmp;
+	}
+	name = malloc(strlen(c->archive) + 12);
+	if (name == NULL)
+		goto nomem;
+	sprintf(name, "%s.run.XXXXXX", c->archive);
+	fd = mkstemp(name);
+	if (fd < 0) {
+		perror(name);
+		free(name);
+		return NULL;
+	}
+	c->runs[c->num_runs++] = name;
+	file = fdopen(fd, "w");
+	if (file == NULL) {
+		perror(name);
+		close(fd);
+	}
+	return file;
+
+nomem:
+	fprintf(stderr, "Not enough memory\n");
+	return NULL;
+}
+
+static int axn500_compact_close(FILE *file, const char *name)
+{
+	if (ferror(file) | fclose(file)) {
+		perror(name);
+		return 1;
+	}
+	return 0;
+}
+
+/* sorts the run buffer and writes it out */
+static int axn500_compact_spill(struct axn500_compact *c)
+{
+	struct axn500_compact_item *item;
+	FILE *run;
+	int i;
+
+	if (c->num_items == 0)
+		return 0;
+	qsort(c->items, c->num_items, sizeof(*c->items), axn500_compact_compare);
+	run = axn500_compact_run(c);
+	if (run == NULL)
+		return 1;
+	dprintf("Spilling %i records, %i bytes, to %s\n", c->num_items,
+		c->buf.len, c->runs[c->num_runs - 1]);
+	for (i = 0, item = c->items; i < c->num_items; i++, item++)
+		fwrite(c->buf.data + item->offset, 1, item->size, run);
+	if (axn500_compact_close(run, c->runs[c->num_runs - 1]))
+		return 1;
+	c->buf.len = 0;
+	c->num_items = 0;
+	c->spilled++;
+	return 0;
+}
+
+/* takes in the record just put at 'offset' in the run buffer */
+static int axn500_compact_item(struct axn500_compact *c, int offset)
+{
+	struct axn500_compact_item *tmp, *item;
+
+	if (c->num_items == c->alloc_items) {
+		c->alloc_items = c->alloc_items? c->alloc_items * 2:256;
+		tmp = realloc(c->items, sizeof(*tmp) * c->alloc_items);
+		if (tmp == NULL) {
+			fprintf(stderr, "Not enough memory\n");
+			return 1;
+		}
+		c->items = tmp;
+	}
+	item = &c->items[c->num_items++];
+	item->offset = offset;
+	item->size = axn500_get32(c->buf.data + offset + 4);
+	axn500_compact_key(c->buf.data + offset, &item->key);
+	c->records++;
+
+	if ((size_t)c->buf.len + sizeof(*c->items) * c->alloc_items >=
+	    c->budget / 2)
+		return axn500_compact_spill(c);
+	return 0;
+}
+
+static int axn500_compact_record(struct axn500_compact *c,
+				 const unsigned char *rec, int size)
+{
+	int offset = c->buf.len;
+
+	if (axn500_buf_reserve(&c->buf, size)) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	memcpy(c->buf.data + offset, rec, size);
+	c->buf.len += size;
+	return axn500_compact_item(c, offset);
+}
+
+/* the exercises that can be placed in time, as ingest_commit() takes them */
+static int axn500_compact_exercises(struct axn500_compact *c,
+				    struct axn500 *info)
+{
+	struct axn500_exercise *e;
+	int ex, offset;
+
+	for (ex = 0; ex < info->exercises.num; ex++) {
+		e = &info->exercises.exercise[ex];
+		if (e->start == 0 ||
+		    (e->status != AXN500_EX_OK && e->status != AXN500_EX_TRUNCATED))
+			continue;
+		offset = c->buf.len;
+		if (axn500_compress_exercise(e, &c->buf)) {
+			fprintf(stderr, "Not enough memory\n");
+			return 1;
+		}
+		if (axn500_compact_item(c, offset))
+			return 1;
+	}
+	return 0;
+}
+
+/* reads the next record, returns its size, 0 at the end and -1 on errors */
+static int axn500_compact_read(FILE *file, const char *name,
+			       unsigned char **rec, int *alloc)
+{
+	unsigned char hdr[8], *tmp;
+	long long pos = ftello(file);
+	size_t n;
+	int size;
+
+	n = fread(hdr, 1, sizeof(hdr), file);
+	if (n == 0 && !ferror(file))
+		return 0;
+	size = (n == sizeof(hdr))? (int)axn500_get32(hdr + 4):0;
+	if (size < AXN500_Z_HDR_SIZE_V1 || size > AXN500_COMPACT_MAX_RECORD)
+		goto invalid;
+	if (size > *alloc) {
+		tmp = realloc(*rec, size);
+		if (tmp == NULL) {
+			fprintf(stderr, "Not enough memory\n");
+			return -1;
+		}
+		*rec = tmp;
+		*alloc = size;
+	}
+	memcpy(*rec, hdr, sizeof(hdr));
+	if (fread(*rec + sizeof(hdr), 1, size - sizeof(hdr), file) !=
+	    size - sizeof(hdr) || axn500_zrecord_size(*rec, size) != size)
+		goto invalid;
+	return size;
+
+invalid:
+	if (ferror(file))
+		perror(name);
+	else
+		fprintf(stderr, "Invalid archive record at offset %lli of %s\n",
+			pos, name);
+	return -1;
+}
+
+/* streams the records of an archive into the runs */
+static int axn500_compact_archive(struct axn500_compact *c, const char *archive)
+{
+	unsigned char *rec = NULL;
+	FILE *file;
+	int size, alloc = 0;
+
+	file = fopen(archive, "r");
+	if (file == NULL) {
+		perror(archive);
+		return 1;
+	}
+	while ((size = axn500_compact_read(file, archive, &rec, &alloc)) > 0) {
+		if (axn500_compact_record(c, rec, size))
+			break;
+		c->archived++;
+	}
+	fclose(file);
+	free(rec);
+	return size != 0;
+}
+
+static int axn500_compact_next(struct axn500_compact_reader *r)
+{
+	r->size = axn500_compact_read(r->file, r->name, &r->rec, &r->alloc);
+	if (r->size > 0)
+		axn500_compact_key(r->rec, &r->key);
+	return r->size;
+}
+
+static void axn500_compact_sift(struct axn500_compact_reader *readers,
+				int *heap, int num, int i)
+{
+	int child, top = heap[i];
+
+	while ((child = 2 * i + 1) < num) {
+		if (child + 1 < num &&
+		    axn500_compact_compare_keys(&readers[heap[child + 1]].key,
+						&readers[heap[child]].key) < 0)
+			child++;
+		if (axn500_compact_compare_keys(&readers[heap[child]].key,
+						&readers[top].key) >= 0)
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = top;
+}
+
+/* k-way merge of sorted runs, 'emit' gets the records kept */
+static int axn500_compact_merge(struct axn500_compact *c, char **runs,
+				int num, axn500_compact_emit emit, void *arg)
+{
+	struct axn500_compact_reader *readers, *r;
+	struct axn500_compact_key last = { 0, 0, 0, 0 };
+	int *heap, i, n = 0, rc = 1;
+
+	readers = calloc(num, sizeof(*readers));
+	heap = malloc(sizeof(*heap) * (num + 1));
+	if (readers == NULL || heap == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		goto out;
+	}
+	for (i = 0; i < num; i++) {
+		r = &readers[i];
+		r->name = runs[i];
+		r->file = fopen(runs[i], "r");
+		if (r->file == NULL) {
+			perror(runs[i]);
+			goto out;
+		}
+		setvbuf(r->file, NULL, _IOFBF, AXN500_COMPACT_READ);
+		switch (axn500_compact_next(r)) {
+		case -1:
+			goto out;
+		case 0:
+			break;
+		default:
+			heap[n++] = i;
+		}
+	}
+	for (i = n / 2 - 1; i >= 0; i--)
+		axn500_compact_sift(readers, heap, n, i);
+
+	while (n) {
+		r = &readers[heap[0]];
+		if (r->key.start && r->key.watch == last.watch &&
+		    r->key.start == last.start) {
+			c->duplicates++;
+		} else {
+			if (emit(arg, r->rec, r->size))
+				goto out;
+			last = r->key;
+		}
+		switch (axn500_compact_next(r)) {
+		case -1:
+			goto out;
+		case 0:
+			heap[0] = heap[--n];
+			break;
+		}
+		if (n)
+			axn500_compact_sift(readers, heap, n, 0);
+	}
+	rc = 0;
+out:
+	for (i = 0; readers && i < num; i++) {
+		if (readers[i].file)
+			fclose(readers[i].file);
+		free(readers[i].rec);
+	}
+	free(readers);
+	free(heap);
+	return rc;
+}
+
+static int axn500_compact_emit_run(void *arg, const unsigned char *rec,
+				   int size)
+{
+	fwrite(rec, 1, size, arg);
+	return 0;
+}
+
+/* the rollups and the similarity index are built a batch at a time */
+static int axn500_compact_flush(struct axn500_compact_out *out)
+{
+	struct axn500 info;
+	int rc;
+
+	if (out->batch.len == 0)
+		return 0;
+	memset(&info, 0, sizeof(info));
+	rc = axn500_archive_decode(out->batch.data, out->batch.len, &info) ||
+	     axn500_rollup_exercises(out->name, &info) ||
+	     axn500_sim_exercises(out->name, &info);
+	axn500_free_exercises(&info);
+	out->batch.len = 0;
+	return rc;
+}
+
+static int axn500_compact_emit_archive(void *arg, const unsigned char *rec,
+				       int size)
+{
+	struct axn500_compact_out *out = arg;
+
+	if (fwrite(rec, 1, size, out->file) != size) {
+		perror(out->name);
+		return 1;
+	}
+	out->records++;
+	if (axn500_buf_reserve(&out->batch, size)) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	memcpy(out->batch.data + out->batch.len, rec, size);
+	out->batch.len += size;
+	return out->batch.len >= out->limit? axn500_compact_flush(out):0;
+}
+
+static void axn500_compact_unlink(char *(*sidecar)(const char *),
+				  const char *archive)
+{
+	char *name = sidecar(archive);
+
+	if (name)
+		unlink(name);
+	free(name);
+}
+
+/* moves a sidecar of the new archive over the one of the archive */
+static int axn500_compact_rename(char *(*sidecar)(const char *),
+				 const char *from, const char *to)
+{
+	char *src = sidecar(from), *dst = sidecar(to);
+	int rc = 1;
+
+	if (src == NULL || dst == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		goto out;
+	}
+	if (access(src, F_OK))
+		rc = unlink(dst) && errno != ENOENT;
+	else
+		rc = rename(src, dst);
+	if (rc)
+		perror(dst);
+out:
+	free(src);
+	free(dst);
+	return rc;
+}
+
+/*
+ * Merges everything taken in into a new archive and puts it, with its
+ * index, rollups and similarity index, in place of the archive.
+ */
+/*
+ * Writes the compacted archive and puts it in place of the old one. The
+ * checkpoint 'ckpt', if any, describes the old archive: it's removed
+ * before the archive is replaced and saved with the new length after
+ * that, so a crash in between leaves no checkpoint, which takes the
+ * archive as committed as it is, rather than one that doesn't match it.
+ */
+static int axn500_compact_finish(struct axn500_compact *c,
+				 struct axn500_checkpoint *ckpt)
+{
+	struct stat st;
+	struct axn500_compact_out out;
+	struct axn500_index_entry *entries;
+	struct axn500_sim sim;
+	char *index = NULL;
+	FILE *run;
+	int fanin, i, rc = 1;
+
+	if (axn500_compact_spill(c))
+		return 1;
+	/* the readers get the memory of the run buffer */
+	free(c->buf.data);
+	free(c->items);
+	memset(&c->buf, 0, sizeof(c->buf));
+	c->items = NULL;
+	c->alloc_items = 0;
+
+	fanin = c->budget / AXN500_COMPACT_READ;
+	if (fanin < 2)
+		fanin = 2;
+	while (c->num_runs > fanin) {
+		dprintf("Merging %i of %i runs\n", fanin, c->num_runs);
+		run = axn500_compact_run(c);
+		if (run == NULL)
+			return 1;
+		rc = axn500_compact_merge(c, c->runs, fanin,
+					  axn500_compact_emit_run, run);
+		if (axn500_compact_close(run, c->runs[c->num_runs - 1]) || rc)
+			return 1;
+		for (i = 0; i < fanin; i++) {
+			unlink(c->runs[i]);
+			free(c->runs[i]);
+		}
+		c->num_runs -= fanin;
+		memmove(c->runs, c->runs + fanin, sizeof(*c->runs) * c->num_runs);
+		c->merges++;
+	}
+
+	memset(&out, 0, sizeof(out));
+	out.limit = c->budget / 8;
+	out.name = malloc(strlen(c->archive) + 9);
+	if (out.name == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	sprintf(out.name, "%s.compact", c->archive);
+	/* an empty similarity index, so it isn't built from the whole archive */
+	axn500_compact_unlink(axn500_rollup_name, out.name);
+	memset(&sim, 0, sizeof(sim));
+	if (axn500_sim_write(out.name, &sim))
+		goto out;
+	out.file = fopen(out.name, "w");
+	if (out.file == NULL) {
+		perror(out.name);
+		goto out;
+	}
+	dprintf("Merging %i runs into %s\n", c->num_runs, c->archive);
+	rc = axn500_compact_merge(c, c->runs, c->num_runs,
+				  axn500_compact_emit_archive, &out) ||
+	     axn500_compact_flush(&out);
+	if (fflush(out.file) || fsync(fileno(out.file))) {
+		perror(out.name);
+		rc = 1;
+	}
+	if (axn500_compact_close(out.file, out.name) || rc)
+		goto out;
+	c->merges++;
+	c->kept = out.records;
+
+	/* the index is rebuilt from scratch */
+	rc = 1;
+	index = axn500_index_name(c->archive);
+	if (index == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		goto out;
+	}
+	if (unlink(index) && errno != ENOENT) {
+		perror(index);
+		goto out;
+	}
+	if (ckpt && unlink(ckpt->name) && errno != ENOENT) {
+		perror(ckpt->name);
+		goto out;
+	}
+	if (axn500_compact_rename(axn500_rollup_name, out.name, c->archive) ||
+	    axn500_compact_rename(axn500_sim_name, out.name, c->archive))
+		goto out;
+	if (rename(out.name, c->archive)) {
+		perror(c->archive);
+		goto out;
+	}
+	if (ckpt) {
+		if (stat(c->archive, &st)) {
+			perror(c->archive);
+			goto out;
+		}
+		ckpt->length = st.st_size;
+		if (axn500_checkpoint_save(ckpt))
+			goto out;
+	}
+	if (axn500_index_sync(c->archive, &entries, &i))
+		goto out;
+	free(entries);
+	rc = 0;
+out:
+	if (rc) {
+		axn500_compact_unlink(axn500_rollup_name, out.name);
+		axn500_compact_unlink(axn500_sim_name, out.name);
+		unlink(out.name);
+	}
+	free(index);
+	free(out.batch.data);
+	free(out.name);
+	return rc;
+}
+
+static void axn500_get_trace_event(const unsigned char *p,
+				   struct axn500_trace_event *ev)
+{
+	ev->time = axn500_get64(p);
+	ev->thread = axn500_get32(p + 8);
+	ev->type = axn500_get16(p + 12);
+	ev->a = axn500_get32(p + 16);
+	ev->b = axn500_get32(p + 20);
+}
+
+#ifdef AXN500_TRACE
+static void axn500_put_trace_event(unsigned char *p,
+				   struct axn500_trace_event *ev)
+{
+	axn500_put64(p, ev->time);
+	axn500_put32(p + 8, ev->thread);
+	axn500_put16(p + 12, ev->type);
+	axn500_put16(p + 14, 0);
+	axn500_put32(p + 16, ev->a);
+	axn500_put32(p + 20, ev->b);
+}
+
+/* should only be called once the other threads are done */
+static int axn500_trace_write(const char *filename)
+{
+	struct axn500_trace_ring *ring;
+	unsigned char raw[AXN500_TRACE_EVENT_SIZE];
+	unsigned long i;
+	FILE *file;
+
+	file = fopen(filename, "w");
+	if (file == NULL) {
+		perror("Unable to create trace file");
+		return 1;
+	}
+	fwrite(AXN500_TRACE_MAGIC, 4, 1, file);
+	for (ring = axn500_trace_rings; ring; ring = ring->next) {
+		i = 0;
+		if (ring->head > AXN500_TRACE_RING_SIZE)
+			i = ring->head - AXN500_TRACE_RING_SIZE;
+		for (; i < ring->head; i++) {
+			axn500_put_trace_event(raw,
+				&ring->events[i & (AXN500_TRACE_RING_SIZE - 1)]);
+			fwrite(raw, sizeof(raw), 1, file);
+		}
+	}
+	if (fclose(file)) {
+		perror("Error writing trace file");
+		return 1;
+	}
+	return 0;
+}
+#endif
+
+static int axn500_trace_cmp(const void *a, const void *b)
+{
+	const struct axn500_trace_event *x = a, *y = b;
+
+	if (x->time != y->time)
+		return (x->time < y->time)? -1:1;
+	return 0;
+}
+
+static int axn500_trace_print(const char *filename, FILE *output)
+{
+	static const char *types[AXN500_TRACE_TYPES] = {
+		[AXN500_TRACE_CMD] = "cmd",
+		[AXN500_TRACE_REPLY] = "reply",
+		[AXN500_TRACE_PACKET] = "packet",
+		[AXN500_TRACE_PARSE] = "parse",
+		[AXN500_TRACE_ERROR] = "error",
+	};
+	static const char *stages[] = {
+		[AXN500_TRACE_PARSE_SCAN] = "scan",
+		[AXN500_TRACE_PARSE_DECODE] = "decode",
+		[AXN500_TRACE_PARSE_DONE] = "done",
+	};
+	struct axn500_trace_event *events, *ev;
+	unsigned char *data;
+	int size, i, n;
+
+	data = axn500_read_file(filename, &size);
+	if (data == NULL)
+		return 1;
+	if (size < 4 || memcmp(data, AXN500_TRACE_MAGIC, 4)) {
+		fprintf(stderr, "%s is not a trace file\n", filename);
+		free(data);
+		return 1;
+	}
+	n = (size - 4) / AXN500_TRACE_EVENT_SIZE;
+	events = malloc(sizeof(*events) * (n + 1));
+	if (events == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		free(data);
+		return 1;
+	}
+	for (i = 0; i < n; i++)
+		axn500_get_trace_event(data + 4 + i * AXN500_TRACE_EVENT_SIZE,
+				       &events[i]);
+	free(data);
+	qsort(events, n, sizeof(*events), axn500_trace_cmp);
+
+	for (i = 0; i < n; i++) {
+		ev = &events[i];
+		fprintf(output, "%12.6f [%u] %-6s ",
+			(ev->time - events[0].time) / 1e9, ev->thread,
+			(ev->type < AXN500_TRACE_TYPES && types[ev->type])?
+				types[ev->type]:"?");
+		switch (ev->type) {
+		case AXN500_TRACE_CMD:
+		case AXN500_TRACE_REPLY:
+			fprintf(output, "%#04x, %u bytes\n", ev->a, ev->b);
+			break;
+		case AXN500_TRACE_PACKET:
+			fprintf(output, "#%u, %u bytes\n", ev->a, ev->b);
+			break;
+		case AXN500_TRACE_PARSE:
+			fprintf(output, "%s %u\n",
+				(ev->a <= AXN500_TRACE_PARSE_DONE)? stages[ev->a]:"?",
+				ev->b);
+			break;
+		case AXN500_TRACE_ERROR:
+			fprintf(output, "at %u: %s\n", ev->a, strerror(ev->b));
+			break;
+		default:
+			fprintf(output, "%u %u\n", ev->a, ev->b);
+		}
+	}
+	free(events);
+	return 0;
+}
+
+/*
+ *
+ * Every 163 bytes packet begins with a 3 byte header:
+ * 0b 00 53
+ *       ^^ packet number
+ * The packet number decrements until 01, when the command to send more data
+ * (0x16, 0x2f) should not be used anymore
+ * The data comes in an inverted fashion: first the last exercise header then
+ * the last entry of the last exercise, then the last but one exercise header
+ * and the last entry of the last but one exercise and so on.
+ */
+/*
+ * Link parameters
+ *
+ * Replies are read into a buffer sized after the negotiated maximum SDU
+ * size. A reply that doesn't fit makes the buffer grow instead of being
+ * cut, and replies split over several reads are put back together.
+ */
+#define AXN500_RX_SIZE		256
+#define AXN500_REPLY_TIMEOUT	2000	/* ms */
+
+struct axn500_link {
+	int max_sdu;
+	char *rx;
+	int rx_size;
+	unsigned long bytes;		/* received */
+	struct timespec start;
+};
+
+static struct axn500_link axn500_link;
+
+static double axn500_elapsed(struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) +
+		(now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static int axn500_rx_reserve(int size)
+{
+	char *tmp;
+
+	if (size <= axn500_link.rx_size)
+		return 0;
+	tmp = realloc(axn500_link.rx, size);
+	if (tmp == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		return 1;
+	}
+	axn500_link.rx = tmp;
+	axn500_link.rx_size = size;
+	return 0;
+}
+
+static void axn500_link_setup(int fd)
+{
+	socklen_t len;
+	int value;
+
+	len = sizeof(value);
+	if (getsockopt(fd, SOL_IRTTP, IRTTP_MAX_SDU_SIZE, &value, &len) == 0) {
+		axn500_link.max_sdu = value;
+		dprintf("Maximum SDU size: %i\n", value);
+	} else
+		dprintf("Unable to get the maximum SDU size: %s\n",
+			strerror(errno));
+	len = sizeof(value);
+	if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &value, &len) == 0)
+		dprintf("Socket receive buffer: %i\n", value);
+
+	axn500_rx_reserve(axn500_link.max_sdu > AXN500_RX_SIZE?
+			  axn500_link.max_sdu:AXN500_RX_SIZE);
+	axn500_link.bytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &axn500_link.start);
+}
+
+/*
+ * Reads a reply into axn500_link.rx and returns its size. If 'expected' is
+ * given, waits up to 'timeout' ms for the rest of a reply that comes in
+ * pieces, otherwise only takes what is already there.
+ */
+static int axn500_read_reply(int fd, int expected, int timeout)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	int rc, len = 0;
+
+	if (axn500_rx_reserve(expected > AXN500_RX_SIZE? expected:AXN500_RX_SIZE))
+		return -1;
+	while (1) {
+		if (len == axn500_link.rx_size && axn500_rx_reserve(len * 2))
+			return -1;
+		rc = read(fd, axn500_link.rx + len, axn500_link.rx_size - len);
+		if (rc < 0)
+			return -1;
+		if (rc == 0)
+			break;
+		len += rc;
+		axn500_link.bytes += rc;
+		if (expected && len >= expected) {
+			if (len > expected)
+				dprintf("Reply bigger than expected: %i of "
+					"%i\n", len, expected);
+			break;
+		}
+		if (poll(&pfd, 1, (expected && len < expected)? timeout:0) <= 0)
+			break;
+	}
+	return len;
+}
+
+/*
+ * Broker protocol
+ *
+ * With a broker (-b) the commands go over a Unix socket to the broker
+ * daemon, which owns the watch connection, instead of to the watch. A
+ * request is two bytes:
+ *	type (u8): AXN500_BROKER_GET or AXN500_BROKER_EXERCISES
+ *	command (u8): the AXN500_CMD_* to send, for AXN500_BROKER_GET
+ * and the reply is:
+ *	status (u8): 0 if the watch answered, data length (u32), data
+ * The data is the watch reply for AXN500_BROKER_GET, and the number of
+ * exercises (u8) followed by the exercise data for AXN500_BROKER_EXERCISES.
+ */
+#define AXN500_BROKER_GET	1
+#define AXN500_BROKER_EXERCISES	2
+#define AXN500_BROKER_REQ_SIZE	2
+#define AXN500_BROKER_HDR_SIZE	5
+
+static const char *axn500_broker;
+
+static int axn500_read_full(int fd, void *buff, int len)
+{
+	int rc;
+
+	while (len > 0) {
+		rc = read(fd, buff, len);
+		if (rc <= 0)
+			return 1;
+		buff = (char *)buff + rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+static int axn500_broker_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("Unable to create socket");
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("Unable to connect to the broker");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* returns the data of the reply, NULL on errors */
+static char *axn500_broker_call(int fd, int type, int cmd, int *len)
+{
+	unsigned char req[AXN500_BROKER_REQ_SIZE] = { type, cmd };
+	unsigned char hdr[AXN500_BROKER_HDR_SIZE];
+	char *data;
+
+	if (write(fd, req, sizeof(req)) != sizeof(req) ||
+	    axn500_read_full(fd, hdr, sizeof(hdr))) {
+		fprintf(stderr, "Lost the connection to the broker\n");
+		return NULL;
+	}
+	if (hdr[0]) {
+		fprintf(stderr, "The broker couldn't get an answer from the "
+			"watch\n");
+		return NULL;
+	}
+	*len = axn500_get32(hdr + 1);
+	data = malloc(*len + 1);
+	if (data == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		return NULL;
+	}
+	if (axn500_read_full(fd, data, *len)) {
+		fprintf(stderr, "Lost the connection to the broker\n");
+		free(data);
+		return NULL;
+	}
+	return data;
+}
+
+static char *axn500_broker_exercises(int fd, unsigned char *num_ex, int *bytes)
+{
+	char *data;
+	int len;
+
+	data = axn500_broker_call(fd, AXN500_BROKER_EXERCISES, 0, &len);
+	if (data == NULL)
+		return NULL;
+	if (len < 1) {
+		fprintf(stderr, "Invalid exercise data from the broker\n");
+		free(data);
+		return NULL;
+	}
+	*num_ex = data[0];
+	*bytes = len - 1;
+	memmove(data, data + 1, len - 1);
+	return data;
+}
+
+#define AXN500_EX_PKT_SIZE 163
+#define AXN500_EX_PKT_HDR_SIZE 3
+#define AXN500_EX_PKT_HDR_NUM 2
+#define AXN500_EX_PKT_PAYLOAD_SIZE (AXN500_EX_PKT_SIZE - AXN500_EX_PKT_HDR_SIZE)
+
+/*
+ * Reads a packet placing the header in 'hdr' and the payload directly where
+ * it belongs in the exercise buffer. Returns the packet size.
+ */
+static int axn500_read_packet(int fd, char *hdr, char *payload, int timeout)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	struct iovec iov[2], *cur = iov;
+	int rc, len = 0, cnt = 2;
+
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = AXN500_EX_PKT_HDR_SIZE;
+	iov[1].iov_base = payload;
+	iov[1].iov_len = AXN500_EX_PKT_PAYLOAD_SIZE;
+	while (len < AXN500_EX_PKT_SIZE) {
+		rc = readv(fd, cur, cnt);
+		if (rc < 0)
+			return -1;
+		if (rc == 0)
+			break;
+		len += rc;
+		axn500_link.bytes += rc;
+		/* skip what's been filled already */
+		while (cnt && rc >= cur->iov_len) {
+			rc -= cur->iov_len;
+			cur++;
+			cnt--;
+		}
+		if (cnt) {
+			cur->iov_base = (char *)cur->iov_base + rc;
+			cur->iov_len -= rc;
+		}
+		if (len < AXN500_EX_PKT_SIZE && poll(&pfd, 1, timeout) <= 0)
+			break;
+	}
+	return len;
+}
+static char *axn500_transfer_exercises(int fd, unsigned char *num_ex,
+				       int *bytes, struct axn500 *info)
+{
+	char *buff, *all, hdr[AXN500_EX_PKT_HDR_SIZE];
+	int i, rc;
+	double elapsed;
+	unsigned char packet_count;
+	const char get_exercise_cmd[] = { 0x0b };
+	const char get_next_cmd[] = { 0x16, 0x2f };
+	const char get_exercisenum_cmd[] = { 0x15 };
+
+	if (axn500_broker)
+		return axn500_broker_exercises(fd, num_ex, bytes);
+
+	axn500_trace(AXN500_TRACE_CMD, get_exercisenum_cmd[0], 1);
+	rc = write(fd, get_exercisenum_cmd, 1);
+	if (rc < 0) {
+		axn500_trace(AXN500_TRACE_ERROR, __LINE__, errno);
+		perror("Error writing get exercise count");
+		return NULL;
+	}
+	rc = axn500_read_reply(fd, 7, AXN500_REPLY_TIMEOUT);
+	buff = axn500_link.rx;
+	if (rc < 0) {
+		axn500_trace(AXN500_TRACE_ERROR, __LINE__, errno);
+		perror("Error getting exercise number");
+		return NULL;
+	}
+	axn500_trace(AXN500_TRACE_REPLY, get_exercisenum_cmd[0], rc);
+	if (rc != 7) {
+		fprintf(stderr, "Unexpected reply size while getting number "
+			"of exercises (expected 7, got %i)\n", rc);
+		return NULL;
+	}
+	*num_ex = buff[3];
+
+	if (*num_ex == 0) {
+		printf("No exercises found on the watch\n");
+		return NULL;
+	}
+
+	axn500_link.bytes = 0;
+	clock_gettime(CLOCK_MONOTONIC, &axn500_link.start);
+	axn500_trace(AXN500_TRACE_CMD, get_exercise_cmd[0], 1);
+	rc = write(fd, get_exercise_cmd, 1);
+	if (rc < 0) {
+		axn500_trace(AXN500_TRACE_ERROR, __LINE__, errno);
+		perror("Error writing get exercises data");
+		return NULL;
+	}
+	/*
+	 * we get the first package to have an idea of how much we'll need for
+	 * the full thing
+	 */
+	rc = axn500_read_reply(fd, AXN500_EX_PKT_SIZE, AXN500_REPLY_TIMEOUT);
+	buff = axn500_link.rx;
+	if (rc < 0) {
+		axn500_trace(AXN500_TRACE_ERROR, __LINE__, errno);
+		perror("Error getting exercise data");
+		return NULL;
+	}
+	axn500_trace(AXN500_TRACE_PACKET, (unsigned char)buff[AXN500_EX_PKT_HDR_NUM], rc);
+	if (rc < 11) {
+		fprintf(stderr, "Not enough data, got only %i bytes\n", rc);
+		return NULL;
+	}
+
+	packet_count = buff[2];
+	dprintf("Got %i bytes on the first request for info, total packets: "
+		"%i\n", rc, packet_count);
+
+	printf(".");
+	fflush(stdout);
+
+	all = malloc(AXN500_EX_PKT_SIZE * packet_count);
+	if (all == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		return NULL;
+	}
+	axn500_profile_alloc(AXN500_ALLOC_TRANSFER,
+			     AXN500_EX_PKT_SIZE * packet_count);
+
+	if (rc > AXN500_EX_PKT_SIZE)
+		rc = AXN500_EX_PKT_SIZE;
+	memcpy(all, buff, rc);
+	*bytes = rc;
+
+	for (i = 1; i < packet_count; i++) {
+		unsigned char c;
+
+		axn500_trace(AXN500_TRACE_CMD, get_next_cmd[0], 2);
+		rc = write(fd, get_next_cmd, 2);
+		if (rc < 0) {
+			axn500_trace(AXN500_TRACE_ERROR, __LINE__, errno);
+			perror("Error asking for more data");
+			free(all);
+			return NULL;
+		}
+		/* the last packet is usually shorter */
+		rc = axn500_read_packet(fd, hdr, all + *bytes,
+			((i + 1) == packet_count)? AXN500_REPLY_TIMEOUT / 40:
+						   AXN500_REPLY_TIMEOUT);
+		if (rc < 0) {
+			axn500_trace(AXN500_TRACE_ERROR, __LINE__, errno);
+			perror("Error getting more data");
+			free(all);
+			return NULL;
+		}
+		axn500_trace(AXN500_TRACE_PACKET, (unsigned char)hdr[AXN500_EX_PKT_HDR_NUM], rc);
+		printf(".");
+		fflush(stdout);
+		if (rc < AXN500_EX_PKT_HDR_SIZE) {
+			fprintf(stderr, "Packet %i of %i too short: %i bytes\n",
+				i + 1, packet_count, rc);
+			free(all);
+			return NULL;
+		}
+		if (rc < AXN500_EX_PKT_SIZE && (i + 1) == packet_count)
+			fprintf(stderr, "Got less data than expected: %i of "
+				"%i, packet %i of %i\n", rc,
+				AXN500_EX_PKT_SIZE,
+				i + 1, packet_count);
+		c = hdr[AXN500_EX_PKT_HDR_NUM];
+		if (c != (packet_count - i))
+			fprintf(stderr, "Unexpected packet number: %i, "
+				"expected %i\n", hdr[AXN500_EX_PKT_HDR_NUM],
+				(packet_count - i));
+		/* the payload is already in place, header skipped */
+		*bytes += rc - AXN500_EX_PKT_HDR_SIZE;
+	}
+	printf("\n");
+	dprintf("Receive complete, got %i packets\n", packet_count);
+	elapsed = axn500_elapsed(&axn500_link.start);
+	printf("Transferred %lu bytes in %.2fs (%.0f bytes/s, max SDU %i)\n",
+	       axn500_link.bytes, elapsed,
+	       elapsed > 0? axn500_link.bytes / elapsed:0, axn500_link.max_sdu);
+
+	return all;
+}
+
+static char *axn500_get_exercise(int fd, unsigned char *num_ex, int *bytes, struct axn500 *info)
+{
+	struct axn500_span span;
+	char *data;
+
+	axn500_profile_begin(&span);
+	data = axn500_transfer_exercises(fd, num_ex, bytes, info);
+	axn500_profile_end(&span, AXN500_PHASE_TRANSFER);
+	return data;
+}
+
+static int axn500_send_cmd(int fd, int cmd)
+{
+	int rc;
+
+	dprintf("size: %i, [%#x][%#x]\n", axn500_commands[cmd].cmdsize, axn500_commands[cmd].cmd[0],
+		axn500_commands[cmd].cmd[1]);
+	axn500_trace(AXN500_TRACE_CMD, axn500_cmd_code(cmd),
+		     axn500_commands[cmd].cmdsize);
+	rc = write(fd, axn500_commands[cmd].cmd, axn500_commands[cmd].cmdsize);
+	if (rc < 0) {
+		axn500_trace(AXN500_TRACE_ERROR, __LINE__, errno);
+		perror("Error writing command");
+		return 1;
+	}
+	if (rc != axn500_commands[cmd].cmdsize) {
+		fprintf(stderr, "Short write on command %i\n", cmd);
+		return 1;
+	}
+	dprintf("Wrote cmd %i, waiting for answer...\n", cmd);
+	return 0;
+}
+
+static void axn500_dump_hex(char *buff, int len)
+{
+	char hex[16 * 3 + 1];
+	int i, j;
+
+	for (i = 0; i < len; i += 16) {
+		for (j = 0; j < 16 && i + j < len; j++)
+			sprintf(hex + j * 3, "%02x ", (unsigned char)buff[i + j]);
+		hex[j * 3] = 0;
+		dprintf("%s\n", hex);
+	}
+}
+
+static int axn500_handle_reply(int cmd, struct axn500 *info, char *buff, int rc)
+{
+	axn500_trace(AXN500_TRACE_REPLY, axn500_cmd_code(cmd), rc);
+	if (axn500_commands[cmd].datasize &&
+	    rc != axn500_commands[cmd].datasize) {
+		fprintf(stderr, "Incorrect answer size: %i (expected %i) for cmd %i\n",
+			rc, axn500_commands[cmd].datasize, cmd);
+		return 1;
+	}
+
+	dprintf("got %i bytes\n", rc);
+	if (axn500_debug)
+		axn500_dump_hex(buff, rc);
+
+	if (axn500_commands[cmd].parser(cmd, info, buff)) {
+		fprintf(stderr, "Error parsing reply to command %i\n", cmd);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int axn500_request_data(int fd, int cmd, struct axn500 *info)
+{
+	char *data;
+	int rc;
+
+	if (axn500_broker) {
+		data = axn500_broker_call(fd, AXN500_BROKER_GET, cmd, &rc);
+		if (data == NULL)
+			return 1;
+		rc = axn500_handle_reply(cmd, info, data, rc);
+		free(data);
+		return rc;
+	}
+
+	if (axn500_send_cmd(fd, cmd))
+		return 1;
+
+	rc = axn500_read_reply(fd, axn500_commands[cmd].datasize,
+			       AXN500_REPLY_TIMEOUT);
+	if (rc < 0) {
+		axn500_trace(AXN500_TRACE_ERROR, __LINE__, errno);
+		perror("Error reading answer");
+		return 1;
+	}
+
+	return axn500_handle_reply(cmd, info, axn500_link.rx, rc);
+}
+
+static int axn500_get_data(int fd, int cmd, struct axn500 *info)
+{
+	struct axn500_span span;
+	int rc;
+
+	axn500_profile_begin(&span);
+	rc = axn500_request_data(fd, cmd, info);
+	axn500_profile_end_cmd(&span, cmd);
+	return rc;
+}
+
+/*
+ * Pipelined fetch
+ *
+ * Up to 'depth' commands are sent without waiting for the replies. Since
+ * the link is a byte stream, the replies are split using the expected reply
+ * size of the oldest outstanding command and checked against its command
+ * code (the watch replies either with the same code or with the code minus
+ * one). Anything unexpected, including a watch that takes too long, makes
+ * us drain the link and do the rest one command at a time.
+ */
+#define AXN500_PIPELINE_TIMEOUT	2000	/* ms */
+
+static int axn500_pipeline;
+
+static int axn500_reply_matches(int cmd, char *reply)
+{
+	unsigned char code = axn500_commands[cmd].cmd[0];
+
+	return (unsigned char)reply[0] == code ||
+	       (unsigned char)reply[0] == code - 1;
+}
+
+static void axn500_drain(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	char buff[256];
+
+	while (poll(&pfd, 1, AXN500_PIPELINE_TIMEOUT / 4) > 0)
+		if (read(fd, buff, sizeof(buff)) <= 0)
+			break;
+}
+
+static int axn500_get_data_pipelined(int fd, int *cmds, int num, int depth,
+				     struct axn500 *info)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	char buff[512];
+	int sent = 0, done = 0, len = 0, rc, size;
+
+	while (done < num) {
+		while (sent < num && sent - done < depth) {
+			if (axn500_send_cmd(fd, cmds[sent]))
+				return 1;
+			sent++;
+		}
+
+		size = axn500_commands[cmds[done]].datasize;
+		if (len < size) {
+			rc = poll(&pfd, 1, AXN500_PIPELINE_TIMEOUT);
+			if (rc <= 0) {
+				fprintf(stderr, "Timeout waiting for reply to "
+					"cmd %i\n", cmds[done]);
+				goto lockstep;
+			}
+			rc = read(fd, buff + len, sizeof(buff) - len);
+			if (rc <= 0) {
+				axn500_trace(AXN500_TRACE_ERROR, __LINE__, errno);
+				perror("Error reading answer");
+				return 1;
+			}
+			len += rc;
+			continue;
+		}
+
+		if (!axn500_reply_matches(cmds[done], buff)) {
+			fprintf(stderr, "Unexpected reply %#x to cmd %i\n",
+				(unsigned char)buff[0], cmds[done]);
+			goto lockstep;
+		}
+		if (axn500_handle_reply(cmds[done], info, buff, size))
+			return 1;
+		len -= size;
+		memmove(buff, buff + size, len);
+		done++;
+	}
+	if (len)
+		dprintf("%i extra bytes after the replies\n", len);
+	return 0;
+
+lockstep:
+	dprintf("Falling back to one command at a time from cmd %i\n",
+		cmds[done]);
+	axn500_drain(fd);
+	for (; done < num; done++)
+		if (axn500_get_data(fd, cmds[done], info))
+			return 1;
+	return 0;
+}
+
+#ifdef AXN500_SET_TIME
+static int axn500_set_data(int fd, int cmd, struct axn500 *info)
+{
+	int rc, size, cmdsize;
+	char raw[100];
+
+	if (axn500_commands[cmd].get_raw == NULL) {
+		fprintf(stderr, "BUG: Command %i doesn't have a get_raw method\n", cmd);
+		return 1;
+	}
+
+	cmdsize = axn500_commands[cmd].cmdsize;
+
+	size = axn500_commands[cmd].get_raw(cmd, info, raw + cmdsize, sizeof(raw) - cmdsize);
+	if (size < 0) {
+		dprintf("Error getting the raw data for command %i\n", cmd);
+		return 1;
+	}
+
+	memcpy(raw, axn500_commands[cmd].cmd, cmdsize);
+
+	axn500_trace(AXN500_TRACE_CMD, axn500_cmd_code(cmd), cmdsize + size);
+	rc = write(fd, raw, cmdsize + size);
+	if (rc < 0) {
+		axn500_trace(AXN500_TRACE_ERROR, __LINE__, errno);
+		perror("Error while writting command");
+		return 1;
+	}
+
+	/* now wait for the answer */	
+	rc = axn500_read_reply(fd, cmdsize + 1, AXN500_REPLY_TIMEOUT);
+	if (rc < 0) {
+		axn500_trace(AXN500_TRACE_ERROR, __LINE__, errno);
+		perror("Error reading answer");
+		return 1;
+	}
+	axn500_trace(AXN500_TRACE_REPLY, axn500_cmd_code(cmd), rc);
+
+	if (rc != (cmdsize + 1)) {
+		fprintf(stderr, "Unexpected answer size: %i, %i expected\n",
+			rc, cmdsize + 1);
+		return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Clock synchronization
+ *
+ * The 0x29 block only has the hours and minutes of the clock, so the watch
+ * is read until its minute changes to find where its second 0 is. Each
+ * reply shows the clock as it was about one way delay (half the shortest
+ * round trip) after asking, so the tick is between those moments for the
+ * last reply with the old minute and the first one with the new minute.
+ *
+ * The new time is written as the host clock starts a minute, ahead by the
+ * one way delay, assuming the watch starts that minute when it gets the
+ * block. The next tick shows how far off it is.
+ */
+#define AXN500_SYNC_PROBES	8
+#define AXN500_SYNC_MARGIN	300000000LL	/* ns of polling before a tick */
+#define AXN500_SYNC_LEAD	2000000000LL	/* ns to prepare the write */
+#define AXN500_SYNC_TIMEOUT	65		/* s to wait for a tick */
+
+struct axn500_clock_sync {
+	long long rtt_min;		/* ns */
+	long long rtt_avg;
+	long long delay;		/* one way */
+	long long before;		/* watch - host, s, to a minute */
+	time_t set;			/* what the watch was set to */
+	long long residual;		/* watch - host after setting, ns */
+	long long precision;		/* +- ns */
+};
+
+static long long axn500_clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* the watch clock, without seconds, in local time */
+static time_t axn500_watch_time(struct axn500 *info)
+{
+	struct axn500_time *t = &info->timezone[info->enabled_timezone];
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = info->date.year + 100;
+	tm.tm_mon = info->date.month - 1;
+	tm.tm_mday = info->date.day;
+	tm.tm_hour = t->hour;
+	tm.tm_min = t->minute;
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+/* reads the clock, 'sent' is when it was asked for (CLOCK_MONOTONIC) */
+static int axn500_read_clock(int fd, struct axn500 *info, long long *sent,
+			     long long *rtt, time_t *now)
+{
+	*sent = axn500_clock_ns(CLOCK_MONOTONIC);
+	if (axn500_get_data(fd, AXN500_CMD_GET_TIME, info))
+		return 1;
+	*rtt = axn500_clock_ns(CLOCK_MONOTONIC) - *sent;
+	*now = axn500_watch_time(info);
+	return 0;
+}
+
+/*
+ * Reads the clock from 'from' (CLOCK_MONOTONIC) until its minute changes,
+ * returns when that happened in CLOCK_MONOTONIC and the new minute
+ */
+static int axn500_find_tick(int fd, struct axn500 *info, long long from,
+			    long long delay, long long *tick,
+			    long long *precision, time_t *minute)
+{
+	struct timespec ts = { from / 1000000000LL, from % 1000000000LL };
+	long long sent, last_sent, rtt, end;
+	time_t now, last;
+
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	end = axn500_clock_ns(CLOCK_MONOTONIC) + AXN500_SYNC_TIMEOUT * 1000000000LL;
+	if (axn500_read_clock(fd, info, &last_sent, &rtt, &last))
+		return 1;
+	while (1) {
+		if (axn500_read_clock(fd, info, &sent, &rtt, &now))
+			return 1;
+		if (now != last)
+			break;
+		last_sent = sent;
+		if (sent > end) {
+			fprintf(stderr, "The watch clock didn't change in %i "
+				"seconds\n", AXN500_SYNC_TIMEOUT);
+			return 1;
+		}
+	}
+	*tick = (last_sent + sent) / 2 + delay;
+	*precision = (sent - last_sent) / 2;
+	*minute = now;
+	return 0;
+}
+
+/* moves the selected clock to 't', the other one isn't written */
+static void axn500_set_clock(struct axn500 *info, time_t t)
+{
+	struct axn500_time *clock = &info->timezone[info->enabled_timezone];
+	struct tm tm;
+
+	localtime_r(&t, &tm);
+	clock->hour = tm.tm_hour;
+	clock->minute = tm.tm_min;
+	info->date.day = tm.tm_mday;
+	info->date.month = tm.tm_mon + 1;
+	info->date.year = tm.tm_year % 100;
+}
+
+static int axn500_sync_clock(int fd, struct axn500 *info,
+			     struct axn500_clock_sync *sync)
+{
+	long long sent, rtt, total = 0, offset, boundary, tick;
+	struct timespec ts;
+	time_t now, minute;
+	int i;
+
+	/* the host clock is read once, everything else is CLOCK_MONOTONIC */
+	offset = axn500_clock_ns(CLOCK_REALTIME) - axn500_clock_ns(CLOCK_MONOTONIC);
+
+	memset(sync, 0, sizeof(*sync));
+	sync->rtt_min = LLONG_MAX;
+	for (i = 0; i < AXN500_SYNC_PROBES; i++) {
+		if (axn500_read_clock(fd, info, &sent, &rtt, &now))
+			return 1;
+		dprintf("Round trip %lli us, watch at %li\n", rtt / 1000,
+			(long)now);
+		total += rtt;
+		if (rtt < sync->rtt_min)
+			sync->rtt_min = rtt;
+	}
+	sync->rtt_avg = total / AXN500_SYNC_PROBES;
+	sync->delay = sync->rtt_min / 2;
+	/* the watch has no seconds, this is only good to a minute */
+	sync->before = now - (sent + sync->delay + offset) / 60000000000LL * 60;
+
+	boundary = (axn500_clock_ns(CLOCK_MONOTONIC) + offset + AXN500_SYNC_LEAD) /
+		   60000000000LL * 60000000000LL + 60000000000LL;
+	sync->set = boundary / 1000000000LL;
+	axn500_set_clock(info, sync->set);
+
+	boundary -= offset;
+	ts.tv_sec = (boundary - sync->delay) / 1000000000LL;
+	ts.tv_nsec = (boundary - sync->delay) % 1000000000LL;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+	if (axn500_set_data(fd, AXN500_CMD_SET_TIME, info))
+		return 1;
+
+	if (axn500_find_tick(fd, info, boundary + 60000000000LL - AXN500_SYNC_MARGIN,
+			     sync->delay, &tick, &sync->precision, &minute))
+		return 1;
+	/* the watch says 'minute' started at 'tick' */
+	sync->residual = (minute - sync->set) * 1000000000LL - (tick - boundary);
+	return 0;
+}
+#endif
+
+void axn500_print_alarm(struct axn500 *info, int i)
+{
+	printf("%s\t%02i:%02i (%s)", info->alarms[i].desc,
+		info->alarms[i].time.hour,
+		info->alarms[i].time.minute,
+		info->alarms[i].enabled? "enabled":"disabled");
+}
+
+void axn500_print_reminder(struct axn500 *info, int i)
+{
+	printf("%s\t%02i:%02i %02i/%02i/%02i (%s)",
+	       info->reminders[i].desc,
+	       info->reminders[i].time.hour,
+	       info->reminders[i].time.minute,
+	       info->reminders[i].date.day,
+	       info->reminders[i].date.month,
+	       info->reminders[i].date.year,
+	       info->reminders[i].enabled? "enabled":"disabled");
+}
+
+void axn500_print_timezone(struct axn500 *info, int i)
+{
+	printf("%02i:%02i (%s)",
+		info->timezone[i].hour,
+		info->timezone[i].minute,
+		(info->enabled_timezone == i)? "main":"");
+}
+
+void _axn500_print_date(struct axn500_date *date)
+{
+	printf("%02i/%02i/%02i", date->day, date->month, date->year);
+}
+
+void axn500_print_date(struct axn500 *info)
+{
+	_axn500_print_date(&info->date);
+}
+
+void axn500_print_birthday(struct axn500 *info)
+{
+	_axn500_print_date(&info->settings.bday);
+}
+
+void _axn500_print_limit(struct axn500_limit *limit)
+{
+	printf("%02i/%02i", limit->lower, limit->upper);
+}
+
+void axn500_print_activity_level(struct axn500 *info)
+{
+	switch (info->settings.activity) {
+	case AXN500_SETTINGS_ACTIVITY_LOW:
+		printf("low");
+		break;
+	case AXN500_SETTINGS_ACTIVITY_MEDIUM:
+		printf("medium");
+		break;
+	case AXN500_SETTINGS_ACTIVITY_HIGH:
+		printf("high");
+		break;
+	case AXN500_SETTINGS_ACTIVITY_TOP:
+		printf("top");
+		break;
+	}
+}
+
+void axn500_print_activity_button_sound(struct axn500 *info)
+{
+	printf("%s", (info->settings.activity_button_sound)? "on":"off");
+}
+
+void axn500_print_intro_animations(struct axn500 *info)
+{
+	printf("%s", (info->settings.intro_animations)? "on":"off");
+}
+
+void axn500_print_countdown(struct axn500 *info)
+{
+	printf("%02i:%02i:%02i",
+		info->settings.countdown.hour,
+		info->settings.countdown.minute,
+		info->settings.countdown.second);
+}
+
+void axn500_print_sex(struct axn500 *info)
+{
+	printf("%s", (info->settings.sex == AXN500_SETTINGS_SEX_MALE)? "male":"female");
+}
+
+void axn500_print_htouch(struct axn500 *info)
+{
+	switch (info->settings.htouch) {
+	case AXN500_SETTINGS_HTOUCH_OFF:
+		printf("off");
+		break;
+	case AXN500_SETTINGS_HTOUCH_LIGHT:
+		printf("light");
+		break;
+	case AXN500_SETTINGS_HTOUCH_SWITCH_DISPLAY:
+		printf("switch display");
+		break;
+	case AXN500_SETTINGS_HTOUCH_TAKE_LAP:
+		printf("take lap");
+		break;
+	}
+}
+
+static void axn500_print_info(struct axn500 *info)
+{
+	int i;
+
+	printf("Date: (dd/mm/yy)\n\t");
+	axn500_print_date(info);
+	printf("\n");
+
+	printf("Clock:\n");
+	for (i = 0; i < 2; i++) {
+		printf("\tTime %i", i);
+		axn500_print_timezone(info, i);
+		printf("\n");
+	}
+	printf("Alarms:\n");
+	for (i = 0; i < 3; i++) {
+		printf("\t");
+		axn500_print_alarm(info, i);
+		printf("\n");
+	}
+
+	printf("Reminders:\n");
+	for (i = 0; i < 5; i++) {
+		printf("\t");
+		axn500_print_reminder(info, i);
+		printf("\n");
+	}
+
+	printf("Settings:\n");
+	printf("\tBirthday: ");
+	axn500_print_birthday(info);
+	printf("\n");
+	printf("\tHeight: %icm\n", info->settings.height);
+	printf("\tWeight: %ilb\n", info->settings.weight);
+	printf("\tRecord Rate: %is\n", info->settings.record_rate);
+	printf("\tActivity level: ");
+	axn500_print_activity_level(info);
+	printf("\n");
+	printf("\tHR max: %i\n", info->settings.hrmax);
+	printf("\tVOmax: %i\n", info->settings.vomax);
+	printf("\tSit HR: %i\n", info->settings.sit_hr);
+	printf("\tActivity button sound: ");
+	axn500_print_activity_button_sound(info);
+	printf("\n");
+	printf("\tIntro animations: ");
+	axn500_print_intro_animations(info);
+	printf("\n");
+	printf("\tUnits: %s\n", (info->settings.imperial)? "imperial":"metric");
+	printf("\tDeclination: %i\n", info->settings.declination);
+	printf("\tCountdown (hh:mm:ss): ");
+	axn500_print_countdown(info);
+	printf("\n");
+	printf("\tSex: ");
+	axn500_print_sex(info);
+	printf("\n");
+	printf("\tHeart touch: ");
+	axn500_print_htouch(info);
+	printf("\n");
+}
+
+int axn500_init(void)
+{
+	int fd;
+
+	if (axn500_broker)
+		return axn500_broker_connect(axn500_broker);
+
+	fd = socket(AF_IRDA, SOCK_STREAM, 0);
+	if (fd < 0)
+		perror("Unable to create socket");
+
+	return fd;
+}
+
+/*
+ * Device cache
+ *
+ * The addresses of the watches we connected to are kept, most recent
+ * first, in $HOME/.axn500_devices as "<address> <hints> <last seen>"
+ * lines. Connecting to a known address directly skips the discovery.
+ */
+#define AXN500_CACHE_FILE	".axn500_devices"
+#define AXN500_CACHE_SIZE	8
+
+struct axn500_cached_device {
+	unsigned int daddr;
+	unsigned int hints;
+	long seen;
+};
+
+static char *axn500_cache_name(void)
+{
+	const char *home = getenv("HOME");
+	char *name;
+
+	if (home == NULL)
+		return NULL;
+	name = malloc(strlen(home) + sizeof(AXN500_CACHE_FILE) + 1);
+	if (name)
+		sprintf(name, "%s/%s", home, AXN500_CACHE_FILE);
+	return name;
+}
+
+static int axn500_cache_load(struct axn500_cached_device *devices)
+{
+	struct axn500_cached_device *dev;
+	char *name = axn500_cache_name();
+	FILE *file;
+	int n = 0;
+
+	if (name == NULL)
+		return 0;
+	file = fopen(name, "r");
+	free(name);
+	if (file == NULL)
+		return 0;
+	while (n < AXN500_CACHE_SIZE) {
+		dev = &devices[n];
+		if (fscanf(file, "%x %x %ld", &dev->daddr, &dev->hints,
+			   &dev->seen) != 3)
+			break;
+		n++;
+	}
+	fclose(file);
+	return n;
+}
+
+static void axn500_cache_save(unsigned int daddr, unsigned int hints)
+{
+	struct axn500_cached_device devices[AXN500_CACHE_SIZE];
+	char *name, *tmp;
+	FILE *file;
+	int i, n;
+
+	n = axn500_cache_load(devices);
+	name = axn500_cache_name();
+	if (name == NULL)
+		return;
+	tmp = malloc(strlen(name) + 5);
+	if (tmp == NULL) {
+		free(name);
+		return;
+	}
+	sprintf(tmp, "%s.tmp", name);
+	file = fopen(tmp, "w");
+	if (file) {
+		fprintf(file, "%#x %#x %ld\n", daddr, hints, (long)time(NULL));
+		for (i = 0; i < n && i < AXN500_CACHE_SIZE - 1; i++)
+			if (devices[i].daddr != daddr)
+				fprintf(file, "%#x %#x %ld\n", devices[i].daddr,
+					devices[i].hints, devices[i].seen);
+		if (fclose(file) == 0)
+			rename(tmp, name);
+	}
+	free(tmp);
+	free(name);
+}
+
+/*
+ * A failed connect() leaves the socket unusable, so a new one takes the
+ * place of the old descriptor
+ */
+static int axn500_reset_socket(int fd)
+{
+	int new = socket(AF_IRDA, SOCK_STREAM, 0);
+
+	if (new < 0)
+		return 1;
+	if (dup2(new, fd) < 0) {
+		close(new);
+		return 1;
+	}
+	close(new);
+	return 0;
+}
+
+static int axn500_connect_addr(int fd, unsigned int daddr)
+{
+	struct sockaddr_irda addr;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sir_family = AF_IRDA;
+	addr.sir_addr = daddr;
+	strncpy(addr.sir_name, "HRM", sizeof(addr.sir_name));
+	return connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+}
+
+/*
+ * Waits up to 'timeout' ms for the kernel to discover a device matching the
+ * hint mask. Returns 0 if one showed up, 1 on timeout and -1 if waiting
+ * isn't supported.
+ */
+static int axn500_wait_device(int fd, int timeout)
+{
+	socklen_t len = sizeof(timeout);
+
+	if (getsockopt(fd, SOL_IRLMP, IRLMP_WAITDEVICE, &timeout, &len) == 0)
+		return 0;
+	if (errno == EAGAIN || errno == ETIME || errno == EINTR)
+		return 1;
+	return -1;
+}
+
+static unsigned int axn500_watch;
+
+#define AXN500_BACKOFF_MIN	10	/* ms */
+#define AXN500_BACKOFF_MAX	500
+#define AXN500_WAITDEVICE_TIMEOUT	1000
+
+/* set by SIGTERM or SIGINT in the daemons, see catch_stop_signals() */
+static volatile sig_atomic_t stop_requested;
+
+static int axn500_connect_watch(int fd, int wait)
+{
+	struct axn500_cached_device devices[AXN500_CACHE_SIZE];
+	struct sockaddr_irda addr;
+	struct axn500_span span;
+	unsigned short hints = 0;
+	int n, rc, mask, backoff = AXN500_BACKOFF_MIN, can_wait = 1;
+
+	/* the broker has its own connection to the watch */
+	if (axn500_broker)
+		return 0;
+
+	/*
+	 * first the last watch we talked to. Only that one is tried since
+	 * each failed attempt costs an IrLAP connection timeout.
+	 */
+	n = axn500_cache_load(devices);
+	if (n) {
+		dprintf("Trying cached device %#x\n", devices[0].daddr);
+		if (axn500_connect_addr(fd, devices[0].daddr) == 0) {
+			dprintf("connected\n");
+			axn500_link_setup(fd);
+			axn500_watch = devices[0].daddr;
+			axn500_cache_save(devices[0].daddr, devices[0].hints);
+			return 0;
+		}
+		if (axn500_reset_socket(fd)) {
+			perror("Unable to create socket");
+			return 1;
+		}
+	}
+
+	/* only wake up for devices like the ones we know */
+	if (n && devices[0].hints) {
+		mask = devices[0].hints;
+		setsockopt(fd, SOL_IRLMP, IRLMP_HINT_MASK_SET, &mask, sizeof(mask));
+	}
+
+	while (1) {
+		if (stop_requested) {
+			dprintf("Stopped while waiting for the watch\n");
+			return 1;
+		}
+		axn500_profile_begin(&span);
+		rc = irda_discover_devices(fd, &addr, &hints, 10);
+		axn500_profile_end(&span, AXN500_PHASE_DISCOVER);
+		if (rc == 0)
+			break;
+		if (errno != EAGAIN) {
+			perror("Error scanning for devices");
+			return 1;
+		}
+		if (!wait) {
+			fprintf(stderr, "No devices found\n");
+			return 1;
+		}
+		/* let the kernel tell us when something shows up */
+		if (can_wait) {
+			switch (axn500_wait_device(fd, AXN500_WAITDEVICE_TIMEOUT)) {
+			case -1:
+				dprintf("IRLMP_WAITDEVICE not supported\n");
+				can_wait = 0;
+				break;
+			default:
+				continue;
+			}
+		}
+		/* keep trying, more patiently each time */
+		usleep(backoff * 1000);
+		backoff *= 2;
+		if (backoff > AXN500_BACKOFF_MAX)
+			backoff = AXN500_BACKOFF_MAX;
+	}
+
+	addr.sir_family = AF_IRDA;
+	strncpy(addr.sir_name, "HRM", sizeof(addr.sir_name));
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("Error connecting");
+		return 1;
+	}
+	dprintf("connected\n");
+	axn500_link_setup(fd);
+	axn500_watch = addr.sir_addr;
+	axn500_cache_save(addr.sir_addr, hints);
+
+	return 0;
+}
+
+int axn500_connect(int fd, int wait)
+{
+	struct axn500_span span;
+	int rc;
+
+	axn500_profile_begin(&span);
+	rc = axn500_connect_watch(fd, wait);
+	axn500_profile_end(&span, AXN500_PHASE_CONNECT);
+	return rc;
+}
+
+void axn500_set_debug(int debug)
+{
+	axn500_debug = debug;
+}
+
+int axn500_fetch_all(int fd, struct axn500 *info)
+{
+	struct axn500_span span;
+	int i, rc;
+	int cmds[] = { AXN500_CMD_GET_TIME,
+		       AXN500_CMD_GET_REMINDER1,
+		       AXN500_CMD_GET_REMINDER2,
+		       AXN500_CMD_GET_REMINDER3,
+		       AXN500_CMD_GET_REMINDER4,
+		       AXN500_CMD_GET_REMINDER5,
+		       AXN500_CMD_GET_SETTINGS,
+		       -1 };
+
+	if (axn500_pipeline > 1 && !axn500_broker) {
+		axn500_profile_begin(&span);
+		rc = axn500_get_data_pipelined(fd, cmds,
+					       sizeof(cmds) / sizeof(cmds[0]) - 1,
+					       axn500_pipeline, info);
+		axn500_profile_end(&span, AXN500_PHASE_FETCH);
+		return rc;
+	}
+
+	for (i = 0; cmds[i] != -1; i++) {
+		rc = axn500_get_data(fd, i, info);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+/* client application */
+static int show_all(int wait)
+{
+	int rc, fd = axn500_init();
+	struct axn500 info;
+
+	if (fd < 0)
+		return fd;
+
+	rc = axn500_connect(fd, wait);
+	if (rc)
+		return rc;
+
+	rc = axn500_fetch_all(fd, &info);
+	if (rc)
+		return rc;
+
+	axn500_print_info(&info);
+	return 0;
+}
+
+#ifdef AXN500_SET_TIME
+static int sync_clock(int wait)
+{
+	struct axn500_clock_sync sync;
+	struct axn500 info;
+	struct tm tm;
+	char buff[32];
+	int rc, fd;
+
+	/* the timing only makes sense with the watch at the other end */
+	if (axn500_broker) {
+		fprintf(stderr, "The clock can't be set through a broker\n");
+		return 1;
+	}
+	fd = axn500_init();
+	if (fd < 0)
+		return fd;
+	rc = axn500_connect(fd, wait);
+	if (rc)
+		return rc;
+
+	printf("Setting the watch clock, this takes a minute or two\n");
+	memset(&info, 0, sizeof(info));
+	rc = axn500_sync_clock(fd, &info, &sync);
+	close(fd);
+	if (rc) {
+		fprintf(stderr, "Unable to set the watch clock\n");
+		return rc;
+	}
+
+	localtime_r(&sync.set, &tm);
+	strftime(buff, sizeof(buff), "%Y-%m-%d %H:%M", &tm);
+	printf("Round trip: %.1f ms minimum, %.1f ms average, one way %.1f ms\n",
+	       sync.rtt_min / 1e6, sync.rtt_avg / 1e6, sync.delay / 1e6);
+	printf("Watch was %lli minutes off, set to %s\n", sync.before / 60,
+	       buff);
+	printf("Residual offset: %+.1f ms (+/- %.1f ms)\n", sync.residual / 1e6,
+	       sync.precision / 1e6);
+	return 0;
+}
+#endif
+
+static int get_value(char *value, int wait)
+{
+	int rc, fd = axn500_init(), i, done_data = 0, multi = 0;
+	struct axn500 info;
+	char *ptr, *start = value, *saved;
+	struct {
+		char *name;
+		int cmd;
+	} values[] = {
+		/* FIXME: be more specific, e.g. alarm1.date */
+		{ "alarm1", AXN500_CMD_GET_TIME },
+		{ "alarm2", AXN500_CMD_GET_TIME },
+		{ "alarm3", AXN500_CMD_GET_TIME },
+		{ "reminder1", AXN500_CMD_GET_REMINDER1 },
+		{ "reminder2", AXN500_CMD_GET_REMINDER2 },
+		{ "reminder3", AXN500_CMD_GET_REMINDER3 },
+		{ "reminder4", AXN500_CMD_GET_REMINDER4 },
+		{ "reminder5", AXN500_CMD_GET_REMINDER5 },
+		{ "timezone1", AXN500_CMD_GET_TIME },
+		{ "timezone2", AXN500_CMD_GET_TIME },
+		{ "timezone", AXN500_CMD_GET_TIME },
+		{ "ampm", AXN500_CMD_GET_TIME },
+		{ "date", AXN500_CMD_GET_TIME },
+		{ "birthday", AXN500_CMD_GET_SETTINGS },
+		{ "height", AXN500_CMD_GET_SETTINGS },
+		{ "weight", AXN500_CMD_GET_SETTINGS },
+		{ "record_rate", AXN500_CMD_GET_SETTINGS },
+		{ "activity", AXN500_CMD_GET_SETTINGS },
+		{ "hrmax", AXN500_CMD_GET_SETTINGS },
+		{ "vomax", AXN500_CMD_GET_SETTINGS },
+		{ "sit_hr", AXN500_CMD_GET_SETTINGS },
+		{ "activity_button_sound", AXN500_CMD_GET_SETTINGS },
+		{ "intro_animations", AXN500_CMD_GET_SETTINGS },
+		{ "imperial", AXN500_CMD_GET_SETTINGS },
+		{ "declination", AXN500_CMD_GET_SETTINGS },
+		{ "countdown", AXN500_CMD_GET_SETTINGS },
+		{ "sex", AXN500_CMD_GET_SETTINGS },
+		{ "htouch", AXN500_CMD_GET_SETTINGS },
+		{ NULL, 0 },
+	};
+
+	if (!strcmp(value, "help")) {
+		for (i = 0; values[i].name != NULL; i++)
+			printf("%s\n", values[i].name);
+		return 0;
+	}
+
+	if (fd < 0)
+		return fd;
+
+	rc = axn500_connect(fd, wait);
+	if (rc)
+		return rc;
+
+	if (strchr(value, ',')) {
+		/* multiple values, fetch all the data */
+		rc = axn500_fetch_all(fd, &info);
+		if (rc)
+			return rc;
+		done_data = 1;
+	}
+
+	while (1) {
+		ptr = strtok_r(start, ",", &saved);
+		if (ptr == NULL)
+			break;
+		start = NULL;
+
+		for (i = 0; values[i].name != NULL && strcmp(values[i].name, ptr); i++)
+			;
+
+		if (values[i].name == NULL) {
+			fprintf(stderr, "value %s unsupported\n", ptr);
+			return -1;
+		}
+
+		if (done_data == 0) {
+			rc = axn500_get_data(fd, values[i].cmd, &info);
+			if (rc)
+				return -1;
+		} 
+
+		if (multi)
+			printf(";");
+
+		if (!strcmp(values[i].name, "alarm1")) {
+			axn500_print_alarm(&info, 0);
+		} else if (!strcmp(values[i].name, "alarm2")) {
+			axn500_print_alarm(&info, 1);
+		} else if (!strcmp(values[i].name, "alarm3")) {
+			axn500_print_alarm(&info, 2);
+		} else if (!strcmp(values[i].name, "reminder1")) {
+			axn500_print_reminder(&info, 0);
+		} else if (!strcmp(values[i].name, "reminder2")) {
+			axn500_print_reminder(&info, 1);
 		} else if (!strcmp(values[i].name, "reminder3")) {
 			axn500_print_reminder(&info, 2);
 		} else if (!strcmp(values[i].name, "reminder4")) {
@@ -1397,168 +7630,1877 @@ static int get_value(char *value, int wait)
 		} else if (!strcmp(values[i].name, "htouch")) {
 			axn500_print_htouch(&info);
 		}
-		/* value */
-		multi = 1;
+		/* value */
+		multi = 1;
+	}
+	printf("\n");
+
+	return 0;
+}
+	
+static int plot_points;
+
+static void print_pyramid(struct axn500_exercise *e, int level, FILE *output)
+{
+	struct axn500_pyramid_point *p;
+	int j;
+
+	fprintf(output, "Data (%i samples per line, HR min/max/mean, "
+		"altitude min/max/mean):\n",
+		1 << axn500_pyramid_shift(level));
+	for (j = 0; j < e->pyramid[level].points; j++) {
+		p = &e->pyramid[level].point[j];
+		fprintf(output, "%i\t%i\t%i\t%i\t%i\t%i\n",
+			p->hr_min, p->hr_max, (int)(p->hr_sum / p->count),
+			p->alt_min, p->alt_max, (int)(p->alt_sum / p->count));
+	}
+}
+
+static void print_exercises(struct axn500 *info, FILE *output)
+{
+	int i, j;
+
+	for (i = 0; i < info->exercises.num; i++) {
+		struct axn500_exercise *e = &info->exercises.exercise[i];
+
+		fprintf(output, "Exercise %i\n", i);
+		if (e->status != AXN500_EX_OK)
+			fprintf(output, "Status: %s\n", axn500_ex_status[e->status]);
+		fprintf(output, "Date: ");
+		_axn500_print_date(&e->date);
+		fprintf(output, "\n");
+		fprintf(output, "Start time: %i:%i:%i", e->start_time.hour,
+			e->start_time.minute, e->start_time.second);
+		fprintf(output, "\n");
+		fprintf(output, "Duration: %ih%imin%is", e->duration.hour,
+			e->duration.minute, e->duration.second);
+		fprintf(output, "\n");
+		for (j = 0; j < 3; j++) {
+			fprintf(output, "Limit %i (lower/upper): ", j);
+			_axn500_print_limit(&e->limits[j]);
+			fprintf(output, "\n");
+		}
+		fprintf(output, "KCal: %hi\n", e->kcal);
+		fprintf(output, "Markers: %i\n", e->num_markers);
+		fprintf(output, "Maximum HR: %i\n", e->max_hr);
+		fprintf(output, "Average HR: %i\n", e->avg_hr);
+		fprintf(output, "Minimum altitude: %i\n", e->min_alt);
+		fprintf(output, "Maximum altitude: %i\n", e->max_alt);
+		if (plot_points > 0 && axn500_pyramid_level(e, plot_points) >= 0) {
+			print_pyramid(e, axn500_pyramid_level(e, plot_points), output);
+			continue;
+		}
+		fprintf(output, "Data:\n");
+		for (j = 0; j < e->entries; j++) {
+			fprintf(output, "%i\t%i", e->data[j].hr, e->data[j].altitude);
+			if (axn500_clean.enabled)
+				fprintf(output, "\t%#x", e->data[j].quality);
+			fprintf(output, "\n");
+		}
+	}
+}
+
+static struct axn500_window analysis_windows[AXN500_MAX_WINDOWS];
+static int num_analysis_windows;
+
+static int set_analysis(char *spec)
+{
+	struct axn500_window *w;
+	char *ptr, *start = spec, *saved, *end;
+
+	while ((ptr = strtok_r(start, ",", &saved))) {
+		start = NULL;
+		if (num_analysis_windows == AXN500_MAX_WINDOWS) {
+			fprintf(stderr, "At most %i windows\n", AXN500_MAX_WINDOWS);
+			return 1;
+		}
+		w = &analysis_windows[num_analysis_windows++];
+		w->size = strtol(ptr, &end, 10);
+		w->seconds = (*end == 's' || *end == 'm');
+		if (*end == 'm')
+			w->size *= 60;
+		if (w->size <= 0 || (*end && end[1]) ||
+		    (*end && !w->seconds)) {
+			fprintf(stderr, "Invalid window: %s\n", ptr);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void print_offset(int seconds, FILE *output)
+{
+	fprintf(output, "%i:%02i:%02i", seconds / 3600, seconds / 60 % 60,
+		seconds % 60);
+}
+
+/* seconds windows are labelled with the span of the samples actually used */
+static void window_label(struct axn500_window *w, int samples, int rate,
+			 char *label)
+{
+	int seconds = samples? samples * rate:w->size;
+
+	if (!w->seconds)
+		sprintf(label, "%i samples", w->size);
+	else if (seconds % 60 == 0)
+		sprintf(label, "%imin", seconds / 60);
+	else
+		sprintf(label, "%is", seconds);
+}
+
+static void print_analysis(struct axn500 *info, FILE *output)
+{
+	struct axn500_analysis *results, *a;
+	struct axn500_window_result *r;
+	struct axn500_exercise *e;
+	struct axn500_window *w;
+	char label[32];
+	int i, k;
+
+	results = calloc(info->exercises.num + 1, sizeof(*results));
+	if (results == NULL ||
+	    axn500_analyze_all(info, analysis_windows, num_analysis_windows,
+			       results)) {
+		fprintf(stderr, "Not enough memory\n");
+		free(results);
+		return;
+	}
+
+	for (i = 0; i < info->exercises.num; i++) {
+		e = &info->exercises.exercise[i];
+		a = &results[i];
+		fprintf(output, "Exercise %i\n", i);
+		fprintf(output, "Date: ");
+		_axn500_print_date(&e->date);
+		fprintf(output, "\n");
+		fprintf(output, "Start time: %i:%i:%i\n", e->start_time.hour,
+			e->start_time.minute, e->start_time.second);
+		for (k = 0; k < num_analysis_windows; k++) {
+			w = &analysis_windows[k];
+			r = &a->window[k];
+			window_label(w, r->samples, e->record_rate, label);
+			if (r->samples == 0) {
+				fprintf(output, "Best %s: exercise too short\n", label);
+				continue;
+			}
+			fprintf(output, "Best %s HR: %.1f from ", label, r->best_hr);
+			print_offset(r->best_hr_start * e->record_rate, output);
+			if (r->samples < 2) {
+				fprintf(output, "\nBest %s ascent: needs at least "
+					"2 samples\n", label);
+				continue;
+			}
+			fprintf(output, "\nBest %s ascent: %i m (%i m/h) from ", label,
+				r->best_ascent, r->best_ascent * 3600 /
+				((r->samples - 1) * e->record_rate));
+			print_offset(r->best_ascent_start * e->record_rate, output);
+			fprintf(output, "\n");
+		}
+		fprintf(output, "Recoveries: %i", a->recoveries);
+		if (a->recoveries) {
+			fprintf(output, ", average ");
+			print_offset(a->recovery_samples * e->record_rate /
+				     a->recoveries, output);
+		}
+		fprintf(output, "\n");
+	}
+	free(results);
+}
+
+#define MAX_EXPORTS	8
+
+static struct axn500_exporter exports[MAX_EXPORTS];
+static const char *export_files[MAX_EXPORTS];	/* NULL for stdout */
+static int num_exports;
+
+/* "<format>[=<file>],...", the data goes to stdout when there's no file */
+static int set_exports(char *spec)
+{
+	struct axn500_exporter *x;
+	char *ptr, *start = spec, *saved, *file;
+
+	while ((ptr = strtok_r(start, ",", &saved))) {
+		start = NULL;
+		if (num_exports == MAX_EXPORTS) {
+			fprintf(stderr, "At most %i exports\n", MAX_EXPORTS);
+			return 1;
+		}
+		file = strchr(ptr, '=');
+		if (file)
+			*file++ = 0;
+		x = &exports[num_exports];
+		x->format = axn500_export_format(ptr);
+		if (x->format == NULL) {
+			fprintf(stderr, "Unknown export format: %s\n", ptr);
+			return 1;
+		}
+		/* opened when exporting, nothing is truncated before that */
+		export_files[num_exports] = file && strcmp(file, "-")? file:NULL;
+		num_exports++;
+	}
+	return 0;
+}
+
+static int export_exercises(struct axn500 *info)
+{
+	int i, opened, rc = 0;
+
+	for (opened = 0; opened < num_exports; opened++) {
+		exports[opened].output = stdout;
+		if (export_files[opened] == NULL)
+			continue;
+		exports[opened].output = fopen(export_files[opened], "w");
+		if (exports[opened].output == NULL) {
+			fprintf(stderr, "Unable to create export file %s: %s\n",
+				export_files[opened], strerror(errno));
+			rc = 1;
+			break;
+		}
+	}
+	if (rc == 0) {
+		rc = axn500_export(info, exports, num_exports);
+		if (rc)
+			fprintf(stderr, "Error writing the exported data\n");
+	}
+	for (i = 0; i < opened; i++)
+		if (exports[i].output != stdout && fclose(exports[i].output))
+			rc = 1;
+	num_exports = 0;
+	return rc;
+}
+
+static int show_exercises(struct axn500 *info, FILE *output)
+{
+	struct axn500_span span;
+	int rc = 0;
+
+	axn500_profile_begin(&span);
+	if (num_exports)
+		rc = export_exercises(info);
+	else if (num_analysis_windows)
+		print_analysis(info, output);
+	else
+		print_exercises(info, output);
+	axn500_profile_end(&span, AXN500_PHASE_OUTPUT);
+	return rc;
+}
+
+static const char *archive_file;
+static unsigned int watch_id;
+static int watch_set;
+
+static const char *store_dir;
+
+/*
+ * An archive with a checkpoint is also fed by -I, which drops whatever is
+ * past the checkpoint when it loads it: the exercises are committed the
+ * same way it does, skipping those already there. Whether there's one is
+ * only looked at under the archive lock, -I may be creating it. Returns
+ * the number of exercises added, -1 on errors.
+ */
+static int commit_exercises(char *raw, struct axn500 *info)
+{
+	struct axn500_checkpoint ckpt;
+	int lock, added = -1;
+
+	lock = axn500_archive_lock(archive_file);
+	if (lock < 0)
+		return -1;
+	if (!axn500_checkpoint_exists(archive_file)) {
+		if (axn500_archive_append(archive_file, info) == 0 &&
+		    axn500_rollup_exercises(archive_file, info) == 0 &&
+		    axn500_sim_exercises(archive_file, info) == 0)
+			added = info->exercises.num;
+		close(lock);
+		return added;
+	}
+	if (axn500_checkpoint_load(archive_file, &ckpt) == 0) {
+		added = axn500_ingest_commit(&ckpt, raw, info);
+		if (added >= 0)
+			dprintf("Committed %i new exercises\n", added);
+	}
+	axn500_checkpoint_free(&ckpt);
+	close(lock);
+	return added;
+}
+
+/* what gets stored isn't cleaned, output_exercises() cleans it after that */
+static int clean_on_decode(void)
+{
+	return axn500_clean.enabled && !store_dir && !archive_file;
+}
+
+static int output_exercises(struct axn500 *info, char *raw, FILE *output)
+{
+	struct axn500_span span;
+	int rc = 0;
+
+	if (store_dir || archive_file) {
+		axn500_profile_begin(&span);
+		if (store_dir)
+			rc = axn500_store_exercises(store_dir, raw, info);
+		if (rc == 0 && archive_file)
+			rc = commit_exercises(raw, info) < 0;
+		axn500_profile_end(&span, AXN500_PHASE_STORE);
+		/* -z doesn't print the exercises, but still exports them */
+		if (rc || (archive_file && !num_exports))
+			return rc;
+		/* stored as they were decoded, see clean_on_decode() */
+		if (axn500_clean.enabled)
+			axn500_clean_exercises(info);
+	}
+
+	return show_exercises(info, output);
+}
+
+static int set_cleaning(char *spec)
+{
+	struct {
+		const char *name;
+		int *value;
+	} keys[] = {
+		{ "gap", &axn500_clean.gap },
+		{ "spike", &axn500_clean.spike },
+		{ "jump", &axn500_clean.jump },
+		{ "hysteresis", &axn500_clean.hysteresis },
+		{ NULL, NULL },
+	};
+	char *ptr, *start = spec, *saved, *value, *end;
+	long n;
+	int i;
+
+	axn500_clean.enabled = 1;
+	if (!strcmp(spec, "on"))
+		return 0;
+	while ((ptr = strtok_r(start, ",", &saved))) {
+		start = NULL;
+		value = strchr(ptr, '=');
+		if (value)
+			*value++ = 0;
+		for (i = 0; keys[i].name; i++)
+			if (!strcmp(ptr, keys[i].name))
+				break;
+		if (value == NULL || keys[i].name == NULL) {
+			fprintf(stderr, "Invalid cleaning setting: %s\n", ptr);
+			return 1;
+		}
+		n = strtol(value, &end, 10);
+		if (end == value || *end || n < 0 || n > INT_MAX) {
+			fprintf(stderr, "Invalid %s: %s, it must be 0 (off) or a "
+				"positive number\n", ptr, value);
+			return 1;
+		}
+		*keys[i].value = n;
+	}
+	return 0;
+}
+
+static int show_archive(const char *filename, FILE *output)
+{
+	struct axn500 info;
+	struct stat st;
+	int rc;
+
+	memset(&info, 0, sizeof(info));
+	if (stat(filename, &st) == 0 && S_ISDIR(st.st_mode))
+		rc = axn500_store_read(filename, &info);
+	else
+		rc = axn500_archive_read(filename, &info);
+	if (rc == 0 && axn500_clean.enabled)
+		axn500_clean_exercises(&info);
+	if (rc == 0)
+		rc = show_exercises(&info, output);
+	axn500_free_exercises(&info);
+
+	return rc;
+}
+
+static int parse_time(const char *value, time_t *t)
+{
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(value, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon,
+		   &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) < 3)
+		return 1;
+	tm.tm_year -= 1900;
+	tm.tm_mon--;
+	tm.tm_isdst = -1;
+	*t = mktime(&tm);
+	return 0;
+}
+
+static void print_sample(void *arg, unsigned int watch, time_t when, int value)
+{
+	FILE *output = arg;
+	struct tm tm;
+	char buff[32];
+
+	localtime_r(&when, &tm);
+	strftime(buff, sizeof(buff), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(output, "%#x\t%s\t%i\n", watch, buff, value);
+}
+
+/*
+ * query format: comma separated list of
+ *	watch=<address>
+ *	from=<YYYY-MM-DD[ HH:MM:SS]>
+ *	to=<YYYY-MM-DD[ HH:MM:SS]>
+ *	column=<hr|alt>
+ */
+static int query_samples(char *query, FILE *output)
+{
+	struct axn500_sample_query q;
+	char *ptr, *start = query, *saved, *value;
+	time_t t;
+
+	if (archive_file == NULL) {
+		fprintf(stderr, "An archive is needed (-z)\n");
+		return 1;
+	}
+
+	q.any_watch = 1;
+	q.watch = 0;
+	q.from = 0;
+	q.to = LLONG_MAX;
+	q.column = AXN500_Z_HR;
+	while ((ptr = strtok_r(start, ",", &saved))) {
+		start = NULL;
+		value = strchr(ptr, '=');
+		if (value == NULL) {
+			fprintf(stderr, "Invalid query: %s\n", ptr);
+			return 1;
+		}
+		*value++ = 0;
+		if (!strcmp(ptr, "watch")) {
+			q.any_watch = 0;
+			q.watch = strtoul(value, NULL, 0);
+		} else if (!strcmp(ptr, "from") || !strcmp(ptr, "to")) {
+			if (parse_time(value, &t)) {
+				fprintf(stderr, "Invalid date: %s\n", value);
+				return 1;
+			}
+			if (!strcmp(ptr, "from"))
+				q.from = t;
+			else
+				q.to = t;
+		} else if (!strcmp(ptr, "column")) {
+			if (!strcmp(value, "hr"))
+				q.column = AXN500_Z_HR;
+			else if (!strcmp(value, "alt"))
+				q.column = AXN500_Z_ALT;
+			else {
+				fprintf(stderr, "Unknown column: %s\n", value);
+				return 1;
+			}
+		} else {
+			fprintf(stderr, "Unknown query key: %s\n", ptr);
+			return 1;
+		}
+	}
+
+	return axn500_archive_query(archive_file, &q, print_sample, output);
+}
+
+/*
+ * Parses a date or a time of day/duration into the interval it stands for:
+ * "2026-03-05" is the whole day, "1:30" the whole minute
+ */
+static int parse_date_range(const char *value, long long *min, long long *max)
+{
+	struct tm tm;
+	time_t t;
+	int n;
+
+	memset(&tm, 0, sizeof(tm));
+	n = sscanf(value, "%d-%d-%d %d:%d:%d", &tm.tm_year, &tm.tm_mon,
+		   &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec);
+	if (n < 3)
+		return 1;
+	tm.tm_year -= 1900;
+	tm.tm_mon--;
+	tm.tm_isdst = -1;
+	t = mktime(&tm);
+	*min = t;
+	if (n == 3)
+		tm.tm_mday++;
+	else if (n == 4)
+		tm.tm_hour++;
+	else if (n == 5)
+		tm.tm_min++;
+	else
+		tm.tm_sec++;
+	tm.tm_isdst = -1;
+	*max = mktime(&tm) - 1;
+	return 0;
+}
+
+static int parse_clock_range(const char *value, long long *min, long long *max)
+{
+	int h, m, s = 0, n;
+
+	n = sscanf(value, "%d:%d:%d", &h, &m, &s);
+	if (n < 2)
+		return 1;
+	*min = h * 3600 + m * 60 + s;
+	*max = *min + ((n == 2)? 59:0);
+	return 0;
+}
+
+static void print_match(void *arg, struct axn500_index_entry *entry, int samples)
+{
+	FILE *output = arg;
+	time_t start = entry->start;
+	struct tm tm;
+	char buff[32];
+
+	localtime_r(&start, &tm);
+	strftime(buff, sizeof(buff), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(output, "%#x\t%s\t%u:%02u:%02u\t%i\t%i\t%i\t%i-%i", entry->watch,
+		buff, entry->duration / 3600, entry->duration / 60 % 60,
+		entry->duration % 60, entry->max_hr, entry->avg_hr, entry->kcal,
+		entry->min_alt, entry->max_alt);
+	if (samples >= 0)
+		fprintf(output, "\t%i", samples);
+	fprintf(output, "\n");
+}
+
+static int query_exercises(char *query, FILE *output)
+{
+	struct axn500_query_stats stats;
+	struct axn500_ex_query q;
+	char *ptr, *start = query, *saved, *op, *value;
+	long long min, max;
+	int field, rc;
+
+	if (archive_file == NULL) {
+		fprintf(stderr, "An archive is needed (-z)\n");
+		return 1;
+	}
+
+	axn500_query_init(&q);
+	while ((ptr = strtok_r(start, ",", &saved))) {
+		start = NULL;
+		op = strpbrk(ptr, "<>=");
+		if (op == NULL) {
+			fprintf(stderr, "Invalid query: %s\n", ptr);
+			return 1;
+		}
+		value = op + ((op[1] == '=')? 2:1);
+		for (field = 0; field < AXN500_Q_FIELDS; field++)
+			if (strlen(axn500_query_fields[field]) == op - ptr &&
+			    !strncmp(ptr, axn500_query_fields[field], op - ptr))
+				break;
+		if (field == AXN500_Q_FIELDS) {
+			fprintf(stderr, "Unknown query field: %.*s\n",
+				(int)(op - ptr), ptr);
+			return 1;
+		}
+
+		if (field == AXN500_Q_DATE)
+			rc = parse_date_range(value, &min, &max);
+		else if (field == AXN500_Q_START || field == AXN500_Q_DURATION)
+			rc = parse_clock_range(value, &min, &max);
+		else {
+			min = max = strtoll(value, &ptr, 0);
+			rc = (ptr == value || *ptr);
+		}
+		if (rc) {
+			fprintf(stderr, "Invalid value for %s: %s\n",
+				axn500_query_fields[field], value);
+			return 1;
+		}
+
+		if (op[0] == '=')
+			axn500_query_range(&q, field, min, max);
+		else if (op[0] == '<' && op[1] == '=')
+			axn500_query_range(&q, field, LLONG_MIN, max);
+		else if (op[0] == '<')
+			axn500_query_range(&q, field, LLONG_MIN, min - 1);
+		else if (op[1] == '=')
+			axn500_query_range(&q, field, min, LLONG_MAX);
+		else
+			axn500_query_range(&q, field, max + 1, LLONG_MAX);
+	}
+
+	rc = axn500_archive_select(archive_file, &q, print_match, output, &stats);
+	dprintf("%i of %i exercises matched, %i of %i blocks read\n",
+		stats.matched, stats.exercises, stats.blocks_read, stats.blocks);
+	return rc;
+}
+
+static int show_rollups(char *query, FILE *output)
+{
+	struct axn500_rollup r;
+	struct axn500_rollup_entry *p;
+	struct tm tm;
+	time_t from = 0, t, start;
+	long long to = LLONG_MAX;
+	unsigned int watch = 0;
+	int i, kind, any_watch = 1;
+	char *ptr, *saved, *value, buff[32];
+
+	if (archive_file == NULL) {
+		fprintf(stderr, "An archive is needed (-z)\n");
+		return 1;
+	}
+
+	ptr = strtok_r(query, ",", &saved);
+	for (kind = 0; ptr && kind < AXN500_ROLLUP_KINDS; kind++)
+		if (!strcmp(ptr, axn500_rollup_kinds[kind]))
+			break;
+	if (ptr == NULL || kind == AXN500_ROLLUP_KINDS) {
+		fprintf(stderr, "Unknown period, use day, week or month\n");
+		return 1;
+	}
+	while ((ptr = strtok_r(NULL, ",", &saved))) {
+		value = strchr(ptr, '=');
+		if (value == NULL) {
+			fprintf(stderr, "Invalid query: %s\n", ptr);
+			return 1;
+		}
+		*value++ = 0;
+		if (!strcmp(ptr, "watch")) {
+			any_watch = 0;
+			watch = strtoul(value, NULL, 0);
+		} else if (!strcmp(ptr, "from") || !strcmp(ptr, "to")) {
+			if (parse_time(value, &t)) {
+				fprintf(stderr, "Invalid date: %s\n", value);
+				return 1;
+			}
+			if (!strcmp(ptr, "from"))
+				from = t;
+			else
+				to = t;
+		} else {
+			fprintf(stderr, "Unknown query key: %s\n", ptr);
+			return 1;
+		}
+	}
+
+	if (axn500_rollup_read(archive_file, &r, 1))
+		return 1;
+	qsort(r.periods, r.num_periods, sizeof(*r.periods), axn500_rollup_compare);
+	for (i = 0; i < r.num_periods; i++) {
+		p = &r.periods[i];
+		if (p->kind != kind || (!any_watch && p->watch != watch) ||
+		    p->start < axn500_period_start(from, kind) || p->start >= to)
+			continue;
+		start = p->start;
+		localtime_r(&start, &tm);
+		strftime(buff, sizeof(buff), "%Y-%m-%d", &tm);
+		fprintf(output, "%#x\t%s\t%u\t%u:%02u:%02u\t%u\t%u\t%u\t%u\t%u\n",
+			p->watch, buff, p->totals.exercises,
+			p->totals.duration / 3600, p->totals.duration / 60 % 60,
+			p->totals.duration % 60, p->totals.kcal,
+			p->totals.zone[0] / 60, p->totals.zone[1] / 60,
+			p->totals.zone[2] / 60, p->totals.load / 60);
+	}
+	axn500_rollup_free(&r);
+	return 0;
+}
+
+/*
+ * "<date>[,watch=<address>][,k=<n>][,dtw]": lists the exercises most like
+ * the one started at <date>, closest first, with their squared distance
+ */
+static int similar_exercises(char *query, FILE *output)
+{
+	struct axn500_sim sim;
+	struct axn500_sim_match *best;
+	struct timespec t0, t1;
+	struct tm tm;
+	float reference[AXN500_SIM_DIM] __attribute__((aligned(32)));
+	unsigned int watch = 0;
+	time_t start, when;
+	int i, num, ex, k = 5, dtw = 0, any_watch = 1;
+	char *ptr, *saved, *value, buff[32];
+
+	if (archive_file == NULL) {
+		fprintf(stderr, "An archive is needed (-z)\n");
+		return 1;
+	}
+
+	ptr = strtok_r(query, ",", &saved);
+	if (ptr == NULL || parse_time(ptr, &start)) {
+		fprintf(stderr, "Invalid date: %s\n", ptr? ptr:"");
+		return 1;
+	}
+	while ((ptr = strtok_r(NULL, ",", &saved))) {
+		if (!strcmp(ptr, "dtw")) {
+			dtw = 1;
+			continue;
+		}
+		value = strchr(ptr, '=');
+		if (value == NULL) {
+			fprintf(stderr, "Invalid query: %s\n", ptr);
+			return 1;
+		}
+		*value++ = 0;
+		if (!strcmp(ptr, "watch")) {
+			any_watch = 0;
+			watch = strtoul(value, NULL, 0);
+		} else if (!strcmp(ptr, "k") && atoi(value) > 0) {
+			k = atoi(value);
+		} else {
+			fprintf(stderr, "Invalid query key: %s\n", ptr);
+			return 1;
+		}
+	}
+
+	if (axn500_sim_load(archive_file, &sim))
+		return 1;
+	for (ex = 0; ex < sim.num; ex++)
+		if (sim.keys[ex].start == start &&
+		    (any_watch || sim.keys[ex].watch == watch))
+			break;
+	if (ex == sim.num) {
+		fprintf(stderr, "No exercise started at %s\n", query);
+		axn500_sim_free(&sim);
+		return 1;
+	}
+	memcpy(reference, &sim.vectors[ex * AXN500_SIM_DIM], sizeof(reference));
+
+	best = malloc(sizeof(*best) * k * AXN500_SIM_RERANK);
+	if (best == NULL) {
+		fprintf(stderr, "Not enough memory\n");
+		axn500_sim_free(&sim);
+		return 1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	num = axn500_sim_search(&sim, reference, ex, k, dtw, best);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	dprintf("Searched %i exercises in %.3f ms\n", sim.num,
+		(t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6);
+
+	for (i = 0; i < num; i++) {
+		when = sim.keys[best[i].index].start;
+		localtime_r(&when, &tm);
+		strftime(buff, sizeof(buff), "%Y-%m-%d %H:%M:%S", &tm);
+		fprintf(output, "%#x\t%s\t%.4f\n", sim.keys[best[i].index].watch,
+			buff, best[i].distance);
+	}
+	free(best);
+	axn500_sim_free(&sim);
+	return 0;
+}
+
+static int get_all_exercises(FILE *output, int wait, const char *save)
+{
+	int rc, fd = axn500_init(), bytes;
+	struct axn500 info;
+	struct tm ref;
+	char *ex;
+	unsigned char num_ex;
+
+	if (fd < 0) {
+		fprintf(stderr, "Unable to initialize AXN500\n");
+		return 1;
+	}
+	rc = axn500_connect(fd, wait);
+	if (rc)
+		return rc;
+
+	/* the watch date is used to figure out the exercises' dates */
+	if (save == NULL && axn500_get_data(fd, AXN500_CMD_GET_TIME, &info))
+		return 1;
+
+	ex = axn500_get_exercise(fd, &num_ex, &bytes, &info);
+	if (ex == NULL) {
+		fprintf(stderr, "Unable to get exercises from AXN500\n");
+		return 1;
+	}
+
+	printf("Found %i exercises\n", num_ex);
+	if (num_ex == 0)
+		return 0;
+
+	if (save) {
+		int fd = open(save, O_CREAT | O_TRUNC | O_RDWR,
+				S_IRUSR | S_IWUSR);
+		if (fd < 0) {
+			perror("Error creating file");
+			return 1;
+		}
+		write(fd, &num_ex, 1);
+		/* FIXME - not endian safe */
+		write(fd, &bytes, 4);
+		dprintf("Writing %i bytes\n", bytes);
+		write(fd, ex, bytes);
+		close(fd);
+		free(ex);
+		return 0;
+	}
+
+	rc = axn500_parse_exercises(ex, num_ex, bytes, &info, clean_on_decode());
+	if (rc) {
+		fprintf(stderr, "Unable to parse exercise data from AXN500\n");
+		free(ex);
+		return 1;
+	}
+
+	memset(&ref, 0, sizeof(ref));
+	ref.tm_mday = info.date.day;
+	ref.tm_mon = info.date.month - 1;
+	ref.tm_year = info.date.year + 100;
+	axn500_date_exercises(&info, &ref, watch_set? watch_id:axn500_watch);
+
+	rc = output_exercises(&info, ex, output);
+	free(ex);
+	axn500_print_parse_errors(&info, stderr);
+	axn500_free_exercises(&info);
+
+	return rc;
+}
+
+static int valid_dump(unsigned char num_ex, unsigned int bytes)
+{
+	if (num_ex == 0 || num_ex > 50) {
+		fprintf(stderr, "Invalid number of exercises (%i). Corrupt file?\n", num_ex);
+		return 0;
+	}
+	if (bytes <= 3 || bytes > 50000) {
+		fprintf(stderr, "Invalid exercise size (%i). Corrupt file?\n", bytes);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Reads a dump saved with -s, returns its exercise data or NULL on errors.
+ * 'mtime' is when it was written, which is right after the transfer.
+ */
+static char *load_dump(const char *filename, unsigned char *num_ex,
+		       unsigned int *bytes, time_t *mtime)
+{
+	int fd = open(filename, O_RDONLY), rc;
+	struct stat st;
+	char *ex;
+
+	if (fd < 0) {
+		perror("Unable to open file");
+		return NULL;
+	}
+
+	if (read(fd, num_ex, 1) != 1) {
+		perror("Unable to read number of exercises");
+		close(fd);
+		return NULL;
+	}
+	if (read(fd, bytes, sizeof(*bytes)) != sizeof(*bytes)) {
+		perror("Unable to read the exercise size");
+		close(fd);
+		return NULL;
+	}
+	if (!valid_dump(*num_ex, *bytes)) {
+		close(fd);
+		return NULL;
+	}
+	ex = malloc(*bytes);
+	if (ex == NULL) {
+		perror("Unable to allocate memory");
+		close(fd);
+		return NULL;
+	}
+	rc = read(fd, ex, *bytes);
+	if (rc != *bytes) {
+		if (rc < 0)
+			perror("Unable to read data file");
+		else
+			fprintf(stderr, "Short read while reading data file: "
+				"wanted %i, got %i\n", *bytes, rc);
+		free(ex);
+		close(fd);
+		return NULL;
+	}
+	if (fstat(fd, &st))
+		st.st_mtime = time(NULL);
+	*mtime = st.st_mtime;
+	close(fd);
+
+	return ex;
+}
+
+static int parse_exercises(const char *filename, FILE *output)
+{
+	struct axn500 info;
+	struct tm ref;
+	time_t mtime;
+	char *ex;
+	unsigned char num_ex;
+	unsigned int bytes;
+	int rc;
+
+	ex = load_dump(filename, &num_ex, &bytes, &mtime);
+	if (ex == NULL)
+		return 1;
+
+	rc = axn500_parse_exercises(ex, num_ex, bytes, &info, clean_on_decode());
+	if (rc) {
+		fprintf(stderr, "Unable to parse exercise data from AXN500\n");
+		free(ex);
+		return 1;
+	}
+
+	localtime_r(&mtime, &ref);
+	axn500_date_exercises(&info, &ref, watch_id);
+
+	rc = output_exercises(&info, ex, output);
+	free(ex);
+	axn500_print_parse_errors(&info, stderr);
+	axn500_free_exercises(&info);
+
+	return rc;
+}
+
+/*
+ * Lists the exercises of a dump without parsing it: the dump is mmap()ed
+ * and viewed, so only the headers and the samples walked to sum the ascent
+ * are touched.
+ */
+static int list_exercises(const char *filename, FILE *output)
+{
+	struct axn500_dump_view view;
+	struct axn500_ex_view ex;
+	struct axn500_sample_iter it;
+	struct axn500_entry entry;
+	struct axn500_time start, duration;
+	unsigned char num_ex;
+	unsigned int bytes;
+	struct stat st;
+	char *map;
+	int fd, i, status, ascent, last, rc = 0;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		perror("Unable to open file");
+		return 1;
+	}
+	if (fstat(fd, &st)) {
+		perror("Unable to stat file");
+		close(fd);
+		return 1;
+	}
+	if (st.st_size < 5) {
+		fprintf(stderr, "Short dump file\n");
+		close(fd);
+		return 1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("Unable to map file");
+		return 1;
+	}
+
+	num_ex = map[0];
+	memcpy(&bytes, map + 1, sizeof(bytes));
+	if (!valid_dump(num_ex, bytes)) {
+		munmap(map, st.st_size);
+		return 1;
+	}
+	if (bytes > st.st_size - 5) {
+		fprintf(stderr, "Short dump file: wanted %u bytes, got %li\n",
+			bytes, (long)st.st_size - 5);
+		bytes = st.st_size - 5;
+	}
+
+	axn500_dump_view_init(&view, map + 5, num_ex, bytes);
+	for (i = 0; i < num_ex; i++) {
+		status = axn500_view_exercise(&view, i, &ex);
+		if (status) {
+			fprintf(stderr, "Exercise %i: %s\n", i,
+				axn500_ex_status[status]);
+			rc = 1;
+			break;
+		}
+		axn500_view_start_time(&ex, &start);
+		axn500_view_duration(&ex, &duration);
+
+		ascent = 0;
+		last = INT_MIN;
+		axn500_view_samples(&ex, &it);
+		while (axn500_view_next(&it, &entry)) {
+			if (last != INT_MIN && entry.altitude > last)
+				ascent += entry.altitude - last;
+			last = entry.altitude;
+		}
+
+		fprintf(output, "Exercise %i: day %i, %i:%02i:%02i, lasted "
+			"%i:%02i:%02i, %i/%i samples, HR %i avg %i max, "
+			"%i kcal, %i m ascent\n", i, axn500_view_day(&ex),
+			start.hour, start.minute, start.second, duration.hour,
+			duration.minute, duration.second, ex.available,
+			ex.entries, axn500_view_avg_hr(&ex),
+			axn500_view_max_hr(&ex), axn500_view_kcal(&ex), ascent);
+	}
+
+	munmap(map, st.st_size);
+	return rc;
+}
+
+/*
+ * The daemons (-I, -B) run until SIGTERM or SIGINT, which only ask them to
+ * stop: they finish what they're doing, stop their threads and return, so
+ * the trace and profile are written at exit like for any other command.
+ * The signal can land on any thread, so they look at stop_requested at
+ * least every second.
+ */
+static void request_stop(int sig)
+{
+	stop_requested = 1;
+}
+
+static void catch_stop_signals(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = request_stop;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+}
+
+/*
+ * Ingest daemon
+ *
+ * Dumps closed in (or moved to) the spool directory are queued for a pool
+ * of workers, which parse them and commit the new exercises to the archive
+ * one dump at a time. Dumps end up in done/ or, if they can't be parsed, in
+ * failed/. The dumps left in the spool when the daemon starts are queued
+ * too; processing one twice is harmless as the checkpoint knows its
+ * exercises already.
+ */
+#define INGEST_QUEUE	16
+
+struct ingest_queue {
+	const char *spool;
+	pthread_mutex_t commit;
+	pthread_mutex_t lock;
+	pthread_cond_t more;
+	pthread_cond_t room;
+	char *names[INGEST_QUEUE];
+	int first;
+	int num;
+	int stop;
+	int failed;
+};
+
+static void ingest_push(struct ingest_queue *queue, const char *name)
+{
+	char *copy = strdup(name);
+
+	if (copy == NULL)
+		return;
+	pthread_mutex_lock(&queue->lock);
+	while (queue->num == INGEST_QUEUE && !queue->stop && !queue->failed)
+		pthread_cond_wait(&queue->room, &queue->lock);
+	if (queue->stop || queue->failed)
+		free(copy);
+	else {
+		queue->names[(queue->first + queue->num++) % INGEST_QUEUE] = copy;
+		pthread_cond_signal(&queue->more);
+	}
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static char *ingest_pop(struct ingest_queue *queue)
+{
+	char *name = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+	while (queue->num == 0 && !queue->stop && !queue->failed)
+		pthread_cond_wait(&queue->more, &queue->lock);
+	/*
+	 * once asked to stop, whatever is queued is left for the next run,
+	 * including what the spool scan is still trying to push
+	 */
+	if (stop_requested && !queue->stop) {
+		queue->stop = 1;
+		pthread_cond_broadcast(&queue->more);
+		pthread_cond_broadcast(&queue->room);
+	}
+	if (queue->num && !queue->stop && !queue->failed) {
+		name = queue->names[queue->first];
+		queue->first = (queue->first + 1) % INGEST_QUEUE;
+		queue->num--;
+		pthread_cond_signal(&queue->room);
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return name;
+}
+
+/* stops everything, the dumps not committed yet stay in the spool */
+static void ingest_fail(struct ingest_queue *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+	queue->failed = 1;
+	pthread_cond_broadcast(&queue->more);
+	pthread_cond_broadcast(&queue->room);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static void ingest_move(struct ingest_queue *queue, const char *name,
+			const char *dir)
+{
+	char *from = axn500_path(queue->spool, "%s", name);
+	char *to = axn500_path(queue->spool, "%s/%s", dir, name);
+
+	if (from && to && rename(from, to) && errno != ENOENT)
+		perror(from);
+	free(from);
+	free(to);
+}
+
+static void ingest_file(struct ingest_queue *queue, const char *name)
+{
+	struct axn500 info;
+	struct tm ref;
+	time_t mtime;
+	unsigned char num_ex;
+	unsigned int bytes;
+	char *path, *ex;
+	int added;
+
+	path = axn500_path(queue->spool, "%s", name);
+	if (path == NULL)
+		return;
+	/* already handled by another worker */
+	if (access(path, F_OK)) {
+		free(path);
+		return;
+	}
+	ex = load_dump(path, &num_ex, &bytes, &mtime);
+	free(path);
+	if (ex == NULL || axn500_parse_exercises(ex, num_ex, bytes, &info, 0)) {
+		fprintf(stderr, "Unable to parse %s\n", name);
+		free(ex);
+		ingest_move(queue, name, "failed");
+		return;
+	}
+	localtime_r(&mtime, &ref);
+	axn500_date_exercises(&info, &ref, watch_id);
+
+	pthread_mutex_lock(&queue->commit);
+	added = -1;
+	if (store_dir == NULL ||
+	    axn500_store_exercises(store_dir, ex, &info) == 0)
+		added = commit_exercises(ex, &info);
+	pthread_mutex_unlock(&queue->commit);
+
+	axn500_print_parse_errors(&info, stderr);
+	axn500_free_exercises(&info);
+	free(ex);
+
+	if (added < 0) {
+		/* the restart will pick it up from the last checkpoint */
+		fprintf(stderr, "Unable to commit %s, stopping\n", name);
+		ingest_fail(queue);
+		return;
 	}
-	printf("\n");
+	printf("%s: %i new exercises\n", name, added);
+	fflush(stdout);
+	ingest_move(queue, name, "done");
+}
 
-	return 0;
+static void *ingest_worker(void *arg)
+{
+	struct ingest_queue *queue = arg;
+	char *name;
+
+	while ((name = ingest_pop(queue))) {
+		ingest_file(queue, name);
+		free(name);
+	}
+	return NULL;
 }
-	
-static void print_exercises(struct axn500 *info, FILE *output)
+
+static int ingest_failed(struct ingest_queue *queue)
 {
-	int i, j;
+	int failed;
 
-	for (i = 0; i < info->exercises.num; i++) {
-		struct axn500_exercise *e = &info->exercises.exercise[i];
+	pthread_mutex_lock(&queue->lock);
+	failed = queue->failed;
+	pthread_mutex_unlock(&queue->lock);
+	return failed;
+}
 
-		fprintf(output, "Exercise %i\n", i);
-		fprintf(output, "Date: ");
-		_axn500_print_date(&e->date);
-		fprintf(output, "\n");
-		fprintf(output, "Start time: %i:%i:%i", e->start_time.hour,
-			e->start_time.minute, e->start_time.second);
-		fprintf(output, "\n");
-		fprintf(output, "Duration: %ih%imin%is", e->duration.hour,
-			e->duration.minute, e->duration.second);
-		fprintf(output, "\n");
-		for (j = 0; j < 3; j++) {
-			fprintf(output, "Limit %i (lower/upper): ", j);
-			_axn500_print_limit(&e->limits[j]);
-			fprintf(output, "\n");
-		}
-		fprintf(output, "KCal: %hi\n", e->kcal);
-		fprintf(output, "Markers: %i\n", e->num_markers);
-		fprintf(output, "Maximum HR: %i\n", e->max_hr);
-		fprintf(output, "Average HR: %i\n", e->avg_hr);
-		fprintf(output, "Minimum altitude: %i\n", e->min_alt);
-		fprintf(output, "Maximum altitude: %i\n", e->max_alt);
-		fprintf(output, "Data:\n");
-		for (j = 0; j < e->entries; j++)
-			fprintf(output, "%i\t%i\n", e->data[j].hr, e->data[j].altitude);
-	}
+static int ingest_wanted(const char *name, int isdir)
+{
+	return !isdir && name[0] != '.';
 }
 
-static int get_all_exercises(FILE *output, int wait, const char *save)
+/* not all filesystems fill d_type */
+static int ingest_isdir(DIR *dir, struct dirent *d)
 {
-	int rc, fd = axn500_init(), bytes;
-	struct axn500 info;
-	char *ex;
-	unsigned char num_ex;
+	struct stat st;
 
-	if (fd < 0) {
-		fprintf(stderr, "Unable to initialize AXN500\n");
+	if (d->d_type != DT_UNKNOWN)
+		return d->d_type == DT_DIR;
+	if (fstatat(dirfd(dir), d->d_name, &st, AT_SYMLINK_NOFOLLOW))
+		return 0;
+	return S_ISDIR(st.st_mode);
+}
+
+static int ingest(const char *spool)
+{
+	struct axn500_checkpoint ckpt;
+	struct ingest_queue queue;
+	struct inotify_event *event;
+	struct pollfd pfd;
+	struct dirent *d;
+	pthread_t *threads;
+	char buff[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	DIR *dir;
+	char *name;
+	int fd, i, n, lock, nthreads, rc = 1;
+
+	if (archive_file == NULL) {
+		fprintf(stderr, "An archive is needed (-z)\n");
 		return 1;
 	}
-	rc = axn500_connect(fd, wait);
-	if (rc)
-		return rc;
+	memset(&queue, 0, sizeof(queue));
+	queue.spool = spool;
+	if (axn500_mkdir(spool, "done") || axn500_mkdir(spool, "failed"))
+		return 1;
+	/* each commit loads it again, this rolls back and checks it early */
+	lock = axn500_archive_lock(archive_file);
+	if (lock < 0)
+		return 1;
+	n = axn500_checkpoint_load(archive_file, &ckpt);
+	axn500_checkpoint_free(&ckpt);
+	close(lock);
+	if (n)
+		return 1;
 
-	ex = axn500_get_exercise(fd, &num_ex, &bytes, &info);
-	if (ex == NULL) {
-		fprintf(stderr, "Unable to get exercises from AXN500\n");
+	fd = inotify_init1(IN_CLOEXEC);
+	if (fd < 0 || inotify_add_watch(fd, spool, IN_CLOSE_WRITE | IN_MOVED_TO |
+					IN_ONLYDIR) < 0) {
+		perror("Unable to watch the spool directory");
 		return 1;
 	}
 
-	printf("Found %i exercises\n", num_ex);
-	if (num_ex == 0)
-		return 0;
-
-	if (save) {
-		int fd = open(save, O_CREAT | O_TRUNC | O_RDWR,
-				S_IRUSR | S_IWUSR);
-		if (fd < 0) {
-			perror("Error creating file");
-			return 1;
+	/* the pool is the parallelism, each dump is decoded by its worker */
+	nthreads = axn500_threads;
+	if (nthreads <= 0)
+		nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	axn500_threads = 1;
+	pthread_mutex_init(&queue.commit, NULL);
+	pthread_mutex_init(&queue.lock, NULL);
+	pthread_cond_init(&queue.more, NULL);
+	pthread_cond_init(&queue.room, NULL);
+	threads = malloc(sizeof(pthread_t) * nthreads);
+	for (i = 0; threads && i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, ingest_worker, &queue))
+			break;
+	nthreads = threads? i:0;
+	if (nthreads == 0) {
+		fprintf(stderr, "Unable to start the ingest workers\n");
+		goto out;
+	}
+	dprintf("Ingesting %s with %i workers\n", spool, nthreads);
+	catch_stop_signals();
+
+	/* whatever was dropped while we weren't watching */
+	dir = opendir(spool);
+	if (dir == NULL) {
+		perror(spool);
+		goto out;
+	}
+	while (!stop_requested && (d = readdir(dir)))
+		if (ingest_wanted(d->d_name, ingest_isdir(dir, d)))
+			ingest_push(&queue, d->d_name);
+	closedir(dir);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!ingest_failed(&queue)) {
+		if (stop_requested) {
+			rc = 0;
+			break;
 		}
-		write(fd, &num_ex, 1);
-		/* FIXME - not endian safe */
-		write(fd, &bytes, 4);
-		dprintf("Writing %i bytes\n", bytes);
-		write(fd, ex, bytes);
-		close(fd);
-		return 0;
+		if (poll(&pfd, 1, 1000) <= 0)
+			continue;
+		n = read(fd, buff, sizeof(buff));
+		if (n <= 0) {
+			perror("Error reading inotify events");
+			goto out;
+		}
+		for (i = 0; i < n; i += sizeof(*event) + event->len) {
+			event = (struct inotify_event *)&buff[i];
+			if (event->mask & IN_Q_OVERFLOW)
+				fprintf(stderr, "Missed some spool events, restart "
+					"to pick up the dumps left behind\n");
+			else if (event->len &&
+				 ingest_wanted(event->name, event->mask & IN_ISDIR))
+				ingest_push(&queue, event->name);
+		}
+	}
+out:
+	pthread_mutex_lock(&queue.lock);
+	queue.stop = 1;
+	pthread_cond_broadcast(&queue.more);
+	pthread_mutex_unlock(&queue.lock);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	while (queue.num) {
+		name = queue.names[queue.first];
+		queue.first = (queue.first + 1) % INGEST_QUEUE;
+		queue.num--;
+		free(name);
 	}
+	close(fd);
+	return rc;
+}
 
-	rc = axn500_parse_exercises(ex, num_ex, bytes, &info);
-	if (rc) {
-		fprintf(stderr, "Unable to parse exercise data from AXN500\n");
+/*
+ * Compaction of a directory of dumps into the archive
+ */
+static size_t compact_budget = 64 << 20;
+
+/* <n>[k|M|G] bytes */
+static int set_budget(const char *arg)
+{
+	unsigned long long n;
+	char *end;
+
+	n = strtoull(arg, &end, 10);
+	switch (*end) {
+	case 'G':
+		n <<= 10;
+		/* fall through */
+	case 'M':
+		n <<= 10;
+		/* fall through */
+	case 'k':
+		n <<= 10;
+		end++;
+	}
+	if (*end || n < 4096 || n > SIZE_MAX / 2) {
+		fprintf(stderr, "Invalid memory budget: %s\n", arg);
 		return 1;
 	}
-	free(ex);
+	compact_budget = n;
+	return 0;
+}
 
-	print_exercises(&info, output);
+/* the exercises taken from a dump are known to a later ingest */
+static int compact_hashes(struct axn500_checkpoint *ckpt, char *raw,
+			  struct axn500 *info)
+{
+	struct axn500_exercise *e;
+	unsigned long long hash;
+	int ex;
 
+	for (ex = 0; ex < info->exercises.num; ex++) {
+		e = &info->exercises.exercise[ex];
+		if (e->start == 0 || e->raw_size == 0 ||
+		    (e->status != AXN500_EX_OK && e->status != AXN500_EX_TRUNCATED))
+			continue;
+		hash = axn500_hash((unsigned char *)raw + e->raw_offset,
+				   e->raw_size);
+		if (!axn500_checkpoint_has(ckpt, hash) &&
+		    axn500_checkpoint_add(ckpt, hash)) {
+			fprintf(stderr, "Not enough memory\n");
+			return 1;
+		}
+	}
 	return 0;
 }
 
-static int parse_exercises(const char *filename, FILE *output)
+/*
+ * Rewrites the archive (-z) with the exercises of all the dumps in 'spool'
+ * merged in, sorted and without copies. Not to be run while an ingest
+ * (-I) is adding to the same archive.
+ */
+static int compact_archive(const char *spool)
 {
-	int fd = open(filename, O_RDONLY), rc;
+	struct axn500_checkpoint ckpt;
+	struct axn500_compact c;
 	struct axn500 info;
-	char *ex;
+	struct dirent *d;
+	struct tm ref;
+	time_t mtime;
 	unsigned char num_ex;
 	unsigned int bytes;
+	char *path, *ex;
+	int lock, ckpt_used, dumps = 0, failed = 0, rc = 1;
+	DIR *dir;
 
-	if (fd < 0) {
-		perror("Unable to open file");
+	if (archive_file == NULL) {
+		fprintf(stderr, "An archive is needed (-z)\n");
 		return 1;
 	}
-
-	if (read(fd, &num_ex, 1) != 1) {
-		perror("Unable to read number of exercises");
-		close(fd);
+	/* nothing else commits to the archive while it's rewritten */
+	lock = axn500_archive_lock(archive_file);
+	if (lock < 0)
 		return 1;
+	memset(&ckpt, 0, sizeof(ckpt));
+	axn500_compact_init(&c, archive_file, compact_budget);
+
+	/* an ingest checkpoint has to follow, and recovers the archive first */
+	ckpt_used = axn500_checkpoint_exists(archive_file);
+	if (ckpt_used && axn500_checkpoint_load(archive_file, &ckpt))
+		goto out;
+
+	if (access(archive_file, F_OK) == 0 &&
+	    axn500_compact_archive(&c, archive_file))
+		goto out;
+
+	dir = opendir(spool);
+	if (dir == NULL) {
+		perror(spool);
+		goto out;
 	}
-	if (read(fd, &bytes, sizeof(bytes)) != sizeof(bytes)) {
-		perror("Unable to read the exercise size");
-		close(fd);
+	while ((d = readdir(dir))) {
+		if (!ingest_wanted(d->d_name, ingest_isdir(dir, d)))
+			continue;
+		path = axn500_path(spool, "%s", d->d_name);
+		if (path == NULL) {
+			fprintf(stderr, "Not enough memory\n");
+			break;
+		}
+		ex = load_dump(path, &num_ex, &bytes, &mtime);
+		free(path);
+		if (ex == NULL || axn500_parse_exercises(ex, num_ex, bytes, &info, 0)) {
+			fprintf(stderr, "Unable to parse %s, skipping it\n",
+				d->d_name);
+			free(ex);
+			failed++;
+			continue;
+		}
+		localtime_r(&mtime, &ref);
+		axn500_date_exercises(&info, &ref, watch_id);
+		rc = axn500_compact_exercises(&c, &info) ||
+		     (ckpt_used && compact_hashes(&ckpt, ex, &info));
+		axn500_print_parse_errors(&info, stderr);
+		axn500_free_exercises(&info);
+		free(ex);
+		if (rc)
+			break;
+		dumps++;
+		rc = 1;
+	}
+	closedir(dir);
+	if (d || axn500_compact_finish(&c, ckpt_used? &ckpt:NULL))
+		goto out;
+
+	printf("%i exercises read from the archive and %i from %i dumps: "
+	       "%i kept, %i copies dropped\n", c.archived,
+	       c.records - c.archived, dumps, c.kept, c.duplicates);
+	if (failed)
+		printf("%i dumps couldn't be parsed\n", failed);
+	dprintf("%i runs, %i merges\n", c.spilled, c.merges);
+	rc = 0;
+out:
+	axn500_compact_free(&c);
+	axn500_checkpoint_free(&ckpt);
+	close(lock);
+	return rc;
+}
+
+/*
+ * Broker daemon
+ *
+ * Serves the broker protocol to any number of clients over one watch
+ * connection. Identical requests, queued or on the wire, are merged and
+ * the reply goes to all the clients waiting for it. The rest are sent one
+ * at a time, picking next the request of the client that has been served
+ * the least, so a client asking for a lot can't starve the others.
+ */
+#define BROKER_CLIENTS	64
+
+struct broker_client {
+	int fd;
+	int pending;		/* requests waiting for a reply */
+	int dead;		/* closed, to free once pending is 0 */
+	unsigned int served;
+	unsigned char req[AXN500_BROKER_REQ_SIZE];
+	int req_len;		/* of the request being received */
+	struct broker_client *next;
+};
+
+struct broker_job {
+	int type;
+	int cmd;
+	int running;
+	struct broker_client *owner;
+	struct broker_client **waiters;
+	int num_waiters;
+	struct broker_job *next;
+};
+
+struct broker {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	struct broker_client *clients;
+	int num_clients;
+	struct broker_job *jobs;
+	int wait;
+	int watch;		/* connection to the watch, -1 if none */
+	int stop;		/* the worker returns after the running job */
+};
+
+static void broker_drop_client(struct broker *b, struct broker_client *client)
+{
+	struct broker_client **p;
+
+	for (p = &b->clients; *p != client; p = &(*p)->next)
+		;
+	*p = client->next;
+	b->num_clients--;
+	close(client->fd);
+	free(client);
+}
+
+/* called with the lock held */
+static int broker_add_request(struct broker *b, struct broker_client *client,
+			      int type, int cmd)
+{
+	struct broker_client **tmp;
+	struct broker_job *job, **p;
+
+	for (p = &b->jobs; *p; p = &(*p)->next)
+		if ((*p)->type == type && (*p)->cmd == cmd)
+			break;
+	job = *p;
+	if (job == NULL) {
+		job = calloc(1, sizeof(*job));
+		if (job == NULL)
+			return 1;
+		job->type = type;
+		job->cmd = cmd;
+		job->owner = client;
+		*p = job;
+		pthread_cond_signal(&b->work);
+	} else
+		dprintf("Request %i/%i merged with %i others\n", type, cmd,
+			job->num_waiters);
+
+	tmp = realloc(job->waiters, sizeof(*tmp) * (job->num_waiters + 1));
+	if (tmp == NULL)
 		return 1;
+	job->waiters = tmp;
+	job->waiters[job->num_waiters++] = client;
+	client->pending++;
+	return 0;
+}
+
+/* called with the lock held */
+static struct broker_job *broker_next_job(struct broker *b)
+{
+	struct broker_job *job, *best = NULL;
+
+	for (job = b->jobs; job; job = job->next)
+		if (!job->running &&
+		    (best == NULL || job->owner->served < best->owner->served))
+			best = job;
+	return best;
+}
+
+/* talks to the watch, returns the reply data or NULL on errors */
+static char *broker_run(struct broker *b, struct broker_job *job, int *len)
+{
+	struct axn500 info;
+	unsigned char num_ex;
+	char *data, *ex;
+	int bytes;
+
+	if (b->watch < 0) {
+		b->watch = axn500_init();
+		if (b->watch < 0)
+			return NULL;
+		if (axn500_connect(b->watch, b->wait))
+			goto error;
 	}
-	if (num_ex == 0 || num_ex > 50) {
-		fprintf(stderr, "Invalid number of exercises (%i). Corrupt file?\n", num_ex);
-		close(fd);
+
+	if (job->type == AXN500_BROKER_GET) {
+		if (axn500_send_cmd(b->watch, job->cmd))
+			goto error;
+		*len = axn500_read_reply(b->watch, axn500_commands[job->cmd].datasize,
+					 AXN500_REPLY_TIMEOUT);
+		if (*len < 0)
+			goto error;
+		data = malloc(*len);
+		if (data)
+			memcpy(data, axn500_link.rx, *len);
+		return data;
+	}
+
+	ex = axn500_get_exercise(b->watch, &num_ex, &bytes, &info);
+	if (ex == NULL)
+		goto error;
+	data = malloc(bytes + 1);
+	if (data) {
+		data[0] = num_ex;
+		memcpy(data + 1, ex, bytes);
+		*len = bytes + 1;
+	}
+	free(ex);
+	return data;
+
+error:
+	/* start over with a new connection */
+	close(b->watch);
+	b->watch = -1;
+	return NULL;
+}
+
+static void *broker_worker(void *arg)
+{
+	struct broker *b = arg;
+	struct broker_client *client;
+	struct broker_job *job, **p;
+	unsigned char hdr[AXN500_BROKER_HDR_SIZE];
+	char *data;
+	int i, len = 0;
+
+	pthread_mutex_lock(&b->lock);
+	while (1) {
+		while (!b->stop && (job = broker_next_job(b)) == NULL)
+			pthread_cond_wait(&b->work, &b->lock);
+		if (b->stop)
+			break;
+		job->running = 1;
+		pthread_mutex_unlock(&b->lock);
+
+		data = broker_run(b, job, &len);
+		hdr[0] = (data == NULL);
+		axn500_put32(hdr + 1, data? len:0);
+
+		pthread_mutex_lock(&b->lock);
+		for (p = &b->jobs; *p != job; p = &(*p)->next)
+			;
+		*p = job->next;
+		job->owner->served++;
+		for (i = 0; i < job->num_waiters; i++) {
+			client = job->waiters[i];
+			if (!client->dead &&
+			    (send(client->fd, hdr, sizeof(hdr), MSG_NOSIGNAL) != sizeof(hdr) ||
+			     (data && send(client->fd, data, len, MSG_NOSIGNAL) != len)))
+				shutdown(client->fd, SHUT_RDWR);
+			if (--client->pending == 0 && client->dead)
+				broker_drop_client(b, client);
+		}
+		free(job->waiters);
+		free(job);
+		free(data);
+	}
+	pthread_mutex_unlock(&b->lock);
+	return NULL;
+}
+
+static int broker(const char *path, int wait)
+{
+	struct sockaddr_un addr;
+	struct pollfd pfd[BROKER_CLIENTS + 1];
+	struct broker_client *clients[BROKER_CLIENTS + 1], *client;
+	unsigned char *req;
+	struct broker b;
+	pthread_t thread;
+	int fd, i, n, ok;
+	ssize_t got;
+
+	memset(&b, 0, sizeof(b));
+	b.wait = wait;
+	b.watch = -1;
+	pthread_mutex_init(&b.lock, NULL);
+	pthread_cond_init(&b.work, NULL);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		perror("Unable to create socket");
 		return 1;
 	}
-	if (bytes <= 3 || bytes > 50000) {
-		fprintf(stderr, "Invalid exercise size (%i). Corrupt file?\n", bytes);
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 16)) {
+		perror("Unable to listen on the broker socket");
 		close(fd);
 		return 1;
 	}
-	ex = malloc(bytes);
-	if (ex == NULL) {
-		perror("Unable to allocate memory");
+	if (pthread_create(&thread, NULL, broker_worker, &b)) {
+		fprintf(stderr, "Unable to start the broker\n");
 		close(fd);
 		return 1;
 	}
-	rc = read(fd, ex, bytes);
-	if (rc != bytes) {
-		if (rc < 0) {
-			perror("Unable to read data file");
-			free(ex);
-			close(fd);
-			return 1;
-		} else {
-			fprintf(stderr, "Short read while reading data file: "
-				"wanted %i, got %i\n", bytes, rc);
-			free(ex);
-			close(fd);
-			return 1;
+	catch_stop_signals();
+
+	while (!stop_requested) {
+		pfd[0].fd = fd;
+		pfd[0].events = POLLIN;
+		n = 1;
+		pthread_mutex_lock(&b.lock);
+		for (client = b.clients; client && n <= BROKER_CLIENTS; client = client->next) {
+			if (client->dead)
+				continue;
+			clients[n] = client;
+			pfd[n].fd = client->fd;
+			pfd[n++].events = POLLIN;
+		}
+		pthread_mutex_unlock(&b.lock);
+
+		if (poll(pfd, n, 1000) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		if (pfd[0].revents & POLLIN) {
+			client = calloc(1, sizeof(*client));
+			if (client)
+				client->fd = accept(fd, NULL, NULL);
+			pthread_mutex_lock(&b.lock);
+			if (client && client->fd >= 0 &&
+			    b.num_clients == BROKER_CLIENTS) {
+				/* no room to poll it, the client sees EOF */
+				dprintf("Refusing a client, %i connected\n",
+					b.num_clients);
+				close(client->fd);
+				client->fd = -1;
+			}
+			if (client && client->fd >= 0) {
+				client->next = b.clients;
+				b.clients = client;
+				b.num_clients++;
+			} else
+				free(client);
+			pthread_mutex_unlock(&b.lock);
+		}
+
+		for (i = 1; i < n; i++) {
+			if (!pfd[i].revents)
+				continue;
+			client = clients[i];
+			/* whatever has arrived, a slow client can't hold up the rest */
+			req = client->req;
+			got = recv(client->fd, req + client->req_len,
+				   sizeof(client->req) - client->req_len,
+				   MSG_DONTWAIT);
+			if (got < 0 && (errno == EAGAIN || errno == EINTR))
+				continue;
+			if (got > 0) {
+				client->req_len += got;
+				if (client->req_len < sizeof(client->req))
+					continue;
+				client->req_len = 0;
+			}
+			/* only reads, nothing a client sends writes to the watch */
+			ok = got > 0 &&
+			     ((req[0] == AXN500_BROKER_GET &&
+			       req[1] < sizeof(axn500_commands) / sizeof(axn500_commands[0]) &&
+			       axn500_commands[req[1]].parser) ||
+			      (req[0] == AXN500_BROKER_EXERCISES && req[1] == 0));
+
+			pthread_mutex_lock(&b.lock);
+			if (!ok || broker_add_request(&b, client, req[0], req[1])) {
+				client->dead = 1;
+				if (client->pending == 0)
+					broker_drop_client(&b, client);
+			}
+			pthread_mutex_unlock(&b.lock);
 		}
 	}
+
+	pthread_mutex_lock(&b.lock);
+	b.stop = 1;
+	pthread_cond_signal(&b.work);
+	pthread_mutex_unlock(&b.lock);
+	pthread_join(thread, NULL);
+	while (b.clients)
+		broker_drop_client(&b, b.clients);
+	if (b.watch >= 0)
+		close(b.watch);
 	close(fd);
+	unlink(path);
+	return !stop_requested;
+}
 
-	rc = axn500_parse_exercises(ex, num_ex, bytes, &info);
-	if (rc) {
-		fprintf(stderr, "Unable to parse exercise data from AXN500\n");
-		free(ex);
-		return 1;
-	}
-	free(ex);
+#ifdef AXN500_TRACE
+static const char *trace_file;
+
+static void write_trace(void)
+{
+	axn500_trace_write(trace_file);
+}
+#endif
 
-	print_exercises(&info, output);
+static const char *phase_names[AXN500_PHASES] = {
+	[AXN500_PHASE_DISCOVER] = "discover",
+	[AXN500_PHASE_CONNECT] = "connect",
+	[AXN500_PHASE_FETCH] = "fetch",
+	[AXN500_PHASE_TRANSFER] = "transfer",
+	[AXN500_PHASE_PARSE] = "parse",
+	[AXN500_PHASE_OUTPUT] = "output",
+	[AXN500_PHASE_STORE] = "store",
+};
 
-	return 0;
+static const char *alloc_names[AXN500_ALLOCS] = {
+	[AXN500_ALLOC_DISCOVER] = "discover",
+	[AXN500_ALLOC_TRANSFER] = "transfer",
+	[AXN500_ALLOC_PARSE] = "parse",
+	[AXN500_ALLOC_ARENA] = "arena",
+};
+
+static void print_phase(const char *kind, const char *name,
+			struct axn500_phase_stats *stats)
+{
+	int i;
+
+	fprintf(stderr, "%s\t%s\t%llu\t%.3f", kind, name, stats->calls,
+		stats->ns / 1e6);
+	for (i = 0; i < AXN500_COUNTERS; i++)
+		if (axn500_profile.counter_fd[0] < 0)
+			fprintf(stderr, "\t-");
+		else
+			fprintf(stderr, "\t%llu", stats->counter[i]);
+	fprintf(stderr, "\n");
+}
+
+/*
+ * Tab separated, one line per phase, per command fetched and per
+ * allocating subsystem, after a header with the totals
+ */
+static void write_profile(void)
+{
+	struct axn500_phase_stats total;
+	struct rusage usage;
+	char name[16];
+	int i;
+
+	memset(&total, 0, sizeof(total));
+	total.calls = 1;
+	total.ns = axn500_now() - axn500_profile.start;
+	axn500_profile_read(total.counter);
+	getrusage(RUSAGE_SELF, &usage);
+
+	fprintf(stderr, "# profile, times in ms, max rss %li kB\n",
+		usage.ru_maxrss);
+	if (axn500_profile.counter_fd[0] < 0)
+		fprintf(stderr, "# no hardware counters: %s\n",
+			strerror(axn500_profile.counter_errno));
+	fprintf(stderr, "# phase\tname\tcalls\tms\tcycles\tinstructions\t"
+		"cache_misses\n");
+	print_phase("total", "run", &total);
+	for (i = 0; i < AXN500_PHASES; i++)
+		if (axn500_profile.phase[i].calls)
+			print_phase("phase", phase_names[i],
+				    &axn500_profile.phase[i]);
+	for (i = 0; i < AXN500_PROFILE_CMDS; i++) {
+		if (axn500_profile.cmd[i].calls == 0)
+			continue;
+		sprintf(name, "%#x", axn500_cmd_code(i));
+		print_phase("cmd", name, &axn500_profile.cmd[i]);
+	}
+	fprintf(stderr, "# alloc\tsubsystem\tcount\tbytes\n");
+	for (i = 0; i < AXN500_ALLOCS; i++)
+		fprintf(stderr, "alloc\t%s\t%llu\t%llu\n", alloc_names[i],
+			axn500_profile.allocs[i], axn500_profile.bytes[i]);
 }
 
 static void show_help(FILE *output)
@@ -1571,40 +9513,196 @@ static void show_help(FILE *output)
 	fprintf(output, "\t-g <value>\tget a value from the watch. use 'help' for the list\n");
 	fprintf(output, "\t\t\tmultiple values can be get at once using comma separated list\n");
 	fprintf(output, "\t-e\t\tget all exercises\n");
+	fprintf(output, "\t-C\t\tset the watch date and time from this computer and\n");
+	fprintf(output, "\t\t\tprint how far off it is afterwards (make SET_TIME=1,\n");
+	fprintf(output, "\t\t\tthe write command is unconfirmed on a watch)\n");
 
 	fprintf(output, "\n\t-s <file>\tget all exercises and save in the specified file\n");
 	fprintf(output, "\t-p <file>\tparse a raw exercises file and print the result\n");
+	fprintf(output, "\t-L <file>\tlist the exercises of a raw exercises file without\n");
+	fprintf(output, "\t\t\tparsing all of it\n");
+	fprintf(output, "\t-u <file>\tprint the exercises stored in a compressed archive\n");
+	fprintf(output, "\t\t\tor in the derived data of a store (-S)\n");
+	fprintf(output, "\t-R <dir>\tdecode again the exercises of a store whose derived\n");
+	fprintf(output, "\t\t\tdata is from a different version of the parser\n");
+	fprintf(output, "\t-D <file>\tprint a trace file\n");
+	fprintf(output, "\t-t <query>\tprint the samples in the archive (-z) matching the query:\n");
+	fprintf(output, "\t\t\twatch=<address>,from=<date>,to=<date>,column=<hr|alt>\n");
+	fprintf(output, "\t\t\tdates are YYYY-MM-DD[ HH:MM:SS]\n");
+	fprintf(output, "\t-W <period>\tprint the totals of the archive (-z) by day, week or\n");
+	fprintf(output, "\t\t\tmonth: watch, period, exercises, duration, kcal,\n");
+	fprintf(output, "\t\t\tminutes within each limit and training load,\n");
+	fprintf(output, "\t\t\toptionally followed by the watch, from and to of -t\n");
+	fprintf(output, "\t-k <date>\tlist the exercises of the archive (-z) most like the\n");
+	fprintf(output, "\t\t\tone started at <date>, optionally followed by\n");
+	fprintf(output, "\t\t\t,watch=<address>, ,k=<results> (5) and ,dtw to compare\n");
+	fprintf(output, "\t\t\tthe curves with dynamic time warping\n");
+	fprintf(output, "\t-B <socket>\tshare the watch with the clients (-b) of this socket\n");
+	fprintf(output, "\t-I <dir>\twatch a spool directory and add the dumps written\n");
+	fprintf(output, "\t\t\tthere to the archive (-z), skipping known exercises\n");
+	fprintf(output, "\t-m <dir>\trewrite the archive (-z) with the exercises of all the\n");
+	fprintf(output, "\t\t\tdumps in <dir>, sorted by watch and start time and\n");
+	fprintf(output, "\t\t\twithout copies, in the memory given by -M\n");
+	fprintf(output, "\t-q <query>\tlist the exercises in the archive (-z) matching all the\n");
+	fprintf(output, "\t\t\tcomma separated <field><op><value>, op is <, <=, =, >=, >\n");
+	fprintf(output, "\t\t\tfields: date, start (H:MM[:SS]), duration (H:MM[:SS]),\n");
+	fprintf(output, "\t\t\tmax_hr, avg_hr, kcal, min_alt, max_alt, watch, and\n");
+	fprintf(output, "\t\t\thr and alt, matching exercises with any such sample\n");
 
 	fprintf(output, "\nOptions:\n");
 	fprintf(output, "\t-d\t\tenable debug\n");
+	fprintf(output, "\t-T <file>\trecord a trace in the specified file, written at exit\n");
+	fprintf(output, "\t\t\t(-I and -B exit on SIGTERM or SIGINT)\n");
+	fprintf(output, "\t--profile\tprint the time, hardware counters and allocations\n");
+	fprintf(output, "\t\t\tof each phase to stderr at exit (-I and -B exit on\n");
+	fprintf(output, "\t\t\tSIGTERM or SIGINT)\n");
 	fprintf(output, "\t-n\t\tdon't wait for the watch to be in range\n");
+	fprintf(output, "\t-b <socket>\ttalk to the watch through a broker (-B)\n");
+	fprintf(output, "\t-j <n>\t\tnumber of threads used to decode exercises\n");
+	fprintf(output, "\t-r\t\tskip corrupt exercises instead of giving up\n");
+	fprintf(output, "\t-c <settings>\tclean the samples: 'on' or some of gap=<samples>,\n");
+	fprintf(output, "\t\t\tspike=<bpm>,jump=<m>,hysteresis=<m> (12, 25, 30, 2),\n");
+	fprintf(output, "\t\t\t0 turns a filter off\n");
+	fprintf(output, "\t\t\tthe data gets a third column with what was done:\n");
+	fprintf(output, "\t\t\t1 HR filled, 2 no HR, 4 HR spike, 8 altitude spike,\n");
+	fprintf(output, "\t\t\t0x10 altitude held\n");
+	fprintf(output, "\t-P <n>\t\tsend up to <n> commands before waiting for the\n");
+	fprintf(output, "\t\t\treplies when fetching all settings\n");
+	fprintf(output, "\t-z <file>\tappend the exercises to a compressed archive instead\n");
+	fprintf(output, "\t\t\tof printing them (-e and -p)\n");
+	fprintf(output, "\t-S <dir>\tkeep the raw exercises in a deduplicating store too\n");
+	fprintf(output, "\t-M <size>\tmemory used to compact (-m), in bytes or with a\n");
+	fprintf(output, "\t\t\tk, M or G suffix (64M)\n");
+	fprintf(output, "\t-A <windows>\tprint the best average HR and ascent over each of the\n");
+	fprintf(output, "\t\t\tcomma separated windows (<n> samples, <n>s or <n>m) and\n");
+	fprintf(output, "\t\t\tthe recoveries after the intervals, instead of the data\n");
+	fprintf(output, "\t-x <exports>\texport the exercises instead of printing them, in a\n");
+	fprintf(output, "\t\t\tcomma separated list of <format>[=<file>], where the\n");
+	fprintf(output, "\t\t\tformat is csv, jsonl, tcx or npy, also after -z appends\n");
+	fprintf(output, "\t-i <address>\twatch address stored with the exercises\n");
+	fprintf(output, "\t-y <points>\tprint at most about <points> lines of data per\n");
+	fprintf(output, "\t\t\texercise, summarizing the samples\n");
 
 	fprintf(output, "\n\t-h\t\tprint this message\n");
 }
 
-static char *options = "andeg:p:s:h";
+#define OPT_PROFILE	0x100
+
+static char *options = "A:ab:B:c:CdnD:eg:i:I:j:k:L:m:M:p:P:q:rR:s:S:t:T:u:W:x:y:z:h";
+static struct option long_options[] = {
+	{ "profile", no_argument, NULL, OPT_PROFILE },
+	{ NULL, 0, NULL, 0 },
+};
+
 int main(int argc, char *argv[])
 {
 	int opt, wait = 1;
 
-	while ((opt = getopt(argc, argv, options)) != -1) {
+	while ((opt = getopt_long(argc, argv, options, long_options,
+				  NULL)) != -1) {
 		switch(opt) {
+			case OPT_PROFILE:
+				axn500_profile_start();
+				atexit(write_profile);
+				break;
 			case 'a':
 				return show_all(wait);
 			case 'g':
 				return get_value(optarg, wait);
+			case 'C':
+#ifdef AXN500_SET_TIME
+				return sync_clock(wait);
+#else
+				fprintf(stderr, "Setting the clock not built in, its "
+					"command is unconfirmed on a watch "
+					"(make SET_TIME=1)\n");
+				exit(1);
+#endif
 			case 'd':
 				axn500_set_debug(1);
 				break;
+			case 'T':
+#ifdef AXN500_TRACE
+				trace_file = optarg;
+				atexit(write_trace);
+				break;
+#else
+				fprintf(stderr, "Tracing support not built in "
+					"(make TRACE=1)\n");
+				exit(1);
+#endif
+			case 'D':
+				return axn500_trace_print(optarg, stdout);
 			case 'n':
 				wait = 0;
 				break;
+			case 'j':
+				axn500_threads = atoi(optarg);
+				break;
+			case 'r':
+				axn500_recover = 1;
+				break;
+			case 'c':
+				if (set_cleaning(optarg))
+					return 1;
+				break;
+			case 'A':
+				if (set_analysis(optarg))
+					return 1;
+				break;
+			case 'x':
+				if (set_exports(optarg))
+					return 1;
+				break;
+			case 'P':
+				axn500_pipeline = atoi(optarg);
+				break;
+			case 'z':
+				archive_file = optarg;
+				break;
+			case 'S':
+				store_dir = optarg;
+				break;
+			case 'i':
+				watch_id = strtoul(optarg, NULL, 0);
+				watch_set = 1;
+				break;
+			case 'y':
+				plot_points = atoi(optarg);
+				break;
 			case 'e':
 				return get_all_exercises(stdout, wait, NULL);
 			case 's':
 				return get_all_exercises(stdout, wait, optarg);
 			case 'p':
 				return parse_exercises(optarg, stdout);
+			case 'L':
+				return list_exercises(optarg, stdout);
+			case 'u':
+				return show_archive(optarg, stdout);
+			case 't':
+				return query_samples(optarg, stdout);
+			case 'q':
+				return query_exercises(optarg, stdout);
+			case 'k':
+				return similar_exercises(optarg, stdout);
+			case 'W':
+				return show_rollups(optarg, stdout);
+			case 'I':
+				return ingest(optarg);
+			case 'm':
+				return compact_archive(optarg);
+			case 'M':
+				if (set_budget(optarg))
+					return 1;
+				break;
+			case 'R':
+				return axn500_store_reprocess(optarg);
+			case 'b':
+				axn500_broker = optarg;
+				break;
+			case 'B':
+				return broker(optarg, wait);
 			case 'h':
 				show_help(stdout);
 				exit(0);